@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "db.h"
+#include "hist.h"
+#include "opstats.h"
+#include "lockprof.h"
+#include "qcache.h"
+
+/*
+ * Benchmark harness.  Each bench_<backend> binary is linked straight against
+ * one db_*.o and replays workload scripts (the same command files the E
+ * clients read) through interpret_command() from several threads at once,
+ * every thread running the whole script, as if that many file clients had
+ * been started on it.  Every run of a workload at a thread count happens in
+ * a fresh child process so each one starts from an empty DB.
+ *
+ * Output is CSV on stdout, one row per run:
+ *
+ *   backend,workload,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns
+ *
+ * where the latencies are per command.  Rows for one workload over the
+ * thread counts given are its scaling curve.  With -s, the run's per
+ * operation latencies (opstats_print()) and whatever the backend measures
+ * about itself (db_stats()) are printed to stderr after each run.  With -c
+ * queries go through the query cache (qcache.h).
+ */
+
+/* The workloads replayed when none are named on the command line */
+static char *default_workloads[] = {
+    "test1", "test2", "test3", "test4", "WindowScript", "caps", NULL
+};
+
+/* The thread counts used when -t is not given */
+#define DEFAULT_THREADS "1,2,4,8"
+
+/* A workload script loaded into memory, split into lines */
+typedef struct Workload {
+    char *name;
+    char *text;		/* The whole file */
+    char **lines;	/* Start of each line in text (not NUL terminated) */
+    int *lens;		/* Length of each line, newline included */
+    int nlines;
+    int maxlen;		/* Longest line */
+} workload_t;
+
+/* What each replaying thread is given and hands back */
+typedef struct Runner {
+    pthread_t thread;
+    workload_t *w;
+    int passes;
+    pthread_barrier_t *start;
+    unsigned long t0;	/* When this thread started and finished replaying */
+    unsigned long t1;
+    hist_t hist;
+} runner_t;
+
+/* Read the file name into a workload.  Returns 0 if it cannot be read. */
+static int workload_load(workload_t *w, char *dir, char *name) {
+    char path[1024];
+    FILE *f;
+    long size;
+    char *p, *end;
+    int cap = 1024;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!(f = fopen(path, "r"))) {
+	perror(path);
+	return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    w->name = name;
+    w->text = (char *) malloc(size + 1);
+    w->lines = (char **) malloc(cap * sizeof(char *));
+    w->lens = (int *) malloc(cap * sizeof(int));
+    if (!w->text || !w->lines || !w->lens ||
+	    fread(w->text, 1, size, f) != (size_t) size) {
+	fprintf(stderr, "could not load %s\n", path);
+	fclose(f);
+	return 0;
+    }
+    fclose(f);
+
+    w->nlines = 0;
+    w->maxlen = 0;
+    for (p = w->text, end = w->text + size; p < end; ) {
+	char *nl = (char *) memchr(p, '\n', end - p);
+	int len = nl ? (int) (nl - p + 1) : (int) (end - p);
+
+	if (w->nlines == cap) {
+	    cap *= 2;
+	    w->lines = (char **) realloc(w->lines, cap * sizeof(char *));
+	    w->lens = (int *) realloc(w->lens, cap * sizeof(int));
+	    if (!w->lines || !w->lens) {
+		fprintf(stderr, "out of memory loading %s\n", path);
+		return 0;
+	    }
+	}
+	w->lines[w->nlines] = p;
+	w->lens[w->nlines] = len;
+	w->nlines++;
+	if (len > w->maxlen) w->maxlen = len;
+	p += len;
+    }
+    return 1;
+}
+
+/* Thread body: replay the workload passes times, timing each command.  The
+ * line is copied out first since interpret_command() parses it in place. */
+static void *runner_run(void *arg) {
+    runner_t *r = (runner_t *) arg;
+    workload_t *w = r->w;
+    char *buf = (char *) malloc(w->maxlen + 1);
+    char response[256];
+    int pass, i;
+
+    hist_init(&r->hist);
+    pthread_barrier_wait(r->start);
+    r->t0 = hist_now();
+    for (pass = 0; pass < r->passes; pass++) {
+	for (i = 0; i < w->nlines; i++) {
+	    unsigned long t0;
+
+	    memcpy(buf, w->lines[i], w->lens[i]);
+	    buf[w->lens[i]] = '\0';
+	    response[0] = '\0';
+	    response[sizeof(response) - 1] = '\0';
+	    t0 = hist_now();
+	    interpret_command(buf, response, sizeof(response));
+	    hist_add(&r->hist, hist_now() - t0);
+	}
+    }
+    r->t1 = hist_now();
+    free(buf);
+    return NULL;
+}
+
+/* Replay w from nthreads threads at once and print its CSV row.  Run in a
+ * child process of its own. */
+static int bench_run(char *backend, workload_t *w, int nthreads, int passes,
+	int stats) {
+    runner_t *runners = (runner_t *) calloc(nthreads, sizeof(runner_t));
+    pthread_barrier_t start;
+    hist_t all;
+    unsigned long t0 = 0, t1 = 0;
+    double secs;
+    int i;
+
+    if (!runners) return 0;
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+	runners[i].w = w;
+	runners[i].passes = passes;
+	runners[i].start = &start;
+	if (pthread_create(&runners[i].thread, NULL, runner_run, &runners[i])) {
+	    fprintf(stderr, "could not start thread %d\n", i);
+	    exit(1);
+	}
+    }
+
+    /* The run lasts from the first thread starting to the last finishing */
+    pthread_barrier_wait(&start);
+    hist_init(&all);
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(runners[i].thread, NULL);
+	hist_merge(&all, &runners[i].hist);
+	if (i == 0 || runners[i].t0 < t0) t0 = runners[i].t0;
+	if (i == 0 || runners[i].t1 > t1) t1 = runners[i].t1;
+    }
+
+    secs = (t1 - t0) / 1e9;
+    printf("%s,%s,%d,%lu,%.6f,%.0f,%lu,%lu,%lu\n", backend, w->name, nthreads,
+	    all.n, secs, (secs > 0) ? all.n / secs : 0.0,
+	    hist_percentile(&all, 0.50), hist_percentile(&all, 0.99),
+	    hist_percentile(&all, 0.999));
+    fflush(stdout);
+    if (stats) {
+	fprintf(stderr, "%s,%s,%d:\n", backend, w->name, nthreads);
+	opstats_print(stderr);
+	db_stats(stderr);
+	lockprof_report(stderr, LOCKPROF_TOP);
+	qcache_print(stderr);
+    }
+    pthread_barrier_destroy(&start);
+    free(runners);
+    return 1;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-t threads,...] [-n passes] [-d dir] [-s] "
+	    "[-S shards] [-c] [workload ...]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    char *threads = DEFAULT_THREADS;
+    char *dir = ".";
+    char **names = default_workloads;
+    char *backend;
+    int passes = 1;
+    int stats = 0;
+    int opt;
+    int rc = 0;
+
+    /* bench_coarse reports itself as coarse, and so on */
+    backend = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+    if (strchr(backend, '_')) backend = strchr(backend, '_') + 1;
+
+    while ((opt = getopt(argc, argv, "t:n:d:sS:c")) != -1) {
+	switch (opt) {
+	case 't':
+	    threads = optarg;
+	    break;
+	case 'n':
+	    if ((passes = atoi(optarg)) < 1) usage(argv[0]);
+	    break;
+	case 'd':
+	    dir = optarg;
+	    break;
+	case 's':
+	    stats = 1;
+	    break;
+	case 'S':
+	    if (!db_init(atoi(optarg))) usage(argv[0]);
+	    break;
+	case 'c':
+	    qcache_enable(1);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind < argc) names = &argv[optind];
+
+    printf("backend,workload,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+    fflush(stdout);
+
+    for (; *names; names++) {
+	workload_t w;
+	char *list = strdup(threads);
+	char *tok, *save = NULL;
+
+	if (!workload_load(&w, dir, *names)) {
+	    rc = 1;
+	    free(list);
+	    continue;
+	}
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+	    int nthreads = atoi(tok);
+	    int status;
+	    pid_t pid;
+
+	    if (nthreads < 1) usage(argv[0]);
+	    if ((pid = fork()) == -1) {
+		perror("fork");
+		exit(1);
+	    }
+	    if (pid == 0) exit(bench_run(backend, &w, nthreads, passes, stats) ? 0 : 1);
+	    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+	    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s %s with %d threads failed\n", backend,
+			w.name, nthreads);
+		rc = 1;
+	    }
+	}
+	free(list);
+	free(w.text);
+	free(w.lines);
+	free(w.lens);
+    }
+    return rc;
+}
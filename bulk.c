@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "db.h"
+#include "words.h"
+#include "wal.h"
+#include "bulk.h"
+
+/*
+ * Running a file line by line costs a trip through the DB's locking for
+ * every line, queries and scans included, though f throws their answers
+ * away.  Here the file is instead mapped privately (so it can be tokenized in
+ * place) and cut into chunks at line boundaries, each parsed by a thread of
+ * its own.
+ *
+ * All that matters about the adds and deletes to one name is their net
+ * change (see net_t), and the net changes of consecutive runs of lines
+ * combine into the net change of the whole run (see net_combine()).  So each
+ * thread keeps a hash table of the net change of its chunk to each name, and
+ * the tables are then combined in file order.  Only the names left over are
+ * sorted, and an empty DB is filled from them with a single db_build(), which
+ * takes the DB's lock once.  Otherwise, or when the write-ahead log is on and
+ * each change has to be logged, they are applied with ordinary adds and
+ * removes.  Either way there are far fewer of them than lines in the file.
+ */
+
+/* The longest line f reads whole (its line buffer holds 256 bytes).  Longer
+ * lines are split up by f, so files holding them are left to it. */
+#define BULK_LINE_MAX 255
+/* Bytes of file worth starting a parsing thread for */
+#define BULK_CHUNK (1 << 20)
+#define BULK_THREADS 8
+
+/*
+ * What running a sequence of adds and deletes of one name comes to.  Once a
+ * delete has run the name is gone whatever was there before, and from then
+ * on it is known whether each add succeeds.  Before any delete an add can
+ * only succeed if the name was not there, and then only the first one can.
+ * So: if remove is set, the name is removed and then added with value if
+ * value is set; if not, it is added with value, which fails if it is there.
+ */
+typedef struct Net {
+    char *name;		/* NULL for an empty slot */
+    char *value;
+    int remove;
+    unsigned long key;	/* The name's first bytes, for sorting */
+} net_t;
+
+/* One chunk of the file and the net changes parsed from it */
+typedef struct Parser {
+    pthread_t thread;
+    char *start;	/* This chunk */
+    char *end;
+    int started;	/* Parsed by a thread of its own */
+    net_t *table;	/* Open addressing, nslots a power of 2 */
+    long nslots;
+    long n;
+    int ok;		/* Parsed, and nothing bulk loading cannot handle */
+    char tail[BULK_LINE_MAX + 1];	/* A last line with no newline */
+} parser_t;
+
+/* Net change a followed by net change b */
+static void net_combine(net_t *a, net_t *b) {
+    if (b->remove) {
+	a->remove = 1;
+	a->value = b->value;
+    } else if (!a->value) {
+	a->value = b->value;
+    }
+}
+
+/* FNV-1a */
+static unsigned long net_hash(char *name) {
+    unsigned long h = 2166136261u;
+
+    while (*name) h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h;
+}
+
+/* The slot for name in ps's table, claimed for it (with no change yet) if it
+ * is not there.  Returns NULL if the table cannot grow. */
+static net_t *net_find(parser_t *ps, char *name) {
+    unsigned long i;
+
+    if (2 * (ps->n + 1) > ps->nslots) {
+	long nslots = ps->nslots ? 2 * ps->nslots : 1024;
+	net_t *table = (net_t *) calloc(nslots, sizeof(net_t));
+	long j;
+
+	if (!table) return NULL;
+	for (j = 0; j < ps->nslots; j++) {
+	    if (!ps->table[j].name) continue;
+	    i = net_hash(ps->table[j].name) & (nslots - 1);
+	    while (table[i].name) i = (i + 1) & (nslots - 1);
+	    table[i] = ps->table[j];
+	}
+	free(ps->table);
+	ps->table = table;
+	ps->nslots = nslots;
+    }
+
+    i = net_hash(name) & (ps->nslots - 1);
+    while (ps->table[i].name) {
+	if (strcmp(ps->table[i].name, name) == 0) return &ps->table[i];
+	i = (i + 1) & (ps->nslots - 1);
+    }
+    ps->table[i].name = name;
+    ps->n++;
+    return &ps->table[i];
+}
+
+/* Fold net change c into ps's table, after whatever it holds for the name.
+ * Returns 0 if out of memory. */
+static int net_add(parser_t *ps, net_t *c) {
+    net_t *slot = net_find(ps, c->name);
+
+    if (!slot) return 0;
+    net_combine(slot, c);
+    return 1;
+}
+
+/* Thread body: parse a chunk the way interpret() would, keeping the adds and
+ * deletes (single or batched) and dropping the queries and scans.  Anything
+ * else, or a line f would split, clears ok. */
+static void *parser_run(void *arg) {
+    parser_t *ps = (parser_t *) arg;
+    char *p = ps->start;
+
+    ps->ok = 1;
+    while (p < ps->end) {
+	char *nl = (char *) memchr(p, '\n', ps->end - p);
+	size_t len = nl ? (size_t) (nl - p) : (size_t) (ps->end - p);
+	char *line = p;
+	word_t args[BULK_LINE_MAX / 2 + 1];
+	net_t c;
+	int n, i;
+
+	if (len > BULK_LINE_MAX) {
+	    ps->ok = 0;
+	    break;
+	}
+	if (nl) *nl = '\0';
+	else {
+	    /* The file may end exactly at the end of the mapping */
+	    memcpy(ps->tail, p, len);
+	    ps->tail[len] = '\0';
+	    line = ps->tail;
+	}
+
+	if (line[0] != '\0' && line[1] != '\0') {
+	    switch (line[0]) {
+	    case 'q':
+	    case 'Q':
+	    case 'r':
+	    case 'p':
+		break;
+	    case 'a':
+		if (tokenize(&line[1], args, 2) == 2) {
+		    c.name = args[0].p;
+		    c.value = args[1].p;
+		    c.remove = 0;
+		    if (!net_add(ps, &c)) ps->ok = 0;
+		}
+		break;
+	    case 'd':
+		if (tokenize(&line[1], args, 1) == 1) {
+		    c.name = args[0].p;
+		    c.value = NULL;
+		    c.remove = 1;
+		    if (!net_add(ps, &c)) ps->ok = 0;
+		}
+		break;
+	    case 'A':
+		/* A batch is its keys' changes in order, or nothing if it is
+		 * ill-formed */
+		n = tokenize(&line[1], args, BULK_LINE_MAX / 2 + 1);
+		for (i = 0; n % 2 == 0 && i < n && ps->ok; i += 2) {
+		    c.name = args[i].p;
+		    c.value = args[i + 1].p;
+		    c.remove = 0;
+		    if (!net_add(ps, &c)) ps->ok = 0;
+		}
+		break;
+	    case 'D':
+		n = tokenize(&line[1], args, BULK_LINE_MAX / 2 + 1);
+		for (i = 0; i < n && ps->ok; i++) {
+		    c.name = args[i].p;
+		    c.value = NULL;
+		    c.remove = 1;
+		    if (!net_add(ps, &c)) ps->ok = 0;
+		}
+		break;
+	    default:
+		ps->ok = 0;
+		break;
+	    }
+	    if (!ps->ok) break;
+	}
+	p += len + 1;
+    }
+    return NULL;
+}
+
+/* The first bytes of name (up to its terminator) as a number that orders
+ * the same way the names do, so most comparisons in the sort need not look
+ * at the names themselves */
+static unsigned long name_key(char *name) {
+    unsigned long key = 0;
+    int i;
+
+    for (i = 0; i < (int) sizeof(key); i++) {
+	key <<= 8;
+	if (*name) key |= (unsigned char) *name++;
+    }
+    return key;
+}
+
+/* Order net changes by name */
+static int by_name(const void *a, const void *b) {
+    const net_t *x = (const net_t *) a;
+    const net_t *y = (const net_t *) b;
+
+    if (x->key != y->key) return (x->key > y->key) - (x->key < y->key);
+    return strcmp(x->name, y->name);
+}
+
+/* Apply the net changes: build an empty DB in one go if nothing needs
+ * logging, and otherwise add and remove.  Returns 0 if out of memory. */
+static int apply(net_t *nets, long n, unsigned long *lsn) {
+    unsigned long l;
+    long i;
+
+    if (!wal_enabled()) {
+	char **names = (char **) malloc((n ? n : 1) * sizeof(char *));
+	char **values = (char **) malloc((n ? n : 1) * sizeof(char *));
+	long m = 0;
+	int built;
+
+	if (!names || !values) {
+	    free(names);
+	    free(values);
+	    return 0;
+	}
+	/* In an empty DB the removes do nothing */
+	for (i = 0; i < n; i++)
+	    if (nets[i].value) {
+		names[m] = nets[i].name;
+		values[m] = nets[i].value;
+		m++;
+	    }
+	built = db_build(names, values, (int) m);
+	free(names);
+	free(values);
+	if (built) return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+	if (nets[i].remove) {
+	    wal_remove(nets[i].name, &l);
+	    if (l > *lsn) *lsn = l;
+	}
+	if (nets[i].value) {
+	    wal_add(nets[i].name, nets[i].value, &l);
+	    if (l > *lsn) *lsn = l;
+	}
+    }
+    return 1;
+}
+
+int bulk_load(char *path, unsigned long *lsn) {
+    parser_t ps[BULK_THREADS];
+    net_t *nets = NULL;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long nnets = 0, j;
+    struct stat st;
+    char *map;
+    size_t size;
+    int nparsers, i, fd, ok = 1;
+
+    if ((fd = open(path, O_RDONLY)) == -1) return -1;
+    if (fstat(fd, &st) == -1) {
+	close(fd);
+	return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+	/* Pipes and the like are read the ordinary way */
+	close(fd);
+	return 0;
+    }
+    if ((size = st.st_size) == 0) {
+	close(fd);
+	return 1;
+    }
+    map = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    /* Cut the file into chunks that start at the beginning of a line */
+    nparsers = size / BULK_CHUNK + 1;
+    if (nparsers > ncpus) nparsers = ncpus;
+    if (nparsers > BULK_THREADS) nparsers = BULK_THREADS;
+    if (nparsers < 1) nparsers = 1;
+    memset(ps, 0, sizeof(ps));
+    for (i = 0; i < nparsers; i++) {
+	char *start = map + size * i / nparsers;
+
+	while (start > map && start < map + size && start[-1] != '\n') start++;
+	ps[i].start = start;
+	if (i > 0) ps[i - 1].end = start;
+    }
+    ps[nparsers - 1].end = map + size;
+
+    for (i = 1; i < nparsers; i++)
+	ps[i].started = !pthread_create(&ps[i].thread, NULL, parser_run, &ps[i]);
+    parser_run(&ps[0]);
+    for (i = 1; i < nparsers; i++) {
+	if (ps[i].started) pthread_join(ps[i].thread, NULL);
+	else parser_run(&ps[i]);
+    }
+    for (i = 0; i < nparsers; i++)
+	if (!ps[i].ok) ok = 0;
+
+    /* Combine the chunks' changes in file order into the first table, then
+     * pack it and sort it */
+    for (i = 1; ok && i < nparsers; i++)
+	for (j = 0; ok && j < ps[i].nslots; j++)
+	    if (ps[i].table[j].name && !net_add(&ps[0], &ps[i].table[j])) ok = 0;
+    if (ok && ps[0].n) {
+	nets = ps[0].table;
+	for (j = 0; j < ps[0].nslots; j++)
+	    if (nets[j].name) {
+		nets[nnets] = nets[j];
+		nets[nnets++].key = name_key(nets[j].name);
+	    }
+	qsort(nets, nnets, sizeof(net_t), by_name);
+    }
+
+    /* Nothing has touched the DB yet, so on failure f can start over */
+    if (ok) ok = apply(nets, nnets, lsn);
+
+    for (i = 0; i < nparsers; i++) free(ps[i].table);
+    munmap(map, size);
+    return ok;
+}
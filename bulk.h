@@ -0,0 +1,18 @@
+#ifndef BULK_H
+#define BULK_H
+/*
+ * Bulk loading for the f command.  bulk_load() runs a command file made only
+ * of adds, deletes, queries and scans (batched or not) without going through
+ * interpret_command() line by line: the file is mapped and parsed by several
+ * threads, the changes are sorted by name and boiled down to at most one
+ * remove and one add per name, and an empty DB is then built in one go with
+ * db_build().  The DB ends up exactly as running the file line by line would
+ * leave it.
+ *
+ * Returns 1 if the file was loaded, 0 if it holds something else (or lines
+ * too long for the f command) and must be run line by line, and -1 if it
+ * cannot be opened.  *lsn is raised to the last log record written, as in
+ * interpret_command().
+ */
+int bulk_load(char *, unsigned long *);
+#endif
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <pthread.h>
 
 typedef struct Node {
@@ -6,8 +7,91 @@ typedef struct Node {
 	struct Node *lchild;
 	struct Node *rchild;
 	pthread_rwlock_t mutex_node_lock;
+	int height;	/* AVL height of the subtree rooted here (leaf = 1) */
+	unsigned long version;	/* db_fine.c: odd while a writer changes the node */
 } node_t;
 
-extern node_t head;
+/* A node whose name and value fit in this many bytes along with the node
+ * itself is allocated as one object, with the strings right after it */
+#define NODE_INLINE_MAX 256
 
+/*
+ * Sharding.  The tree backends split the DB into db_nshards independent
+ * trees, each with its own root and its own locks, and keep each key in the
+ * shard db_shard() picks by hashing it.  Operations on keys in different
+ * shards then never touch the same lock.  db_init() sets the number of
+ * shards (1 unless it is called) and must be called, if at all, before the
+ * DB is first used; it returns false if the number is out of range.  The
+ * hash table is split into lock stripes already and ignores it.
+ */
+#define DB_SHARDS_MAX 64
+extern int db_nshards;
+int db_init(int);
+int db_shard(char *);
+int db_partition(char **, char **, int, char ***, char ***, int *);
+
+/* The operations every backend (db_*.c) provides */
+void query(char *, char *, int);
+int add(char *, char *);
+int xremove(char *);
+
+/* Batches.  query_batch(), add_batch() and xremove_batch() do the same as
+ * query(), add() and xremove() on each of n keys in turn (results[i] holds
+ * len characters; added[i] and removed[i] are set to what add() and
+ * xremove() would return), and return the number found, added or removed.
+ * The backend is free to do the keys in any order that keeps the operations
+ * on any one key in order, and sorts them so that each shard's keys are done
+ * under one acquisition of its lock.
+ *
+ * db_batch_sort() (shard.c) orders a batch's keys that way for the tree
+ * backends: by shard, then by name, then by position in the batch.  It
+ * returns a new array for the caller to free, or NULL if out of memory. */
+typedef struct BatchKey {
+    char *name;
+    int shard;
+    int i;		/* Position in the batch */
+} batch_key_t;
+
+int query_batch(char **, char **, int, int);
+int add_batch(char **, char **, int *, int);
+int xremove_batch(char **, int *, int);
+batch_key_t *db_batch_sort(char **, int);
+
+/* Bulk access to the whole DB, for snapshots (snapshot.c).  db_walk() calls
+ * the function on every name/value pair while the DB is held still (in key
+ * order within each shard, and in no order in the hash table), stopping if
+ * it returns nonzero.
+ * db_build() fills an empty DB from pairs sorted by name with no duplicates,
+ * much faster than adding them one by one; it returns false and changes
+ * nothing if the DB is not empty. */
+void db_walk(int (*)(char *, char *, void *), void *);
+int db_build(char **, char **, int);
+
+/* Range scans.  db_scan() calls the function on every pair whose name is at
+ * least lo and less than hi (no upper bound if hi is NULL), in key order,
+ * stopping if it returns nonzero.  Unlike db_walk() it never holds the DB
+ * still: locks are taken for a few pairs at a time, so a long scan does not
+ * keep writers out, and each pair is as it was when the scan got to it.
+ * Returns the number of pairs passed on, or -1 if out of memory.
+ *
+ * db_scan_merge() (shard.c) does the work for the sharded backends.  It
+ * calls batch(shard, from, after, hi, max, fn, arg) to have fn called, in
+ * key order, on up to max of the shard's pairs that come after from (or are
+ * from, unless after is set) and before hi, and merges the shards' pairs. */
+long db_scan(char *, char *, int (*)(char *, char *, void *), void *);
+long db_scan_merge(char *, char *, int (*)(char *, char *, void *), void *,
+	void (*)(int, char *, int, char *, int, int (*)(char *, char *, void *),
+	    void *));
+
+/* Print whatever the backend measures about itself (lock waits and so on) */
+void db_stats(FILE *);
+
+/* Shared by all backends, in interpret.c.  The command is parsed in place
+ * and may be modified.  Commands that answer with more than one line (the
+ * scans, the batches and i) hand the extra lines, each starting with a tab
+ * ("\tname value" for every pair a scan finds), to the function
+ * interpret_stream() is given, ahead of the response proper, which is the
+ * only line that does not start with a tab.  interpret_command() drops
+ * them. */
 void interpret_command(char *, char *, int);
+void interpret_stream(char *, char *, int, void (*)(char *, void *), void *);
@@ -4,86 +4,106 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include "slab.h"
+#include "lockprof.h"
+
+/* Each shard is a tree hanging off its own head, with one mutex for the
+ * whole tree.  Shards are a cache line apart so their locks do not share
+ * one. */
+typedef struct Shard {
+    pthread_mutex_t mutex_db;
+    node_t head;
+} __attribute__((aligned(64))) shard_t;
+
+static shard_t shards[DB_SHARDS_MAX];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void shards_init(void) {
+    int i;
+
+    for (i = 0; i < DB_SHARDS_MAX; i++) {
+	pthread_mutex_init(&shards[i].mutex_db, NULL);
+	shards[i].head.name = shards[i].head.value = "";
+    }
+}
 
-/* Forward declaration */
-pthread_mutex_t mutex_db = PTHREAD_MUTEX_INITIALIZER; 
+/* The shard the key name lives in */
+static inline shard_t *shard_of(char *name) {
+    pthread_once(&shards_once, shards_init);
+    return &shards[db_shard(name)];
+}
 
+/* Forward declaration */
 node_t *search(char *, node_t *, node_t **);
 
-node_t head = { "", "", 0, 0 };
 /*
- * Allocate a new node with the given key, value and children.
+ * Allocate a new node with the given key, value and children.  A short key
+ * and value are stored right behind the node in the same allocation, which
+ * saves two allocator calls and keeps the key next to the child pointers the
+ * search is about to follow.
  */
-node_t *node_create(char *arg_name, char *arg_value, node_t * arg_left,
-	node_t * arg_right) {
-	//fprintf(stderr, "A\n");
-	//pthread_mutex_lock(&mutex_db);
-	//fprintf(stderr, "B\n");
+node_t *node_create(char *arg_name, char *arg_value, node_t * arg_left, node_t * arg_right) {
+    size_t nlen = strlen(arg_name) + 1;
+    size_t vlen = strlen(arg_value) + 1;
     node_t *new_node;
 
-    new_node = (node_t *) malloc(sizeof(node_t));
-    if (!new_node)
-    {
-    	//fprintf(stderr, "C\n");
-    	//pthread_mutex_unlock(&mutex_db);
-    	//fprintf(stderr, "D\n");
-    	return NULL;
-    }
+    if (sizeof(node_t) + nlen + vlen <= NODE_INLINE_MAX) {
+	if (!(new_node = (node_t *) slab_alloc(sizeof(node_t) + nlen + vlen)))
+	    return NULL;
+	new_node->name = (char *) (new_node + 1);
+	new_node->value = new_node->name + nlen;
+    } else {
+	if (!(new_node = (node_t *) slab_alloc(sizeof(node_t)))) return NULL;
+
+	if (!(new_node->name = (char *) slab_alloc(nlen))) {
+	    slab_free(new_node, sizeof(node_t));
+	    return NULL;
+	}
 
-    if (!(new_node->name = (char *)malloc(strlen(arg_name) + 1))) {
-	free(new_node);
-	//fprintf(stderr, "E\n");
-	//pthread_mutex_unlock(&mutex_db);
-	//fprintf(stderr, "F\n");
-	return NULL;
+	if (!(new_node->value = (char *) slab_alloc(vlen))) {
+	    slab_free(new_node->name, nlen);
+	    slab_free(new_node, sizeof(node_t));
+	    return NULL;
+	}
     }
 
-    if (!(new_node->value = (char *)malloc(strlen(arg_value) + 1))) {
-	free(new_node->name);
-	free(new_node);
-	//fprintf(stderr, "G\n");
-	//pthread_mutex_unlock(&mutex_db);
-	//fprintf(stderr, "H\n");
-	return NULL;
-    }
-	//fprintf(stderr, "I\n");
-    strcpy(new_node->name, arg_name);
-    strcpy(new_node->value, arg_value);
+    memcpy(new_node->name, arg_name, nlen);
+    memcpy(new_node->value, arg_value, vlen);
     new_node->lchild = arg_left;
     new_node->rchild = arg_right;
-    //fprintf(stderr, "J\n");
- 	//pthread_mutex_unlock(&mutex_db);
- 	//fprintf(stderr, "K\n");
+    new_node->height = 1;
     return new_node;
 }
 
-/* Free the data structures in node and the node itself. */
+/* Free the data structures in node and the node itself.  The sizes handed
+ * back to the allocator are recomputed from the strings. */
 void node_destroy(node_t * node) {
-    /* Clearing name and value after they are freed is defensive programming in
-     * case the node_destroy is called again. */
-	//fprintf(stderr, "L\n");
-	//pthread_mutex_lock(&mutex_db);
-	//fprintf(stderr, "M\n");
-    if (node->name) {free(node->name); node->name = NULL; }
-    if (node->value) { free(node->value); node->value = NULL; }
-    free(node);
-    //fprintf(stderr, "N\n");
-    //pthread_mutex_unlock(&mutex_db);
-    //fprintf(stderr, "O\n");
+    size_t nlen = strlen(node->name) + 1;
+    size_t vlen = strlen(node->value) + 1;
+
+    if (node->name == (char *) (node + 1)) {
+	/* Stored inline */
+	slab_free(node, sizeof(node_t) + nlen + vlen);
+	return;
+    }
+    slab_free(node->name, nlen);
+    slab_free(node->value, vlen);
+    slab_free(node, sizeof(node_t));
 }
 
 /* Find the node with key name and return a result or error string in result.
  * Result must have space for len characters. */
 void query(char *name, char *result, int len) {
+	shard_t *sh = shard_of(name);
 	//fprintf(stderr, "P\n");
 	//Lock the mutex to prevent other accesses
-	pthread_mutex_lock(&mutex_db);
+	MUTEX_LOCK(&sh->mutex_db);
 	//fprintf(stderr, "Q\n");
     node_t *target;
     //fprintf(stderr, "R\n");
     //pthread_mutex_unlock(&mutex_db);
     //fprintf(stderr, "S\n");
-    target = search(name, &head, NULL);
+    target = search(name, &sh->head, NULL);
    	//fprintf(stderr, "T\n");
     //pthread_mutex_lock(&mutex_db);
     //fprintf(stderr, "U\n");
@@ -92,7 +112,7 @@ void query(char *name, char *result, int len) {
     	//fprintf(stderr, "V\n");
 		strncpy(result, "not found", len - 1);
 		//Unlock the mutex to allow others to access DB
-		pthread_mutex_unlock(&mutex_db);
+		MUTEX_UNLOCK(&sh->mutex_db);
 		//fprintf(stderr, "W\n");
 		return;
     } 
@@ -101,177 +121,299 @@ void query(char *name, char *result, int len) {
     	//fprintf(stderr, "X\n");
 		strncpy(result, target->value, len - 1);
 		//Unlock the mutex to allow others to access DB
-		pthread_mutex_unlock(&mutex_db);
+		MUTEX_UNLOCK(&sh->mutex_db);
 		//fprintf(stderr, "Y\n");
 		return;
     }
 }
 
+/*
+ * The tree hanging off head.rchild is kept AVL balanced so that keys that
+ * arrive in sorted order (the caps file, sequential IDs) still give a tree of
+ * logarithmic depth.  Each node records the height of its subtree; the
+ * helpers below restore the balance invariant on the way back up from an
+ * insertion or deletion.  All of them must be called with the DB locked.
+ */
+
+/* Height of the subtree rooted at node.  The empty tree has height 0. */
+static inline int height(node_t *node) {
+    return (node) ? node->height : 0;
+}
+
+/* Recompute node's height from its children. */
+static inline void fix_height(node_t *node) {
+    int lh = height(node->lchild);
+    int rh = height(node->rchild);
+
+    node->height = ((lh > rh) ? lh : rh) + 1;
+}
+
+/* Rotate the subtree rooted at node to the right and return its new root. */
+static node_t *rotate_right(node_t *node) {
+    node_t *pivot = node->lchild;
+
+    node->lchild = pivot->rchild;
+    pivot->rchild = node;
+    fix_height(node);
+    fix_height(pivot);
+    return pivot;
+}
+
+/* Rotate the subtree rooted at node to the left and return its new root. */
+static node_t *rotate_left(node_t *node) {
+    node_t *pivot = node->rchild;
+
+    node->rchild = pivot->lchild;
+    pivot->lchild = node;
+    fix_height(node);
+    fix_height(pivot);
+    return pivot;
+}
+
+/* Fix the height of node and, if its children's heights now differ by more
+ * than one, rotate it back into balance.  Return the root of the (possibly
+ * new) subtree. */
+static node_t *rebalance(node_t *node) {
+    int balance = height(node->lchild) - height(node->rchild);
+
+    if (balance > 1) {
+	/* Left heavy.  A left-right shape needs a double rotation. */
+	if (height(node->lchild->lchild) < height(node->lchild->rchild))
+	    node->lchild = rotate_left(node->lchild);
+	return rotate_right(node);
+    }
+    if (balance < -1) {
+	/* Right heavy, mirror image of the above */
+	if (height(node->rchild->rchild) < height(node->rchild->lchild))
+	    node->rchild = rotate_right(node->rchild);
+	return rotate_left(node);
+    }
+    fix_height(node);
+    return node;
+}
+
+/* Insert name/value into the subtree rooted at node and return the new root
+ * of that subtree.  *added is set to true if a node was created, false if the
+ * key was already there (or memory ran out). */
+static node_t *insert(node_t *node, char *name, char *value, int *added) {
+    int cmp;
+
+    if (!node) {
+	node_t *newnode = node_create(name, value, 0, 0);
+
+	*added = (newnode != NULL);
+	return newnode;
+    }
+
+    if ((cmp = strcmp(name, node->name)) == 0) {
+	/* There is already a node with this key in the tree */
+	*added = 0;
+	return node;
+    }
+    if (cmp < 0) node->lchild = insert(node->lchild, name, value, added);
+    else node->rchild = insert(node->rchild, name, value, added);
+
+    return (*added) ? rebalance(node) : node;
+}
+
+/* Unlink the leftmost (lexicographically smallest) node of the subtree rooted
+ * at node, store it in *min and return the new root of the subtree. */
+static node_t *remove_min(node_t *node, node_t **min) {
+    if (!node->lchild) {
+	*min = node;
+	return node->rchild;
+    }
+    node->lchild = remove_min(node->lchild, min);
+    return rebalance(node);
+}
+
+/* Remove the node with key name from the subtree rooted at node and return
+ * the new root of the subtree.  *removed is set to true if a node was
+ * deleted. */
+static node_t *delete(node_t *node, char *name, int *removed) {
+    node_t *next;	    /* leftmost child of the right subtree */
+    node_t *rest;	    /* what is left of the right subtree without next */
+    int cmp;
+
+    if (!node) {
+	/* it's not there */
+	*removed = 0;
+	return NULL;
+    }
+
+    if ((cmp = strcmp(name, node->name)) < 0) {
+	node->lchild = delete(node->lchild, name, removed);
+	return (*removed) ? rebalance(node) : node;
+    }
+    if (cmp > 0) {
+	node->rchild = delete(node->rchild, name, removed);
+	return (*removed) ? rebalance(node) : node;
+    }
+
+    *removed = 1;
+    /* The easy cases: with at most one child, that child replaces the node */
+    if (!node->rchild) {
+	next = node->lchild;
+	node_destroy(node);
+	return next;
+    }
+    if (!node->lchild) {
+	next = node->rchild;
+	node_destroy(node);
+	return next;
+    }
+
+    /* So much for the easy cases ...
+     * We know that all nodes in a node's right subtree have
+     * lexicographically greater names than the node does, and all
+     * nodes in a node's left subtree have lexicographically smaller
+     * names than the node does. So, we find the lexicographically
+     * smallest node in the right subtree and replace the node to be
+     * deleted with that node. This new node thus is lexicographically
+     * smaller than all nodes in its right subtree, and greater than
+     * all nodes in its left subtree. Thus the modified tree is well
+     * formed.  The node itself moves, not just its contents, since short
+     * names and values live inside the node's allocation. */
+    rest = remove_min(node->rchild, &next);
+    next->lchild = node->lchild;
+    next->rchild = rest;
+    node_destroy(node);
+    return rebalance(next);
+}
+
 /* Insert a node with name and value into the proper place in the DB rooted at
  * head. */
 int add(char *name, char *value) {
-	//fprintf(stderr, "Z\n");
+	shard_t *sh = shard_of(name);
+	int added;	    /* Was a new node created? */
+
 	//Lock the mutex to prevent other accesses
-	pthread_mutex_lock(&mutex_db);
-	//fprintf(stderr, "AA\n");
-	//This is technically not critical code, but I'm trying to keep accesses serial
-	node_t *parent;	    /* The new node will be the child of this node */
-	node_t *target;	    /* The existing node with key name if any */
-	node_t *newnode;    /* The new node to add */
-
-	//fprintf(stderr, "AB\n");
-	//pthread_mutex_unlock(&mutex_db);
-	//fprintf(stderr, "AC\n");
-	if ((target = search(name, &head, &parent))) 
-	{
-		//pthread_mutex_lock(&mutex_db);
-		//Unlock the mutex to allow for other accesses to DB
-		pthread_mutex_unlock(&mutex_db);
-	    /* There is already a node with this key in the tree */
-	    //fprintf(stderr, "AD\n");
-	    return 0;
-	}
+	MUTEX_LOCK(&sh->mutex_db);
+	/* Every key sorts after head's empty name, so the tree proper hangs off
+	 * head's right child */
+	sh->head.rchild = insert(sh->head.rchild, name, value, &added);
+	//Unlock the mutex to allow for other accesses to DB
+	MUTEX_UNLOCK(&sh->mutex_db);
+	return added;
+}
 
-	/* No idea how this could happen, but... */
-	if (!parent)
-	{
-		//pthread_mutex_lock(&mutex_db);
-		//Unlock the mutex to allow for other accesses to DB
-		pthread_mutex_unlock(&mutex_db);
-		//fprintf(stderr, "AE\n");
-		return 0;
-	}
-	//fprintf(stderr, "AF\n");
-	/* make the new node and attach it to parent */
-	newnode = node_create(name, value, 0, 0);
-	//fprintf(stderr, "AG\n");
-	//pthread_mutex_lock(&mutex_db);
-	//fprintf(stderr, "AH\n");
-	if (strcmp(name, parent->name) < 0) parent->lchild = newnode;
-	else parent->rchild = newnode;
-	//fprintf(stderr, "AI\n");
-	pthread_mutex_unlock(&mutex_db);
-	//fprintf(stderr, "AJ\n");
-	return 1;
+/* Remove the node with key name from the tree if it is there.  See delete()
+ * for algorithmic details.  Return true if something was deleted. */
+int xremove(char *name) {
+	shard_t *sh = shard_of(name);
+	int removed;	    /* Was a node deleted? */
+
+	//Lock the mutex for access to the DB
+	MUTEX_LOCK(&sh->mutex_db);
+	sh->head.rchild = delete(sh->head.rchild, name, &removed);
+	//Unlock the mutex to allow for other accesses to DB
+	MUTEX_UNLOCK(&sh->mutex_db);
+	return removed;
 }
 
-/*
- * When deleting a node with 2 children, we swap the contents leftmost child of
- * its right subtree with the node to be deleted.  This is used to swap those
- * content pointers without copying the data, which is unsafe if the
- * allocations are different sizes (copying "alamorgodo" into "ny" for
- * example).
- */
-static inline void swap_pointers(char **a, char **b) {
-    char *tmp = *b;
-    *b = *a;
-    *a = tmp;
+/* Look up the batch keys k[0..n), which are sorted by name, in the subtree
+ * rooted at node in one descent: the keys are split around each node and
+ * each part carries on down its own side.  Returns the number found. */
+static int search_batch(node_t *node, batch_key_t *k, int n, char **results,
+	int len) {
+    int lo, hi, mid, eq, found;
+
+    if (n == 0) return 0;
+    if (!node) {
+	for (eq = 0; eq < n; eq++) strncpy(results[k[eq].i], "not found", len - 1);
+	return 0;
+    }
+    /* k[0..lo) sort before node, and k[lo..eq) are node's name */
+    for (lo = 0, hi = n; lo < hi; ) {
+	mid = (lo + hi) / 2;
+	if (strcmp(k[mid].name, node->name) < 0) lo = mid + 1;
+	else hi = mid;
+    }
+    for (eq = lo; eq < n && strcmp(k[eq].name, node->name) == 0; eq++)
+	strncpy(results[k[eq].i], node->value, len - 1);
+    found = eq - lo;
+    found += search_batch(node->lchild, k, lo, results, len);
+    return found + search_batch(node->rchild, k + eq, n - eq, results, len);
 }
 
-/* Remove the node with key name from the tree if it is there.  See inline
- * comments for algorithmic details.  Return true if something was deleted. */
-int xremove(char *name) {
-	//fprintf(stderr, "AK\n");
-	//Lock the mutex for access to the DB
-	pthread_mutex_lock(&mutex_db);
-	//fprintf(stderr, "AL\n");
-	node_t *parent;	    /* Parent of the node to delete */
-	node_t *dnode;	    /* Node to delete */
-	node_t *next;	    /* used to find leftmost child of right subtree */
-	node_t **pnext;	    /* A pointer in the tree that points to next so we
-			       can change that nodes children (see below). */
-
-	/* first, find the node to be removed */
-	//fprintf(stderr, "AM\n");
-	//pthread_mutex_unlock(&mutex_db);
-	//fprintf(stderr, "AN\n");
-	if (!(dnode = search(name, &head, &parent))) {
-	    /* it's not there */
-	    //Unlock the mutex to allow for other accesses to DB
-	    pthread_mutex_unlock(&mutex_db);
-	    //fprintf(stderr, "AO\n");
-	    return 0;
+/* Batch versions of query(), add() and xremove() (see db.h).  Each shard's
+ * keys are done in name order under one acquisition of its lock, the
+ * queries in a single shared descent.  Without the memory to sort the keys
+ * they are done one by one. */
+int query_batch(char **names, char **results, int len, int n) {
+    batch_key_t *k = db_batch_sort(names, n);
+    int found = 0;
+    int i, j;
+
+    if (!k) {
+	for (i = 0; i < n; i++) {
+	    query(names[i], results[i], len);
+	    if (strcmp(results[i], "not found") != 0) found++;
 	}
+	return found;
+    }
+    pthread_once(&shards_once, shards_init);
+    for (i = 0; i < n; i = j) {
+	shard_t *sh = &shards[k[i].shard];
+
+	for (j = i; j < n && k[j].shard == k[i].shard; j++)
+	    ;
+	MUTEX_LOCK(&sh->mutex_db);
+	found += search_batch(sh->head.rchild, k + i, j - i, results, len);
+	MUTEX_UNLOCK(&sh->mutex_db);
+    }
+    free(k);
+    return found;
+}
 
-	/* we found it.  Now check out the easy cases.  If the node has no
-	 * right child, then we can merely replace its parent's pointer to
-	 * it with the node's left child. */
-	//fprintf(stderr, "AP\n");
-	//pthread_mutex_lock(&mutex_db);
-	//fprintf(stderr, "AQ\n");
-	if (dnode->rchild == 0) {
-		//fprintf(stderr, "AR\n");
-	    if (strcmp(dnode->name, parent->name) < 0)
-		parent->lchild = dnode->lchild;
-	    else
-		parent->rchild = dnode->lchild;
-		//fprintf(stderr, "AS\n");
-		//pthread_mutex_unlock(&mutex_db);
-		//fprintf(stderr, "AT\n");
-	    /* done with dnode */
-	    node_destroy(dnode);
-	    //fprintf(stderr, "AU\n");
-	    //pthread_mutex_lock(&mutex_db);
-	    //fprintf(stderr, "AV\n");
-
-	} else if (dnode->lchild == 0) {
-		//fprintf(stderr, "AW\n");
-	    /* ditto if the node had no left child */
-	    if (strcmp(dnode->name, parent->name) < 0)
-		parent->lchild = dnode->rchild;
-	    else
-		parent->rchild = dnode->rchild;
-		//fprintf(stderr, "AX\n");
-		//pthread_mutex_unlock(&mutex_db);
-		//fprintf(stderr, "AY\n");
-	    /* done with dnode */
-	    node_destroy(dnode);
-	    //fprintf(stderr, "AZ\n");
-	    //pthread_mutex_lock(&mutex_db);
-	    //fprintf(stderr, "BA\n");
-	} else {
-	    /* So much for the easy cases ...
-	     * We know that all nodes in a node's right subtree have
-	     * lexicographically greater names than the node does, and all
-	     * nodes in a node's left subtree have lexicographically smaller
-	     * names than the node does. So, we find the lexicographically
-	     * smallest node in the right subtree and replace the node to be
-	     * deleted with that node. This new node thus is lexicographically
-	     * smaller than all nodes in its right subtree, and greater than
-	     * all nodes in its left subtree. Thus the modified tree is well
-	     * formed. */
-
-	    /* pnext is the address of the pointer which points to next (either
-	     * parent's lchild or rchild) */
-	    //fprintf(stderr, "BB\n");
-	    pnext = &dnode->rchild;
-	    next = *pnext;
-	    //fprintf(stderr, "BC\n");
-	    while (next->lchild != 0) {
-	    	//fprintf(stderr, "BD\n");
-		    /* work our way down the lchild chain, finding the smallest
-		     * node in the subtree. */
-		    pnext = &next->lchild;
-		    next = *pnext;
-		    //fprintf(stderr, "BE\n");
-	    }
-	    //fprintf(stderr, "BF\n");
-	    swap_pointers(&dnode->name, &next->name);
-	    swap_pointers(&dnode->value, &next->value);
-	    *pnext = next->rchild;
-	    //fprintf(stderr, "BG\n");
-	    //pthread_mutex_unlock(&mutex_db);
-	    //fprintf(stderr, "BH\n");
-	    node_destroy(next);
-	    //fprintf(stderr, "BI\n");
-	    //pthread_mutex_lock(&mutex_db);
-	    //fprintf(stderr, "BJ\n");
+int add_batch(char **names, char **values, int *added, int n) {
+    batch_key_t *k = db_batch_sort(names, n);
+    int count = 0;
+    int i, j;
+
+    if (!k) {
+	for (i = 0; i < n; i++) count += (added[i] = add(names[i], values[i]));
+	return count;
+    }
+    pthread_once(&shards_once, shards_init);
+    for (i = 0; i < n; i = j) {
+	shard_t *sh = &shards[k[i].shard];
+
+	MUTEX_LOCK(&sh->mutex_db);
+	for (j = i; j < n && k[j].shard == k[i].shard; j++) {
+	    sh->head.rchild = insert(sh->head.rchild, k[j].name,
+		    values[k[j].i], &added[k[j].i]);
+	    count += added[k[j].i];
+	}
+	MUTEX_UNLOCK(&sh->mutex_db);
+    }
+    free(k);
+    return count;
+}
+
+int xremove_batch(char **names, int *removed, int n) {
+    batch_key_t *k = db_batch_sort(names, n);
+    int count = 0;
+    int i, j;
+
+    if (!k) {
+	for (i = 0; i < n; i++) count += (removed[i] = xremove(names[i]));
+	return count;
     }
-    //fprintf(stderr, "BK\n");
-    //Unlock the mutex to allow for other accesses to DB
-    pthread_mutex_unlock(&mutex_db);
-    //fprintf(stderr, "BL\n");
-    return 1;
+    pthread_once(&shards_once, shards_init);
+    for (i = 0; i < n; i = j) {
+	shard_t *sh = &shards[k[i].shard];
+
+	MUTEX_LOCK(&sh->mutex_db);
+	for (j = i; j < n && k[j].shard == k[i].shard; j++) {
+	    sh->head.rchild = delete(sh->head.rchild, k[j].name,
+		    &removed[k[j].i]);
+	    count += removed[k[j].i];
+	}
+	MUTEX_UNLOCK(&sh->mutex_db);
+    }
+    free(k);
+    return count;
 }
 
 /* Search the tree, starting at parent, for a node containing name (the "target
@@ -327,110 +469,116 @@ node_t *search(char *name, node_t * parent, node_t ** parentpp) {
     return (result);
 }
 
-/*
- * Parse the command in command, execute it on the DB rooted at head and return
- * a string describing the results.  Response must be a writable string that
- * can hold len characters.  The response is stored in response.
- */
-void interpret_command(char *command, char *response, int len)
-{
-    char value[256];
-    char ibuf[256];
-    char name[256];
+/* In-order walk of the subtree rooted at node for db_walk().  Returns
+ * nonzero if fn asked to stop. */
+static int walk(node_t *node, int (*fn)(char *, char *, void *), void *arg) {
+    if (!node) return 0;
+    return walk(node->lchild, fn, arg) ||
+	fn(node->name, node->value, arg) ||
+	walk(node->rchild, fn, arg);
+}
 
-    if (strlen(command) <= 1) 
-    {
-		strncpy(response, "ill-formed command", len - 1);
-		return;
+/* In-order visit for scan_shard() of the pairs in the subtree rooted at node
+ * that come after from (or are from, unless after is set) and before hi, at
+ * most *left of them.  Returns nonzero once the batch is over. */
+static int scan(node_t *node, char *from, int after, char *hi, int *left,
+	int (*fn)(char *, char *, void *), void *arg) {
+    int cmp;
+
+    if (!node) return 0;
+    /* Below a node that sorts too early only its right subtree can match */
+    if ((cmp = strcmp(node->name, from)) > 0 || (cmp == 0 && !after)) {
+	if (scan(node->lchild, from, after, hi, left, fn, arg)) return 1;
+	if (hi && strcmp(node->name, hi) >= 0) return 1;
+	if (fn(node->name, node->value, arg) || --*left == 0) return 1;
     }
+    return scan(node->rchild, from, after, hi, left, fn, arg);
+}
 
-    switch (command[0]) 
-    {
-    	case 'q':
-			/* Query */
-			sscanf(&command[1], "%255s", name);
-			if (strlen(name) == 0) 
-			{
-	    		strncpy(response, "ill-formed command", len - 1);
-	    		return;
-			}
-
-			query(name, response, len);
-			if (strlen(response) == 0) 
-			{
-	    		strncpy(response, "not found", len - 1);
-			}
-
-			return;
-
-    	case 'a':
-			/* Add to the database */
-			sscanf(&command[1], "%255s %255s", name, value);
-			if ((strlen(name) == 0) || (strlen(value) == 0)) 
-			{
-	    		strncpy(response, "ill-formed command", len - 1);
-	    		return;
-			}
-
-			if (add(name, value)) 
-			{
-	    		strncpy(response, "added", len - 1);
-			} 
-			else 
-			{
-	    		strncpy(response, "already in database", len - 1);
-			}
-
-			return;
-
-    	case 'd':
-			/* Delete from the database */
-			sscanf(&command[1], "%255s", name);
-			if (strlen(name) == 0) 
-			{
-	    		strncpy(response, "ill-formed command", len - 1);
-	    		return;
-			}
-
-			if (xremove(name)) 
-			{
-	    		strncpy(response, "removed", len - 1);
-			} 
-			else 
-			{
-	    		strncpy(response, "not in database", len - 1);
-			}
-
-	    	return;
-
-    	case 'f':
-			/* process the commands in a file (silently) */
-			sscanf(&command[1], "%255s", name);
-			if (name[0] == '\0') 
-			{
-	    		strncpy(response, "ill-formed command", len - 1);
-	    		return;
-			}
-
-
-			{
-	    		FILE *finput = fopen(name, "r");
-	    		if (!finput) 
-	    		{
-					strncpy(response, "bad file name", len - 1);
-					return;
-	    		}
-	    		while (fgets(ibuf, sizeof(ibuf), finput) != 0) 
-	    		{
-					interpret_command(ibuf, response, len);
-	    		}
-	    		fclose(finput);
-			}
-			strncpy(response, "file processed", len - 1);
-			return;
-
-    	default:
-			strncpy(response, "ill-formed command", len - 1);
-			return;
+/* Free every node of a subtree nothing else can see */
+static void free_tree(node_t *node) {
+    if (!node) return;
+    free_tree(node->lchild);
+    free_tree(node->rchild);
+    node_destroy(node);
+}
+
+/* Build a perfectly balanced subtree from the sorted pairs lo..hi (inclusive)
+ * for db_build().  Sets *ok to 0 and returns what it has if a node cannot be
+ * made. */
+static node_t *build(char **names, char **values, int lo, int hi, int *ok) {
+    node_t *node;
+    int mid;
+
+    if (lo > hi || !*ok) return NULL;
+    mid = lo + (hi - lo) / 2;
+    if (!(node = node_create(names[mid], values[mid], NULL, NULL))) {
+	*ok = 0;
+	return NULL;
+    }
+    node->lchild = build(names, values, lo, mid - 1, ok);
+    node->rchild = build(names, values, mid + 1, hi, ok);
+    node->height = 1 + (height(node->lchild) > height(node->rchild) ?
+	    height(node->lchild) : height(node->rchild));
+    return node;
+}
+
+/* Call fn on every pair, shard by shard in key order, holding every shard's
+ * lock throughout so the walk sees one consistent state.  Stops early if fn
+ * returns nonzero. */
+void db_walk(int (*fn)(char *, char *, void *), void *arg) {
+    int i;
+
+    pthread_once(&shards_once, shards_init);
+    for (i = 0; i < db_nshards; i++) pthread_mutex_lock(&shards[i].mutex_db);
+    for (i = 0; i < db_nshards; i++)
+	if (walk(shards[i].head.rchild, fn, arg)) break;
+    for (i = db_nshards - 1; i >= 0; i--)
+	pthread_mutex_unlock(&shards[i].mutex_db);
+}
+
+/* Fill the empty DB with the n pairs in names/values, which are sorted by
+ * name with no duplicates, as one balanced tree per shard.  Returns false,
+ * leaving the DB alone, if it is not empty or memory runs out. */
+int db_build(char **names, char **values, int n) {
+    node_t *roots[DB_SHARDS_MAX];
+    int start[DB_SHARDS_MAX + 1];
+    char **snames, **svalues;
+    int ok = 1;
+    int i;
+
+    pthread_once(&shards_once, shards_init);
+    if (!db_partition(names, values, n, &snames, &svalues, start)) return 0;
+    for (i = 0; i < db_nshards; i++) pthread_mutex_lock(&shards[i].mutex_db);
+    for (i = 0; i < db_nshards; i++)
+	if (shards[i].head.rchild) ok = 0;
+    for (i = 0; i < db_nshards; i++)
+	roots[i] = build(snames, svalues, start[i], start[i + 1] - 1, &ok);
+    for (i = 0; i < db_nshards; i++) {
+	if (ok) shards[i].head.rchild = roots[i];
+	else free_tree(roots[i]);
     }
+    for (i = db_nshards - 1; i >= 0; i--)
+	pthread_mutex_unlock(&shards[i].mutex_db);
+    free(snames);
+    free(svalues);
+    return ok;
+}
+
+/* db_scan_merge() batch: a shard's next max pairs, under its lock */
+static void scan_shard(int s, char *from, int after, char *hi, int max,
+	int (*fn)(char *, char *, void *), void *arg) {
+    MUTEX_LOCK(&shards[s].mutex_db);
+    scan(shards[s].head.rchild, from, after, hi, &max, fn, arg);
+    MUTEX_UNLOCK(&shards[s].mutex_db);
+}
+
+long db_scan(char *lo, char *hi, int (*fn)(char *, char *, void *), void *arg) {
+    pthread_once(&shards_once, shards_init);
+    return db_scan_merge(lo, hi, fn, arg, scan_shard);
+}
+
+/* This backend keeps no statistics */
+void db_stats(FILE *f) {
+    (void) f;
 }
@@ -4,522 +4,979 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include "slab.h"
+#include <sched.h>
+#include "epoch.h"
+#include "lockprof.h"
 
-/* Forward declaration */
-node_t *searchQ(char *, node_t *, node_t **);
-node_t *searchAR(char *, node_t *, node_t **);
-//node_t *searchR(char *, node_t *, node_t **);
-
-node_t head = { "", "", 0, 0, PTHREAD_RWLOCK_INITIALIZER };
 /*
- * Allocate a new node with the given key, value and children.
+ * Allocate a new node with the given key, value and children.  A short key
+ * and value are stored right behind the node in the same allocation, which
+ * saves two allocator calls and keeps the key next to the child pointers the
+ * search is about to follow.
  */
-node_t *node_create(char *arg_name, char *arg_value, node_t * arg_left, node_t * arg_right) 
-{
+node_t *node_create(char *arg_name, char *arg_value, node_t * arg_left, node_t * arg_right) {
+    size_t nlen = strlen(arg_name) + 1;
+    size_t vlen = strlen(arg_value) + 1;
     node_t *new_node;
 
-    new_node = (node_t *) malloc(sizeof(node_t));
+    if (sizeof(node_t) + nlen + vlen <= NODE_INLINE_MAX) {
+	if (!(new_node = (node_t *) slab_alloc(sizeof(node_t) + nlen + vlen)))
+	    return NULL;
+	new_node->name = (char *) (new_node + 1);
+	new_node->value = new_node->name + nlen;
+    } else {
+	if (!(new_node = (node_t *) slab_alloc(sizeof(node_t)))) return NULL;
+
+	if (!(new_node->name = (char *) slab_alloc(nlen))) {
+	    slab_free(new_node, sizeof(node_t));
+	    return NULL;
+	}
 
-    if (!new_node)
-    {
-    	return NULL;
+	if (!(new_node->value = (char *) slab_alloc(vlen))) {
+	    slab_free(new_node->name, nlen);
+	    slab_free(new_node, sizeof(node_t));
+	    return NULL;
+	}
     }
 
     //Initialize the rwlock
     pthread_rwlock_init(&(new_node->mutex_node_lock),NULL);
 
-    if (!(new_node->name = (char *)malloc(strlen(arg_name) + 1))) 
-    {
-		free(new_node);
-		return NULL;
-    }
-
-    if (!(new_node->value = (char *)malloc(strlen(arg_value) + 1))) 
-    {
-		free(new_node->name);
-		free(new_node);
-		return NULL;
-    }
-
-    strcpy(new_node->name, arg_name);
-    strcpy(new_node->value, arg_value);
+    memcpy(new_node->name, arg_name, nlen);
+    memcpy(new_node->value, arg_value, vlen);
     new_node->lchild = arg_left;
     new_node->rchild = arg_right;
-    
+    new_node->height = 1;
+    new_node->version = 0;
     return new_node;
 }
 
-/* Free the data structures in node and the node itself. */
+/* Free the data structures in node and the node itself.  The sizes handed
+ * back to the allocator are recomputed from the strings. */
 void node_destroy(node_t * node) {
-    /* Clearing name and value after they are freed is defensive programming in
-     * case the node_destroy is called again. */
-	//Destroy the rwlock
-	pthread_rwlock_destroy(&(node->mutex_node_lock));
+    size_t nlen = strlen(node->name) + 1;
+    size_t vlen = strlen(node->value) + 1;
+
+    //Destroy the rwlock
+    pthread_rwlock_destroy(&(node->mutex_node_lock));
 
-    if (node->name) {free(node->name); node->name = NULL; }
-    if (node->value) { free(node->value); node->value = NULL; }
-    free(node);
+    if (node->name == (char *) (node + 1)) {
+	/* Stored inline */
+	slab_free(node, sizeof(node_t) + nlen + vlen);
+	return;
+    }
+    slab_free(node->name, nlen);
+    slab_free(node->value, vlen);
+    slab_free(node, sizeof(node_t));
 }
 
-/* Find the node with key name and return a result or error string in result.
- * Result must have space for len characters. */
-void query(char *name, char *result, int len) 
+/* Hand a node that has been unlinked from the tree back to node_destroy once
+ * no lock-free reader can still be looking at it. */
+static void node_reclaim(void *node)
 {
-	node_t *parent;
-    node_t *target;
+	node_destroy((node_t *) node);
+}
+
+/*
+ * Queries do not take any locks.  Writers still write lock the nodes they
+ * change, but they also bump the node's version to odd before the change and
+ * back to even afterwards (a per-node seqlock).  A reader notes a node's
+ * version, reads the fields it needs and then checks that the version has not
+ * moved; if it has, the reader starts over from head.  Checking the parent's
+ * version again after picking up the child's means the parent still pointed
+ * at the child at that moment, so the reader never wanders off into a part of
+ * the tree that was rotated out from under it.  Unlinked nodes are freed
+ * through epoch_retire() so a reader that is still on one never touches freed
+ * memory.
+ *
+ * Fields readers follow are loaded and stored atomically.
+ */
+#define LOAD(field)	    __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STORE(field, val)   __atomic_store_n(&(field), (val), __ATOMIC_RELAXED)
 
-    //Parent will be locked afte this
-    target = searchQ(name, &head, &parent);
+/*
+ * Deleting a node with two children moves the node with the smallest key of
+ * its right subtree up into its place.  A reader that was already below the
+ * deleted node can then miss that key, and no single node version tells it
+ * so.  Writers count
+ * these moves as they start and finish; a reader that comes up empty handed
+ * retries if any move overlapped its search.
+ */
 
-    if (!target) 
-    {
-		strncpy(result, "not found", len - 1);
-		//Release the parent lock
-		pthread_rwlock_unlock(&(parent->mutex_node_lock));
-		return;
-    } 
-    else 
-    {   	
-	    //The only critical section for the read	
-		strncpy(result, target->value, len - 1);
-		//Unlock any of the locks
-		pthread_rwlock_unlock(&(target->mutex_node_lock));
-		pthread_rwlock_unlock(&(parent->mutex_node_lock));
-		return;
-    }
+/*
+ * Each shard is a tree hanging off its own head, with its own move counters,
+ * so writers in one shard never hold up readers in another.
+ */
+typedef struct Shard {
+	node_t head;
+	unsigned long moves_started;
+	unsigned long moves_done;
+} __attribute__((aligned(64))) shard_t;
+
+static shard_t shards[DB_SHARDS_MAX];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void shards_init(void)
+{
+	int i;
+
+	for (i = 0; i < DB_SHARDS_MAX; i++)
+	{
+		shards[i].head.name = shards[i].head.value = "";
+		pthread_rwlock_init(&(shards[i].head.mutex_node_lock), NULL);
+	}
 }
 
-/* Insert a node with name and value into the proper place in the DB rooted at
- * head. */
-int add(char *name, char *value) {
-	node_t *parent;	    /* The new node will be the child of this node */
-	node_t *target;	    /* The existing node with key name if any */
-	node_t *newnode;    /* The new node to add */
+/* The shard the key name lives in */
+static inline shard_t *shard_of(char *name)
+{
+	pthread_once(&shards_once, shards_init);
+	return &shards[db_shard(name)];
+}
 
-	//Target and parent will be locked after this
-	if ((target = searchAR(name, &head, &parent))) 
+/* Wait until no writer is changing node and return its version */
+static inline unsigned long read_version(node_t *node)
+{
+	unsigned long version;
+	int spins = 0;
+
+	while ((version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE)) & 1)
 	{
-	    /* There is already a node with this key in the tree */
-	    pthread_rwlock_unlock(&(target->mutex_node_lock));
-	    pthread_rwlock_unlock(&(parent->mutex_node_lock));
-	    return 0;
+		if (++spins % 64 == 0) sched_yield();
 	}
-	/* No idea how this could happen, but... */
-	if (!parent) return 0;
+	return version;
+}
 
-	/* make the new node and attach it to parent */
-	newnode = node_create(name, value, 0, 0);
+/* True if node has not changed since read_version() returned version */
+static inline int validate(node_t *node, unsigned long version)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&node->version, __ATOMIC_RELAXED) == version;
+}
+
+/* Bracket a change to a write locked node */
+static inline void write_begin(node_t *node)
+{
+	__atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-	if (strcmp(name, parent->name) < 0) 
+static inline void write_end(node_t *node)
+{
+	__atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELEASE);
+}
+
+/* Find the node with key name and return a result or error string in result.
+ * Result must have space for len characters. */
+void query(char *name, char *result, int len) 
+{
+	node_t *parent;		/* Node we came from */
+	node_t *target;		/* Node being examined */
+	unsigned long pversion;	/* parent's version when we read target from it */
+	unsigned long tversion;	/* target's version */
+	unsigned long moves;	/* moves_started when the search began */
+	shard_t *sh = shard_of(name);
+	int cmp;
+
+	epoch_enter();
+retry:
+	if ((moves = __atomic_load_n(&sh->moves_done, __ATOMIC_ACQUIRE)) !=
+		__atomic_load_n(&sh->moves_started, __ATOMIC_ACQUIRE))
 	{
-		parent->lchild = newnode;
+		//A key is being moved up the tree; let it land
+		sched_yield();
+		goto retry;
 	}
-	else 
+	parent = &sh->head;
+	pversion = read_version(&sh->head);
+	target = LOAD(sh->head.rchild);
+
+	while (target != NULL)
 	{
-		parent->rchild = newnode;
+		tversion = read_version(target);
+		//The parent must still have pointed here when we got the version
+		if (!validate(parent, pversion)) goto retry;
+
+		if ((cmp = strcmp(name, LOAD(target->name))) == 0)
+		{
+			strncpy(result, LOAD(target->value), len - 1);
+			if (!validate(target, tversion)) goto retry;
+			epoch_exit();
+			return;
+		}
+
+		parent = target;
+		pversion = tversion;
+		target = (cmp < 0) ? LOAD(target->lchild) : LOAD(target->rchild);
 	}
-	//Unlock the lock
-	pthread_rwlock_unlock(&(parent->mutex_node_lock));
 
-	return 1;
+	//The empty child we stopped at, and the path to it, must still be current
+	if (!validate(parent, pversion) ||
+		__atomic_load_n(&sh->moves_started, __ATOMIC_RELAXED) != moves)
+	{
+		goto retry;
+	}
+	epoch_exit();
+	strncpy(result, "not found", len - 1);
 }
 
 /*
- * When deleting a node with 2 children, we swap the contents leftmost child of
- * its right subtree with the node to be deleted.  This is used to swap those
- * content pointers without copying the data, which is unsafe if the
- * allocations are different sizes (copying "alamorgodo" into "ny" for
- * example).
+ * Each shard's tree is kept AVL balanced.  Writers walk down
+ * from head write locking each node, but as soon as they reach a node whose
+ * height cannot change as a result of their operation (a "safe" node) they
+ * release everything above that node's parent.  All rebalancing then happens
+ * inside the nodes that are still locked, so other writers can keep working
+ * in the rest of the tree.  Rotations only change the key ranges of the
+ * rotated nodes themselves, whose versions are bumped, so a reader that is
+ * already further down still finds its key.
+ *
+ * For an insert, a node is safe if it is already unbalanced: growing its short
+ * side evens it out and growing its tall side triggers a rotation that
+ * restores its old height.  For a delete, a node is safe if it is balanced:
+ * shrinking either side leaves its height alone.
+ *
+ * Locking from head still puts every writer through head's lock, even one
+ * whose key turns out to be there already (or not there, for a delete) and
+ * which changes nothing.  So writers first search the way query() does, with
+ * no locks, noting each node's version on the way down (optimistic lock
+ * coupling).  An add that finds its key, or an xremove that does not, is
+ * done.  Otherwise the writer picks the parent of the deepest safe node it
+ * passed and write locks from there down to the bottom of its path, checking
+ * that each node's version is still the one it saw.  Any change to a node
+ * bumps its version, so if they all match the locked nodes are exactly the
+ * path it searched, and that path is still in the tree.  Heights are read
+ * unlocked during the search, so the node picked as safe is checked again
+ * under the locks.  If anything has moved the writer lets go and searches
+ * again, and after OLC_TRIES failures it falls back on locking from head.
+ * Locks are still only taken from parent to child, on nodes whose version
+ * shows the link between them is current, so writers cannot deadlock.
  */
-static inline void swap_pointers(char **a, char **b) 
+
+/* An AVL tree with 2^43 nodes is still less than 63 levels deep */
+#define MAX_DEPTH 64
+
+/* Optimistic attempts an add or xremove makes before locking from head */
+#define OLC_TRIES 4
+
+/* The nodes from head down to where an add or xremove is working.  Entries
+ * top through n-1 are write locked, the ones above top have been released.
+ * An optimistic search also notes the version it saw each node at. */
+typedef struct Path {
+	node_t *node[MAX_DEPTH];
+	unsigned long version[MAX_DEPTH];
+	int top;
+	int n;
+} path_t;
+
+/* Write lock node and append it to path */
+static inline void path_push(path_t *path, node_t *node)
 {
-    char *tmp = *b;
-    *b = *a;
-    *a = tmp;
+	WRLOCK(&(node->mutex_node_lock));
+	path->node[path->n++] = node;
 }
 
-/* Remove the node with key name from the tree if it is there.  See inline
- * comments for algorithmic details.  Return true if something was deleted. */
-int xremove(char *name) 
+/* Release the locks on all the path entries above entry i */
+static inline void path_release_above(path_t *path, int i)
 {
-	node_t *parent;	    /* Parent of the node to delete */
-	node_t *dnode;	    /* Node to delete */
-	node_t *next;	    /* used to find leftmost child of right subtree */
-	node_t **pnext;	    /* A pointer in the tree that points to next so we
-			       can change that nodes children (see below). */
-
-	/* first, find the node to be removed */
-	if (!(dnode = searchAR(name, &head, &parent))) 
+	while (path->top < i)
 	{
-		pthread_rwlock_unlock(&(parent->mutex_node_lock));
-	    /* it's not there */
-	    return 0;
+		RWUNLOCK(&(path->node[path->top++]->mutex_node_lock));
 	}
+}
 
-	/* we found it.  Now check out the easy cases.  If the node has no
-	 * right child, then we can merely replace its parent's pointer to
-	 * it with the node's left child. */
-	if (dnode->rchild == 0) 
-	{
-		//Has only left child
-		//I think this also handles no children
-	    if (strcmp(dnode->name, parent->name) < 0)
-	    {
-	    	//It is the left child of the parent
-			parent->lchild = dnode->lchild;
-		}
-	    else
-	    {
-	    	//It is the right child of the parent
-			parent->rchild = dnode->lchild;
-		}
+/* Release every lock still held on path */
+static inline void path_unlock(path_t *path)
+{
+	path_release_above(path, path->n);
+}
 
-	    /* done with dnode */
-	    node_destroy(dnode);
-	} 
-	else if (dnode->lchild == 0) 
-	{
-		//Has only right child
-    	/* ditto if the node had no left child */
-    	if (strcmp(dnode->name, parent->name) < 0)
-    	{
-  			//IS the left child of the parent
-			parent->lchild = dnode->rchild;
-		}
-    	else
-    	{
-			parent->rchild = dnode->rchild;
-		}
+/* Height of the subtree rooted at node.  The empty tree has height 0. */
+static inline int height(node_t *node)
+{
+    return (node) ? node->height : 0;
+}
 
-    	/* done with dnode */
-    	node_destroy(dnode);
-	} 
-	else 
+/* Difference between the heights of node's left and right subtrees */
+static inline int balance(node_t *node)
+{
+	return height(node->lchild) - height(node->rchild);
+}
+
+/* Recompute node's height from its children.  The height is only stored if
+ * it changed; other writers may be reading it through their own locked
+ * parent. */
+static inline void fix_height(node_t *node)
+{
+    int lh = height(node->lchild);
+    int rh = height(node->rchild);
+    int h = ((lh > rh) ? lh : rh) + 1;
+
+    if (node->height != h) node->height = h;
+}
+
+/* Rotate the subtree rooted at node to the right and return its new root.
+ * node and its left child must be write locked and mid write_begin(). */
+static node_t *rotate_right(node_t *node)
+{
+    node_t *pivot = node->lchild;
+
+    STORE(node->lchild, pivot->rchild);
+    STORE(pivot->rchild, node);
+    fix_height(node);
+    fix_height(pivot);
+    return pivot;
+}
+
+/* Rotate the subtree rooted at node to the left and return its new root.
+ * node and its right child must be write locked and mid write_begin(). */
+static node_t *rotate_left(node_t *node)
+{
+    node_t *pivot = node->rchild;
+
+    STORE(node->rchild, pivot->lchild);
+    STORE(pivot->lchild, node);
+    fix_height(node);
+    fix_height(pivot);
+    return pivot;
+}
+
+/* Point whichever child pointer of parent refers to old at new instead */
+static inline void relink(node_t *parent, node_t *old, node_t *new)
+{
+	if (parent->lchild == old) STORE(parent->lchild, new);
+	else STORE(parent->rchild, new);
+}
+
+/* Fix the height of the write locked node and rotate it back into balance if
+ * needed, pointing parent at the new root of the subtree.  After an insert
+ * the nodes that get rotated are always on the locked path.  After a delete
+ * they are on the other side of node, so lock_aside asks for them to be
+ * locked here for the duration of the rotation. */
+static void rebalance(node_t *parent, node_t *node, int lock_aside)
+{
+	node_t *pivot;		/* child of node that moves up */
+	node_t *inner = NULL;	/* grandchild that moves up in a double rotation */
+	node_t *root;		/* the new root of this subtree */
+	int bal = balance(node);
+
+	if (bal >= -1 && bal <= 1)
 	{
-	    /* So much for the easy cases ...
-	     * We know that all nodes in a node's right subtree have
-	     * lexicographically greater names than the node does, and all
-	     * nodes in a node's left subtree have lexicographically smaller
-	     * names than the node does. So, we find the lexicographically
-	     * smallest node in the right subtree and replace the node to be
-	     * deleted with that node. This new node thus is lexicographically
-	     * smaller than all nodes in its right subtree, and greater than
-	     * all nodes in its left subtree. Thus the modified tree is well
-	     * formed. */
+		fix_height(node);
+		return;
+	}
 
-	    /* pnext is the address of the pointer which points to next (either
-	     * parent's lchild or rchild) */
-	    pnext = &dnode->rchild;
-	    next = *pnext;
+	pivot = (bal > 1) ? node->lchild : node->rchild;
+	if (lock_aside) WRLOCK(&(pivot->mutex_node_lock));
+	if (bal > 1 && balance(pivot) < 0) inner = pivot->rchild;
+	if (bal < -1 && balance(pivot) > 0) inner = pivot->lchild;
+	if (inner && lock_aside) WRLOCK(&(inner->mutex_node_lock));
 
-	    //Lock as you traverse down the tree
-	    pthread_rwlock_rdlock(&(next->mutex_node_lock));
+	//Readers must never see the subtree half rotated
+	write_begin(parent);
+	write_begin(node);
+	write_begin(pivot);
+	if (inner) write_begin(inner);
 
-	    while (next->lchild != 0) 
-	    {
-	    	//Release the lock
-	    	pthread_rwlock_unlock(&(next->mutex_node_lock));
-		    /* work our way down the lchild chain, finding the smallest
-		     * node in the subtree. */
-		    pnext = &next->lchild;
+	if (bal > 1)
+	{
+		if (inner) STORE(node->lchild, rotate_left(pivot));
+		root = rotate_right(node);
+	}
+	else
+	{
+		if (inner) STORE(node->rchild, rotate_right(pivot));
+		root = rotate_left(node);
+	}
+	relink(parent, node, root);
 
-		    next = *pnext;
+	if (inner) write_end(inner);
+	write_end(pivot);
+	write_end(node);
+	write_end(parent);
 
-		    pthread_rwlock_rdlock(&(next->mutex_node_lock));
-    	}
-    	//At teh end, the parent of the dnode is locked
+	if (lock_aside)
+	{
+		if (inner) RWUNLOCK(&(inner->mutex_node_lock));
+		RWUNLOCK(&(pivot->mutex_node_lock));
+	}
+}
 
-    	pthread_rwlock_unlock(&(next->mutex_node_lock));
-    	pthread_rwlock_wrlock(&(next->mutex_node_lock));
+/* Walk back up the locked part of path from entry i, rebalancing every node
+ * below the topmost locked one (which only has its child pointer updated). */
+static void retrace(path_t *path, int i, int lock_aside)
+{
+	for ( ; i > path->top; i--)
+	{
+		rebalance(path->node[i - 1], path->node[i], lock_aside);
+	}
+}
 
-	    swap_pointers(&dnode->name, &next->name);
-	    swap_pointers(&dnode->value, &next->value);
-	    *pnext = next->rchild; //This part seems magical
+/*
+ * Search shard sh for name without taking any locks, as query() does, and
+ * leave the nodes from its head down to where the search ended on path along
+ * with their versions.  Returns true if name was found, in which case it is
+ * the last node on the path; otherwise the last node is the parent of the
+ * empty child name belongs in, and *cmp says which child.  *moves is set to
+ * the shard's moves_started as of the start of the search.  Must be called
+ * inside an epoch.
+ */
+static int olc_search(shard_t *sh, char *name, path_t *path, int *cmp,
+	unsigned long *moves)
+{
+	node_t *target;
+	unsigned long tversion;
 
-	    pthread_rwlock_unlock(&(next->mutex_node_lock));
+retry:
+	if ((*moves = __atomic_load_n(&sh->moves_done, __ATOMIC_ACQUIRE)) !=
+		__atomic_load_n(&sh->moves_started, __ATOMIC_ACQUIRE))
+	{
+		sched_yield();
+		goto retry;
+	}
+	path->top = 0;
+	path->n = 1;
+	path->node[0] = &sh->head;
+	path->version[0] = read_version(&sh->head);
+	target = LOAD(sh->head.rchild);
+	*cmp = 1;
+
+	while (target != NULL)
+	{
+		tversion = read_version(target);
+		if (!validate(path->node[path->n - 1], path->version[path->n - 1]) ||
+			path->n == MAX_DEPTH)
+		{
+			goto retry;
+		}
+		path->node[path->n] = target;
+		path->version[path->n] = tversion;
+		path->n++;
 
-    	node_destroy(next);
+		if ((*cmp = strcmp(name, LOAD(target->name))) == 0) return 1;
+		target = (*cmp < 0) ? LOAD(target->lchild) : LOAD(target->rchild);
 	}
 
-	pthread_rwlock_unlock(&(parent->mutex_node_lock));
-	pthread_rwlock_unlock(&(dnode->mutex_node_lock));
+	if (!validate(path->node[path->n - 1], path->version[path->n - 1]))
+	{
+		goto retry;
+	}
+	return 0;
+}
+
+/* Write lock the nodes on path from entry top down, checking each against
+ * the version olc_search() saw.  Returns false, with nothing locked, if any
+ * of them has changed. */
+static int olc_lock(path_t *path, int top)
+{
+	int i;
 
+	path->top = top;
+	for (i = top; i < path->n; i++)
+	{
+		WRLOCK(&(path->node[i]->mutex_node_lock));
+		if (LOAD(path->node[i]->version) != path->version[i])
+		{
+			while (i >= top)
+			{
+				RWUNLOCK(&(path->node[i--]->mutex_node_lock));
+			}
+			return 0;
+		}
+	}
 	return 1;
 }
 
-/* Search the tree, starting at parent, for a node containing name (the "target
- * node").  Return a pointer to the node, if found, otherwise return 0.  If
- * parentpp is not 0, then it points to a location at which the address of the
- * parent of the target node is stored.  If the target node is not found, the
- * location pointed to by parentpp is set to what would be the the address of
- * the parent of the target node, if it were there.
- *
- * Assumptions:
- * parent is not null and it does not contain name */
- //USed for query
-node_t *searchQ(char *name, node_t * parent, node_t ** parentpp) {
+/* Make a node with name and value and hang it off the last node on path, on
+ * the side cmp says, then rebalance.  The path must be locked from the parent
+ * of its deepest safe node (for an insert) down; everything is unlocked on
+ * return. */
+static int add_locked(path_t *path, char *name, char *value, int cmp)
+{
+	node_t *parent;	    /* The new node will be the child of this node */
+	node_t *newnode;    /* The new node to add */
 
-    node_t *next;
-    node_t *result;
+	/* make the new node and attach it to parent */
+	if (!(newnode = node_create(name, value, 0, 0)))
+	{
+		path_unlock(path);
+		return 0;
+	}
 
-    //Lock the parent as you traverse down
-    pthread_rwlock_rdlock(&(parent->mutex_node_lock));
+	parent = path->node[path->n - 1];
+	write_begin(parent);
+	if (cmp < 0) 
+	{
+		STORE(parent->lchild, newnode);
+	}
+	else 
+	{
+		STORE(parent->rchild, newnode);
+	}
+	write_end(parent);
+	retrace(path, path->n - 1, 0);
+	//Unlock the locks
+	path_unlock(path);
 
-    if (strcmp(name, parent->name) < 0) 
-    {
-    	next = parent->lchild;
-    }
-    else 
-    {
-    	next = parent->rchild;
-    }
+	return 1;
+}
 
-    //pthread_rwlock_lock(&(next->mutex_node_lock));
+/* Insert a node with name and value into the proper place in the DB rooted at
+ * its shard's head. */
+int add(char *name, char *value) {
+	shard_t *sh = shard_of(name);
+	path_t path;	    /* Locked nodes from head down to the new node's parent */
+	node_t *next;	    /* Next node down the tree */
+	unsigned long moves;
+	int cmp = 1;	    /* Everything sorts after head's empty name */
+	int tries, top, i;
+
+	for (tries = 0; tries < OLC_TRIES; tries++)
+	{
+		epoch_enter();
+		if (olc_search(sh, name, &path, &cmp, &moves))
+		{
+		    /* There is already a node with this key in the tree */
+			epoch_exit();
+			return 0;
+		}
 
-    if (next == NULL) 
-    {
-		result = NULL;
-    } 
-    else 
-    {
-		if (strcmp(name, next->name) == 0) 
+		for (top = 0, i = 1; i < path.n; i++)
 		{
-		    /* Note that this falls through to the if (parentpp .. ) statement
-		     * below. */
-			//Found it lock the Read
-		    result = next;
-		} 
-		else 
+			if (balance(path.node[i]) != 0) top = i - 1;
+		}
+		if (olc_lock(&path, top))
 		{
-		    /* "We have to go deeper!" This recurses and returns from here
-		     * after the recursion has returned result and set parentpp */
-			//pthread_rwlock_unlock(&(next->mutex_node_lock));
-			//Release the parentbefore recursing down
-			pthread_rwlock_unlock(&(parent->mutex_node_lock));
-		    result = searchQ(name, next, parentpp);
-		    return result;
+			//The safe node has to still be safe now that it is locked, and
+			//no key can have been moved up past the search
+			for (i = path.n - 1; i > top && balance(path.node[i]) == 0; i--)
+				;
+			if ((i > top || top == 0) &&
+				__atomic_load_n(&sh->moves_started, __ATOMIC_ACQUIRE) == moves)
+			{
+				epoch_exit();
+				if (i > top) path_release_above(&path, i - 1);
+				return add_locked(&path, name, value, cmp);
+			}
+			path_unlock(&path);
 		}
-    }
+		epoch_exit();
+	}
 
-    /* record a parent if we are looking for one */
-    if (parentpp != 0) 
-    {
-    	*parentpp = parent;
-    	
-    }
+	//Too busy to get in optimistically; lock all the way from head
+	cmp = 1;
+	path.top = path.n = 0;
+	path_push(&path, &sh->head);
+	next = sh->head.rchild;
 
-    //pthread_rwlock_unlock(&(parent->mutex_node_lock));
-    if(result != NULL)
-    {
-    	pthread_rwlock_rdlock(&(result->mutex_node_lock));
-    }
+	while (next != NULL)
+	{
+		path_push(&path, next);
+		if ((cmp = strcmp(name, next->name)) == 0)
+		{
+		    /* There is already a node with this key in the tree */
+			path_unlock(&path);
+			return 0;
+		}
+		//Nothing above this node's parent can change, let it go
+		if (balance(next) != 0) path_release_above(&path, path.n - 2);
+		next = (cmp < 0) ? next->lchild : next->rchild;
+	}
 
-    return (result);
+	return add_locked(&path, name, value, cmp);
 }
 
-/* Search the tree, starting at parent, for a node containing name (the "target
- * node").  Return a pointer to the node, if found, otherwise return 0.  If
- * parentpp is not 0, then it points to a location at which the address of the
- * parent of the target node is stored.  If the target node is not found, the
- * location pointed to by parentpp is set to what would be the the address of
- * the parent of the target node, if it were there.
- *
- * Assumptions:
- * parent is not null and it does not contain name */
- //Used for Add and Remove
-node_t *searchAR(char *name, node_t * parent, node_t ** parentpp) {
-	//Same as SearchQ jsut with readlocks instead
-    node_t *next;
-    node_t *result;
-
-    pthread_rwlock_wrlock(&(parent->mutex_node_lock));
-
-    if (strcmp(name, parent->name) < 0) next = parent->lchild;
-    else next = parent->rchild;
-
-    if (next == NULL) 
-    {
-		result = NULL;
-    } 
-    else 
-    {
-		if (strcmp(name, next->name) == 0) 
-		{
-		    /* Note that this falls through to the if (parentpp .. ) statement
-		     * below. */
-		    result = next;
-		} 
-		else 
+/* Unlink the last node on path from shard sh's tree and rebalance.  The path must be
+ * locked from the parent of its deepest safe node (for a delete) down;
+ * everything is unlocked on return.  See inline comments for algorithmic
+ * details. */
+static void remove_locked(shard_t *sh, path_t *path)
+{
+	node_t *dnode;	    /* Node to delete */
+	node_t *next;	    /* Next node down the tree */
+	node_t *gone;	    /* The node that actually leaves the tree */
+	node_t *parent;	    /* Parent of the node being unlinked */
+	node_t *dparent;    /* dnode's parent */
+	int at;		    /* dnode's place on the path */
+
+	dnode = path->node[path->n - 1];
+	if (dnode->lchild == 0 || dnode->rchild == 0)
+	{
+		/* The easy cases: with at most one child, that child replaces the
+		 * node in its parent.  dnode's version is bumped too so anyone
+		 * holding on to it knows it is gone. */
+		parent = path->node[path->n - 2];
+		write_begin(parent);
+		write_begin(dnode);
+		relink(parent, dnode, (dnode->lchild) ? dnode->lchild : dnode->rchild);
+		write_end(dnode);
+		write_end(parent);
+		gone = dnode;
+	}
+	else
+	{
+	    /* So much for the easy cases ...
+	     * We know that all nodes in a node's right subtree have
+	     * lexicographically greater names than the node does, and all
+	     * nodes in a node's left subtree have lexicographically smaller
+	     * names than the node does. So, we find the lexicographically
+	     * smallest node in the right subtree and replace the node to be
+	     * deleted with that node. This new node thus is lexicographically
+	     * smaller than all nodes in its right subtree, and greater than
+	     * all nodes in its left subtree. Thus the modified tree is well
+	     * formed.  The node itself moves, not just its contents, since short
+	     * names and values live inside the node's allocation.
+	     *
+	     * dnode's height cannot change if it is balanced, so it is safe to
+	     * let go of what is above it.  Below it everything stays locked. */
+		at = path->n - 1;
+		if (balance(dnode) == 0) path_release_above(path, at - 1);
+
+		//Lock as you traverse down the tree
+		next = dnode->rchild;
+		path_push(path, next);
+		while (next->lchild != 0)
 		{
-		    /* "We have to go deeper!" This recurses and returns from here
-		     * after the recursion has returned result and set parentpp */
-
-			pthread_rwlock_unlock(&(parent->mutex_node_lock));
-		    result = searchAR(name, next, parentpp);
-		    return result;
+		    /* work our way down the lchild chain, finding the smallest
+		     * node in the subtree. */
+			next = next->lchild;
+			path_push(path, next);
 		}
-    }
 
-    /* record a parent if we are looking for one */
-    if (parentpp != 0) 
-    {
-    	*parentpp = parent;
-    }
+		parent = path->node[path->n - 2];
+		dparent = path->node[at - 1];
+		__atomic_fetch_add(&sh->moves_started, 1, __ATOMIC_RELAXED);
+		write_begin(dparent);
+		write_begin(dnode);
+		if (parent != dnode) write_begin(parent);
+		write_begin(next);
 
-    if(result != NULL)
-    {
-    	pthread_rwlock_wrlock(&(result->mutex_node_lock));
-    }
+		if (parent != dnode)
+		{
+			STORE(parent->lchild, next->rchild);
+			STORE(next->rchild, dnode->rchild);
+		}
+		STORE(next->lchild, dnode->lchild);
+		next->height = dnode->height;
+		relink(dparent, dnode, next);
+
+		write_end(next);
+		if (parent != dnode) write_end(parent);
+		write_end(dnode);
+		write_end(dparent);
+		__atomic_fetch_add(&sh->moves_done, 1, __ATOMIC_RELEASE);
+
+		//next has taken dnode's place on the path as well as in the tree;
+		//the last entry on the path is now a stale copy of it
+		path->node[at] = next;
+		gone = dnode;
+	}
 
-    return (result);
+	/* Drop the last entry on the path (gone, or the node that replaced it)
+	 * and rebalance what is above it */
+	path->n--;
+	retrace(path, path->n - 1, 1);
+	path_unlock(path);
+
+	//Anyone else after gone's lock is a writer that found it optimistically.
+	//It will see gone's version has moved and let go, and being inside an
+	//epoch it keeps gone from being freed until then.
+	RWUNLOCK(&(gone->mutex_node_lock));
+	epoch_retire(gone, node_reclaim);
 }
 
+/* Remove the node with key name from the tree if it is there.  Return true
+ * if something was deleted. */
+int xremove(char *name) 
+{
+	shard_t *sh = shard_of(name);
+	path_t path;	    /* Locked nodes from head down to the node unlinked */
+	node_t *next;	    /* Next node down the tree */
+	unsigned long moves;
+	int tries, top, i, cmp;
 
-/* Search the tree, starting at parent, for a node containing name (the "target
- * node").  Return a pointer to the node, if found, otherwise return 0.  If
- * parentpp is not 0, then it points to a location at which the address of the
- * parent of the target node is stored.  If the target node is not found, the
- * location pointed to by parentpp is set to what would be the the address of
- * the parent of the target node, if it were there.
- *
- * Assumptions:
- * parent is not null and it does not contain name */
- //USed for Remove
-//node_t *searchR(char *name, node_t * parent, node_t ** parentpp) {
-//
-//    node_t *next;
-//    node_t *result;
-//
-//    pthread_rwlock_wrlock(&(parent->mutex_node_lock));
-//
-//   if (strcmp(name, parent->name) < 0) next = parent->lchild;
-//    else next = parent->rchild;
-//
-//    if (next == NULL) 
-//    {
-//		result = NULL;
-//    } 
-//    else 
-//    {
-//		if (strcmp(name, next->name) == 0) 
-//		{
-//		    /* Note that this falls through to the if (parentpp .. ) statement
-//		     * below. */
-//		    result = next;
-//		} 
-//		else 
-//		{
-//		    /* "We have to go deeper!" This recurses and returns from here
-//		     * after the recursion has returned result and set parentpp */
-//			pthread_rwlock_unlock(&(parent->mutex_node_lock));
-//		    result = searchR(name, next, parentpp);
-//		    return result;
-//		}
-//    }
-//
-//  /* record a parent if we are looking for one */
-//    if (parentpp != 0)
-//    {
-//		*parentpp = parent;
-//	}
-//
-//	if(result != NULL)
-//    {
-//    	pthread_rwlock_wrlock(&(result->mutex_node_lock));
-//    }
-//
-//    return (result);
-//}
+	for (tries = 0; tries < OLC_TRIES; tries++)
+	{
+		epoch_enter();
+		if (!olc_search(sh, name, &path, &cmp, &moves))
+		{
+			//Not there, as long as no key was moved up past the search
+			if (__atomic_load_n(&sh->moves_started, __ATOMIC_RELAXED) == moves)
+			{
+				epoch_exit();
+				return 0;
+			}
+			epoch_exit();
+			continue;
+		}
 
+		//dnode itself is dealt with by remove_locked()
+		for (top = 0, i = 1; i < path.n - 1; i++)
+		{
+			if (balance(path.node[i]) == 0) top = i - 1;
+		}
+		if (olc_lock(&path, top))
+		{
+			//The safe node has to still be safe now that it is locked
+			for (i = path.n - 2; i > top && balance(path.node[i]) != 0; i--)
+				;
+			if (i > top || top == 0)
+			{
+				epoch_exit();
+				if (i > top) path_release_above(&path, i - 1);
+				remove_locked(sh, &path);
+				return 1;
+			}
+			path_unlock(&path);
+		}
+		epoch_exit();
+	}
+
+	//Too busy to get in optimistically; lock all the way from head
+	path.top = path.n = 0;
+	path_push(&path, &sh->head);
+	next = sh->head.rchild;
+
+	/* first, find the node to be removed */
+	while (next != NULL)
+	{
+		path_push(&path, next);
+		if ((cmp = strcmp(name, next->name)) == 0)
+		{
+			remove_locked(sh, &path);
+			return 1;
+		}
+		//Nothing above this node's parent can change, let it go
+		if (balance(next) == 0) path_release_above(&path, path.n - 2);
+		next = (cmp < 0) ? next->lchild : next->rchild;
+	}
+
+	/* it's not there */
+	path_unlock(&path);
+	return 0;
+}
 
 /*
- * Parse the command in command, execute it on the DB rooted at head and return
- * a string describing the results.  Response must be a writable string that
- * can hold len characters.  The response is stored in response.
+ * Batch versions of query(), add() and xremove() (see db.h).  Queries here
+ * take no locks and writers lock only the few nodes they change, so there is
+ * no lock acquisition to share, and a descent shared by many keys would have
+ * to hold locks that single writers could otherwise get past.  The keys are
+ * just done one at a time in name order, so that each descent finds the
+ * nodes near the top, and often much of its path, in cache from the one
+ * before.
  */
-void interpret_command(char *command, char *response, int len)
+int query_batch(char **names, char **results, int len, int n)
 {
-    char value[256];
-    char ibuf[256];
-    char name[256];
+	batch_key_t *k = db_batch_sort(names, n);
+	int found = 0;
+	int i;
 
-    if (strlen(command) <= 1) {
-	strncpy(response, "ill-formed command", len - 1);
-	return;
-    }
+	for (i = 0; i < n; i++)
+	{
+		int at = k ? k[i].i : i;
 
-    switch (command[0]) {
-    case 'q':
-	/* Query */
-	sscanf(&command[1], "%255s", name);
-	if (strlen(name) == 0) {
-	    strncpy(response, "ill-formed command", len - 1);
-	    return;
+		query(names[at], results[at], len);
+		if (strcmp(results[at], "not found") != 0) found++;
 	}
+	free(k);
+	return found;
+}
 
-	query(name, response, len);
-	if (strlen(response) == 0) {
-	    strncpy(response, "not found", len - 1);
-	}
+int add_batch(char **names, char **values, int *added, int n)
+{
+	batch_key_t *k = db_batch_sort(names, n);
+	int count = 0;
+	int i;
 
-	return;
+	for (i = 0; i < n; i++)
+	{
+		int at = k ? k[i].i : i;
 
-    case 'a':
-	/* Add to the database */
-	sscanf(&command[1], "%255s %255s", name, value);
-	if ((strlen(name) == 0) || (strlen(value) == 0)) {
-	    strncpy(response, "ill-formed command", len - 1);
-	    return;
+		count += (added[at] = add(names[at], values[at]));
 	}
+	free(k);
+	return count;
+}
 
-	if (add(name, value)) {
-	    strncpy(response, "added", len - 1);
-	} else {
-	    strncpy(response, "already in database", len - 1);
-	}
+int xremove_batch(char **names, int *removed, int n)
+{
+	batch_key_t *k = db_batch_sort(names, n);
+	int count = 0;
+	int i;
 
-	return;
+	for (i = 0; i < n; i++)
+	{
+		int at = k ? k[i].i : i;
 
-    case 'd':
-	/* Delete from the database */
-	sscanf(&command[1], "%255s", name);
-	if (strlen(name) == 0) {
-	    strncpy(response, "ill-formed command", len - 1);
-	    return;
+		count += (removed[at] = xremove(names[at]));
 	}
+	free(k);
+	return count;
+}
 
-	if (xremove(name)) {
-	    strncpy(response, "removed", len - 1);
-	} else {
-	    strncpy(response, "not in database", len - 1);
-	}
+/* In-order walk of the subtree rooted at node for db_walk().  Returns
+ * nonzero if fn asked to stop. */
+static int walk(node_t *node, int (*fn)(char *, char *, void *), void *arg) {
+    if (!node) return 0;
+    return walk(node->lchild, fn, arg) ||
+	fn(node->name, node->value, arg) ||
+	walk(node->rchild, fn, arg);
+}
 
-	    return;
+/* Free every node of a subtree nothing else can see */
+static void free_tree(node_t *node) {
+    if (!node) return;
+    free_tree(node->lchild);
+    free_tree(node->rchild);
+    node_destroy(node);
+}
 
-    case 'f':
-	/* process the commands in a file (silently) */
-	sscanf(&command[1], "%255s", name);
-	if (name[0] == '\0') {
-	    strncpy(response, "ill-formed command", len - 1);
-	    return;
-	}
+/* Build a perfectly balanced subtree from the sorted pairs lo..hi (inclusive)
+ * for db_build().  Sets *ok to 0 and returns what it has if a node cannot be
+ * made. */
+static node_t *build(char **names, char **values, int lo, int hi, int *ok) {
+    node_t *node;
+    int mid;
+
+    if (lo > hi || !*ok) return NULL;
+    mid = lo + (hi - lo) / 2;
+    if (!(node = node_create(names[mid], values[mid], NULL, NULL))) {
+	*ok = 0;
+	return NULL;
+    }
+    node->lchild = build(names, values, lo, mid - 1, ok);
+    node->rchild = build(names, values, mid + 1, hi, ok);
+    node->height = 1 + (height(node->lchild) > height(node->rchild) ?
+	    height(node->lchild) : height(node->rchild));
+    return node;
+}
+
+/* Read lock every node of the subtree rooted at node, parents first.  Each
+ * node's children are read only once it is locked, so they are current. */
+static void lock_tree(node_t *node) {
+    if (!node) return;
+    pthread_rwlock_rdlock(&(node->mutex_node_lock));
+    lock_tree(node->lchild);
+    lock_tree(node->rchild);
+}
 
+static void unlock_tree(node_t *node) {
+    if (!node) return;
+    unlock_tree(node->lchild);
+    unlock_tree(node->rchild);
+    pthread_rwlock_unlock(&(node->mutex_node_lock));
+}
+
+/* Call fn on every pair, shard by shard in key order.  Writers no longer all
+ * pass through head, so to hold the DB still the walk read locks every node
+ * of every shard, from head down the way writers lock.  Once it has them all
+ * no writer can change anything and the walk sees one consistent state;
+ * lock-free queries carry on meanwhile.  Stops early if fn returns nonzero. */
+void db_walk(int (*fn)(char *, char *, void *), void *arg) {
+    int i;
+
+    pthread_once(&shards_once, shards_init);
+    for (i = 0; i < db_nshards; i++) {
+	pthread_rwlock_rdlock(&(shards[i].head.mutex_node_lock));
+	lock_tree(shards[i].head.rchild);
+    }
+    for (i = 0; i < db_nshards; i++)
+	if (walk(shards[i].head.rchild, fn, arg)) break;
+    for (i = db_nshards - 1; i >= 0; i--) {
+	unlock_tree(shards[i].head.rchild);
+	pthread_rwlock_unlock(&(shards[i].head.mutex_node_lock));
+    }
+}
+
+/* Fill the empty DB with the n pairs in names/values, which are sorted by
+ * name with no duplicates, as one balanced tree per shard.  Each finished
+ * tree is published with a single store, so a concurrent query sees either
+ * none of it or all of it.  Returns false, leaving the DB alone, if it is not
+ * empty or memory runs out. */
+int db_build(char **names, char **values, int n) {
+    node_t *roots[DB_SHARDS_MAX];
+    int start[DB_SHARDS_MAX + 1];
+    char **snames, **svalues;
+    int ok = 1;
+    int i;
+
+    pthread_once(&shards_once, shards_init);
+    if (!db_partition(names, values, n, &snames, &svalues, start)) return 0;
+    for (i = 0; i < db_nshards; i++) {
+	pthread_rwlock_wrlock(&(shards[i].head.mutex_node_lock));
+	if (shards[i].head.rchild) ok = 0;
+    }
+    for (i = 0; i < db_nshards; i++)
+	roots[i] = build(snames, svalues, start[i], start[i + 1] - 1, &ok);
+    for (i = 0; i < db_nshards; i++) {
+	node_t *head = &shards[i].head;
+
+	if (ok) {
+	    write_begin(head);
+	    __atomic_store_n(&head->rchild, roots[i], __ATOMIC_RELEASE);
+	    write_end(head);
+	} else free_tree(roots[i]);
+    }
+    for (i = db_nshards - 1; i >= 0; i--)
+	pthread_rwlock_unlock(&(shards[i].head.mutex_node_lock));
+    free(snames);
+    free(svalues);
+    return ok;
+}
+
+/*
+ * db_scan_merge() batch: a shard's next max pairs.  Each one is found by
+ * walking down from head with lock coupling, read locking a node before
+ * letting go of its parent, so a scan never holds more than two node locks
+ * and writers elsewhere in the tree carry on.  Since the locks are taken top
+ * down, as writers take theirs, the walk cannot be overtaken by a change
+ * above it, and it ends at the least name after from as of when it passed
+ * that node.  Names and values never change once a node is made, and inside
+ * an epoch the node cannot be freed, so it is safe to read after its lock
+ * is gone.
+ */
+static void scan_shard(int s, char *from, int after, char *hi, int max,
+	int (*fn)(char *, char *, void *), void *arg)
+{
+	node_t *node, *next, *found;
+	int cmp;
+
+	epoch_enter();
+	while (max-- > 0)
 	{
-	    FILE *finput = fopen(name, "r");
-	    if (!finput) {
-		strncpy(response, "bad file name", len - 1);
-		return;
-	    }
-	    while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
-		interpret_command(ibuf, response, len);
-	    }
-	    fclose(finput);
+		found = NULL;
+		node = &shards[s].head;
+		RDLOCK(&(node->mutex_node_lock));
+		next = node->rchild;
+		while (next != NULL)
+		{
+			RDLOCK(&(next->mutex_node_lock));
+			RWUNLOCK(&(node->mutex_node_lock));
+			node = next;
+			if ((cmp = strcmp(node->name, from)) > 0 || (cmp == 0 && !after))
+			{
+				found = node;
+				if (cmp == 0) break;
+				next = node->lchild;
+			}
+			else next = node->rchild;
+		}
+		RWUNLOCK(&(node->mutex_node_lock));
+
+		if (!found || (hi && strcmp(found->name, hi) >= 0)) break;
+		if (fn(found->name, found->value, arg)) break;
+		from = found->name;
+		after = 1;
 	}
-	strncpy(response, "file processed", len - 1);
-	return;
+	epoch_exit();
+}
 
-    default:
-	strncpy(response, "ill-formed command", len - 1);
-	return;
-    }
+long db_scan(char *lo, char *hi, int (*fn)(char *, char *, void *), void *arg) {
+    pthread_once(&shards_once, shards_init);
+    return db_scan_merge(lo, hi, fn, arg, scan_shard);
+}
+
+/* This backend keeps no statistics */
+void db_stats(FILE *f) {
+    (void) f;
 }
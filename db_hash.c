@@ -0,0 +1,614 @@
+#include "db.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "slab.h"
+#include "lockprof.h"
+
+/*
+ * A chained hash table implementation of the db.h interface.  Instead of one
+ * lock at the root of a tree, the buckets are split into NSTRIPES groups
+ * ("stripes") that each have their own reader/writer lock, so clients working
+ * on unrelated keys rarely touch the same lock.  Bucket b belongs to stripe
+ * b % NSTRIPES.
+ *
+ * The table doubles when it gets too full.  Rather than rehashing everything
+ * at once, the old table is kept around and each writer moves a few of its
+ * own stripe's buckets into the new one while it holds that stripe's lock.
+ * Table sizes are powers of two and multiples of NSTRIPES, so a bucket and
+ * both of the buckets it splits into belong to the same stripe, and one
+ * stripe lock covers a key in either table.  The table pointers themselves
+ * only change while every stripe lock is held.
+ */
+
+/* Number of lock stripes (a power of two) */
+#define NSTRIPES 64
+/* Buckets in a fresh table (a power of two multiple of NSTRIPES) */
+#define INITIAL_BUCKETS 1024
+/* Average chain length that makes the table double */
+#define MAX_LOAD 2
+/* Old buckets a writer moves to the new table while a resize is going on */
+#define MIGRATE_STEP 4
+
+/* A key/value pair on a bucket's chain */
+typedef struct Entry {
+	char *name;
+	char *value;
+	unsigned long hash;	/* hash of name, to skip most strcmps */
+	struct Entry *next;
+} entry_t;
+
+/* A lock stripe.  Each one gets its own cache line so that clients on
+ * different stripes don't bounce each other's line around. */
+typedef struct Stripe {
+	pthread_rwlock_t lock;
+	long count;	    /* Entries in this stripe's buckets */
+	long migrated;	    /* This stripe's old buckets moved so far */
+} __attribute__((aligned(64))) stripe_t;
+
+static stripe_t stripes[NSTRIPES];
+
+static entry_t **table = NULL;	    /* Current buckets */
+static unsigned long nbuckets = 0;
+static entry_t **old_table = NULL;  /* Table being drained, if resizing */
+static unsigned long old_nbuckets = 0;
+/* Stripes that have finished draining the old table */
+static int stripes_done = 0;
+
+/* Serializes starting and finishing resizes */
+pthread_mutex_t mutex_resize = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+/* Set up the stripe locks and the initial table. */
+static void hash_init(void) {
+    int i;
+
+    for (i = 0; i < NSTRIPES; i++) {
+	pthread_rwlock_init(&stripes[i].lock, NULL);
+	stripes[i].count = 0;
+	stripes[i].migrated = 0;
+    }
+    if (!(table = (entry_t **) calloc(INITIAL_BUCKETS, sizeof(entry_t *)))) {
+	perror("hash table");
+	exit(1);
+    }
+    nbuckets = INITIAL_BUCKETS;
+}
+
+/* 64-bit FNV-1a of name, with a final mix so the low bits (which pick the
+ * bucket and stripe) depend on every character. */
+static inline unsigned long hash_name(char *name) {
+    unsigned long long h = 14695981039346656037ULL;
+
+    while (*name) {
+	h ^= (unsigned char) *name++;
+	h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (unsigned long) h;
+}
+
+/* The stripe protecting every bucket name can hash to */
+static inline stripe_t *stripe_of(unsigned long hash) {
+    return &stripes[hash & (NSTRIPES - 1)];
+}
+
+/* Return the address of the chain that holds (or would hold) a key with the
+ * given hash.  The caller must hold the key's stripe lock. */
+static entry_t **bucket_of(unsigned long hash) {
+    if (old_table) {
+	/* Still in the old table unless its stripe has moved it already */
+	unsigned long ob = hash & (old_nbuckets - 1);
+
+	if ((long) (ob / NSTRIPES) >= stripe_of(hash)->migrated)
+	    return &old_table[ob];
+    }
+    return &table[hash & (nbuckets - 1)];
+}
+
+/* Move up to max of stripe s's old buckets to the new table.  The caller
+ * holds the stripe's write lock.  Return true if this finished the last
+ * stripe, in which case the caller should call resize_finish() once it has
+ * dropped the lock. */
+static int migrate(int s, int max) {
+    stripe_t *stripe = &stripes[s];
+    long per_stripe = old_nbuckets / NSTRIPES;
+    entry_t *e, *next;
+    entry_t **b;
+
+    if (!old_table || stripe->migrated >= per_stripe) return 0;
+
+    while (max-- > 0 && stripe->migrated < per_stripe) {
+	b = &old_table[stripe->migrated * NSTRIPES + s];
+	for (e = *b; e; e = next) {
+	    next = e->next;
+	    e->next = table[e->hash & (nbuckets - 1)];
+	    table[e->hash & (nbuckets - 1)] = e;
+	}
+	*b = NULL;
+	stripe->migrated++;
+    }
+    if (stripe->migrated < per_stripe) return 0;
+    return __atomic_add_fetch(&stripes_done, 1, __ATOMIC_ACQ_REL) == NSTRIPES;
+}
+
+/* Write lock every stripe, in order so two callers can't deadlock */
+static void lock_all(void) {
+    int i;
+
+    for (i = 0; i < NSTRIPES; i++) pthread_rwlock_wrlock(&stripes[i].lock);
+}
+
+static void unlock_all(void) {
+    int i;
+
+    for (i = NSTRIPES - 1; i >= 0; i--) pthread_rwlock_unlock(&stripes[i].lock);
+}
+
+/* Drain whatever is left of the old table and free it.  Callers hold every
+ * stripe lock. */
+static void drain_old_table(void) {
+    int i;
+
+    if (!old_table) return;
+    for (i = 0; i < NSTRIPES; i++) migrate(i, old_nbuckets / NSTRIPES);
+    free(old_table);
+    old_table = NULL;
+    old_nbuckets = 0;
+}
+
+/* Retire the old table once every stripe has moved its buckets out. */
+static void resize_finish(void) {
+    pthread_mutex_lock(&mutex_resize);
+    lock_all();
+    /* A resize_start() may have beaten us to it and begun another one */
+    if (stripes_done == NSTRIPES) drain_old_table();
+    unlock_all();
+    pthread_mutex_unlock(&mutex_resize);
+}
+
+/* Start doubling the table if it is still over its load limit once we have
+ * everything locked.  A resize that is still in progress is completed first
+ * so at most two tables ever exist. */
+static void resize_start(void) {
+    entry_t **new_table;
+    long total = 0;
+    int i;
+
+    pthread_mutex_lock(&mutex_resize);
+    lock_all();
+    drain_old_table();
+
+    for (i = 0; i < NSTRIPES; i++) total += stripes[i].count;
+    if (total > (long) nbuckets * MAX_LOAD &&
+	    (new_table = (entry_t **) calloc(2 * nbuckets, sizeof(entry_t *)))) {
+	old_table = table;
+	old_nbuckets = nbuckets;
+	table = new_table;
+	nbuckets *= 2;
+	for (i = 0; i < NSTRIPES; i++) stripes[i].migrated = 0;
+	stripes_done = 0;
+    }
+
+    unlock_all();
+    pthread_mutex_unlock(&mutex_resize);
+}
+
+/*
+ * Allocate a new entry with the given key, value and hash.  Short names and
+ * values are stored right after the entry, in the same allocation.
+ */
+static entry_t *entry_create(char *arg_name, char *arg_value, unsigned long hash) {
+    size_t nlen = strlen(arg_name) + 1;
+    size_t vlen = strlen(arg_value) + 1;
+    entry_t *new_entry;
+
+    if (sizeof(entry_t) + nlen + vlen <= NODE_INLINE_MAX) {
+	if (!(new_entry = (entry_t *) slab_alloc(sizeof(entry_t) + nlen + vlen)))
+	    return NULL;
+	new_entry->name = (char *) (new_entry + 1);
+	new_entry->value = new_entry->name + nlen;
+    } else {
+	if (!(new_entry = (entry_t *) slab_alloc(sizeof(entry_t)))) return NULL;
+
+	if (!(new_entry->name = (char *) slab_alloc(nlen))) {
+	    slab_free(new_entry, sizeof(entry_t));
+	    return NULL;
+	}
+
+	if (!(new_entry->value = (char *) slab_alloc(vlen))) {
+	    slab_free(new_entry->name, nlen);
+	    slab_free(new_entry, sizeof(entry_t));
+	    return NULL;
+	}
+    }
+
+    memcpy(new_entry->name, arg_name, nlen);
+    memcpy(new_entry->value, arg_value, vlen);
+    new_entry->hash = hash;
+    new_entry->next = NULL;
+    return new_entry;
+}
+
+/* Free the data structures in entry and the entry itself. */
+static void entry_destroy(entry_t *entry) {
+    size_t nlen = strlen(entry->name) + 1;
+    size_t vlen = strlen(entry->value) + 1;
+
+    if (entry->name == (char *) (entry + 1)) {
+	slab_free(entry, sizeof(entry_t) + nlen + vlen);
+	return;
+    }
+    slab_free(entry->name, nlen);
+    slab_free(entry->value, vlen);
+    slab_free(entry, sizeof(entry_t));
+}
+
+/* Return the address of the pointer to the entry with key name on the chain
+ * at b, or of the chain's terminating NULL if it is not there. */
+static inline entry_t **find(entry_t **b, char *name, unsigned long hash) {
+    for ( ; *b; b = &(*b)->next) {
+	if ((*b)->hash == hash && strcmp((*b)->name, name) == 0) break;
+    }
+    return b;
+}
+
+/* Find the node with key name and return a result or error string in result.
+ * Result must have space for len characters. */
+void query(char *name, char *result, int len) {
+    unsigned long hash;
+    stripe_t *stripe;
+    entry_t *target;
+
+    pthread_once(&hash_once, hash_init);
+    hash = hash_name(name);
+    stripe = stripe_of(hash);
+
+    RDLOCK(&stripe->lock);
+    if ((target = *find(bucket_of(hash), name, hash)))
+	strncpy(result, target->value, len - 1);
+    else
+	strncpy(result, "not found", len - 1);
+    RWUNLOCK(&stripe->lock);
+}
+
+/* Insert a node with name and value into the table.  Return true if it was
+ * added, false if the key was already there. */
+int add(char *name, char *value) {
+    unsigned long hash;
+    stripe_t *stripe;
+    entry_t **b;
+    entry_t *newentry;
+    int grow;	    /* Did this add push the stripe over its share of load? */
+    int finish;	    /* Did we move the last old bucket? */
+
+    pthread_once(&hash_once, hash_init);
+    hash = hash_name(name);
+    stripe = stripe_of(hash);
+
+    WRLOCK(&stripe->lock);
+    finish = migrate(hash & (NSTRIPES - 1), MIGRATE_STEP);
+
+    if (*(b = find(bucket_of(hash), name, hash)) ||
+	    !(newentry = entry_create(name, value, hash))) {
+	/* Already in the table (or out of memory) */
+	RWUNLOCK(&stripe->lock);
+	if (finish) resize_finish();
+	return 0;
+    }
+    /* find() left b at the end of the chain */
+    *b = newentry;
+    stripe->count++;
+    grow = stripe->count * NSTRIPES > (long) nbuckets * MAX_LOAD;
+    RWUNLOCK(&stripe->lock);
+
+    if (finish) resize_finish();
+    if (grow) resize_start();
+    return 1;
+}
+
+/* Remove the entry with key name from the table if it is there.  Return true
+ * if something was deleted. */
+int xremove(char *name) {
+    unsigned long hash;
+    stripe_t *stripe;
+    entry_t **b;
+    entry_t *dentry;
+    int finish;	    /* Did we move the last old bucket? */
+
+    pthread_once(&hash_once, hash_init);
+    hash = hash_name(name);
+    stripe = stripe_of(hash);
+
+    WRLOCK(&stripe->lock);
+    finish = migrate(hash & (NSTRIPES - 1), MIGRATE_STEP);
+
+    if ((dentry = *(b = find(bucket_of(hash), name, hash)))) {
+	*b = dentry->next;
+	stripe->count--;
+    }
+    RWUNLOCK(&stripe->lock);
+
+    if (finish) resize_finish();
+    if (!dentry) return 0;
+    entry_destroy(dentry);
+    return 1;
+}
+
+/* Group a batch's n keys by stripe: sets *phash to their hashes and *porder
+ * to their positions, stripe s's keys (in the order given) being
+ * (*porder)[start[s]] up to (*porder)[start[s + 1]].  Returns 0 if out of
+ * memory. */
+static int batch_group(char **names, int n, unsigned long **phash, int **porder,
+	int *start) {
+    unsigned long *hash = (unsigned long *) malloc((n ? n : 1) * sizeof(unsigned long));
+    int *order = (int *) malloc((n ? n : 1) * sizeof(int));
+    int next[NSTRIPES];
+    int i, s;
+
+    if (!hash || !order) {
+	free(hash);
+	free(order);
+	return 0;
+    }
+    for (s = 0; s <= NSTRIPES; s++) start[s] = 0;
+    for (i = 0; i < n; i++) {
+	hash[i] = hash_name(names[i]);
+	start[(hash[i] & (NSTRIPES - 1)) + 1]++;
+    }
+    for (s = 0; s < NSTRIPES; s++) {
+	start[s + 1] += start[s];
+	next[s] = start[s];
+    }
+    for (i = 0; i < n; i++) order[next[hash[i] & (NSTRIPES - 1)]++] = i;
+    *phash = hash;
+    *porder = order;
+    return 1;
+}
+
+/* Batch versions of query(), add() and xremove() (see db.h).  Each stripe's
+ * keys are done under one acquisition of its lock.  Without the memory to
+ * group them the keys are done one by one. */
+int query_batch(char **names, char **results, int len, int n) {
+    int start[NSTRIPES + 1];
+    unsigned long *hash;
+    int *order;
+    entry_t *target;
+    int found = 0;
+    int i, s;
+
+    if (!batch_group(names, n, &hash, &order, start)) {
+	for (i = 0; i < n; i++) {
+	    query(names[i], results[i], len);
+	    if (strcmp(results[i], "not found") != 0) found++;
+	}
+	return found;
+    }
+    pthread_once(&hash_once, hash_init);
+    for (s = 0; s < NSTRIPES; s++) {
+	if (start[s] == start[s + 1]) continue;
+	RDLOCK(&stripes[s].lock);
+	for (i = start[s]; i < start[s + 1]; i++) {
+	    int at = order[i];
+
+	    if ((target = *find(bucket_of(hash[at]), names[at], hash[at]))) {
+		strncpy(results[at], target->value, len - 1);
+		found++;
+	    } else
+		strncpy(results[at], "not found", len - 1);
+	}
+	RWUNLOCK(&stripes[s].lock);
+    }
+    free(hash);
+    free(order);
+    return found;
+}
+
+int add_batch(char **names, char **values, int *added, int n) {
+    int start[NSTRIPES + 1];
+    unsigned long *hash;
+    int *order;
+    entry_t **b;
+    entry_t *newentry;
+    int count = 0;
+    int grow, finish;
+    int i, s;
+
+    if (!batch_group(names, n, &hash, &order, start)) {
+	for (i = 0; i < n; i++) count += (added[i] = add(names[i], values[i]));
+	return count;
+    }
+    pthread_once(&hash_once, hash_init);
+    for (s = 0; s < NSTRIPES; s++) {
+	if (start[s] == start[s + 1]) continue;
+	finish = 0;
+	WRLOCK(&stripes[s].lock);
+	for (i = start[s]; i < start[s + 1]; i++) {
+	    int at = order[i];
+
+	    /* Each add moves its share of the old table, as add() does */
+	    finish |= migrate(s, MIGRATE_STEP);
+	    added[at] = 0;
+	    if (*(b = find(bucket_of(hash[at]), names[at], hash[at])) ||
+		    !(newentry = entry_create(names[at], values[at], hash[at])))
+		continue;
+	    *b = newentry;
+	    stripes[s].count++;
+	    added[at] = 1;
+	    count++;
+	}
+	grow = stripes[s].count * NSTRIPES > (long) nbuckets * MAX_LOAD;
+	RWUNLOCK(&stripes[s].lock);
+
+	if (finish) resize_finish();
+	if (grow) resize_start();
+    }
+    free(hash);
+    free(order);
+    return count;
+}
+
+int xremove_batch(char **names, int *removed, int n) {
+    int start[NSTRIPES + 1];
+    unsigned long *hash;
+    int *order;
+    entry_t **b;
+    entry_t *dentry;
+    entry_t *gone = NULL;	/* Unlinked entries, chained to be freed */
+    int count = 0;
+    int finish;
+    int i, s;
+
+    if (!batch_group(names, n, &hash, &order, start)) {
+	for (i = 0; i < n; i++) count += (removed[i] = xremove(names[i]));
+	return count;
+    }
+    pthread_once(&hash_once, hash_init);
+    for (s = 0; s < NSTRIPES; s++) {
+	if (start[s] == start[s + 1]) continue;
+	finish = 0;
+	WRLOCK(&stripes[s].lock);
+	for (i = start[s]; i < start[s + 1]; i++) {
+	    int at = order[i];
+
+	    finish |= migrate(s, MIGRATE_STEP);
+	    removed[at] = 0;
+	    if ((dentry = *(b = find(bucket_of(hash[at]), names[at], hash[at])))) {
+		*b = dentry->next;
+		stripes[s].count--;
+		dentry->next = gone;
+		gone = dentry;
+		removed[at] = 1;
+		count++;
+	    }
+	}
+	RWUNLOCK(&stripes[s].lock);
+
+	if (finish) resize_finish();
+    }
+    /* Freed outside the locks, as xremove() does */
+    while ((dentry = gone)) {
+	gone = dentry->next;
+	entry_destroy(dentry);
+    }
+    free(hash);
+    free(order);
+    return count;
+}
+
+/* Call fn on every pair, in no particular order, holding every stripe's read
+ * lock so the walk sees one consistent state while queries carry on.  Stops
+ * early if fn returns nonzero. */
+void db_walk(int (*fn)(char *, char *, void *), void *arg) {
+    entry_t *e;
+    unsigned long b;
+    int i;
+
+    pthread_once(&hash_once, hash_init);
+    for (i = 0; i < NSTRIPES; i++) pthread_rwlock_rdlock(&stripes[i].lock);
+    /* Buckets already moved out of the old table are empty */
+    for (b = 0; b < old_nbuckets; b++)
+	for (e = old_table[b]; e; e = e->next)
+	    if (fn(e->name, e->value, arg)) goto done;
+    for (b = 0; b < nbuckets; b++)
+	for (e = table[b]; e; e = e->next)
+	    if (fn(e->name, e->value, arg)) goto done;
+done:
+    for (i = NSTRIPES - 1; i >= 0; i--) pthread_rwlock_unlock(&stripes[i].lock);
+}
+
+/* Fill the empty DB with the n pairs in names/values.  Order does not matter
+ * to a hash table, so this is just the adds.  Returns false, leaving the DB
+ * alone, if it is not empty. */
+int db_build(char **names, char **values, int n) {
+    long total = 0;
+    int i;
+
+    pthread_once(&hash_once, hash_init);
+    for (i = 0; i < NSTRIPES; i++) total += stripes[i].count;
+    if (total) return 0;
+    for (i = 0; i < n; i++) add(names[i], values[i]);
+    return 1;
+}
+
+/* The pairs db_scan() has copied out so far, each one name '\0' value '\0'
+ * in an allocation of its own */
+typedef struct Found {
+    char **pairs;
+    long n;
+    long size;
+} found_t;
+
+/* Copy e into found if it is in the range.  Returns 0 if out of memory. */
+static int scan_entry(found_t *found, entry_t *e, char *lo, char *hi) {
+    size_t nlen, vlen;
+    char *pair;
+
+    if (strcmp(e->name, lo) < 0 || (hi && strcmp(e->name, hi) >= 0)) return 1;
+    if (found->n == found->size) {
+	long nsize = found->size ? 2 * found->size : 64;
+	char **npairs = (char **) realloc(found->pairs, nsize * sizeof(char *));
+
+	if (!npairs) return 0;
+	found->pairs = npairs;
+	found->size = nsize;
+    }
+    nlen = strlen(e->name) + 1;
+    vlen = strlen(e->value) + 1;
+    if (!(pair = (char *) malloc(nlen + vlen))) return 0;
+    memcpy(pair, e->name, nlen);
+    memcpy(pair + nlen, e->value, vlen);
+    found->pairs[found->n++] = pair;
+    return 1;
+}
+
+/* qsort comparison for copied pairs, by name */
+static int by_name(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* The table keeps no order, so every bucket is looked at, one stripe at a
+ * time under its read lock; the pairs in the range are copied out and
+ * sorted before fn sees any of them. */
+long db_scan(char *lo, char *hi, int (*fn)(char *, char *, void *), void *arg) {
+    found_t found = { NULL, 0, 0 };
+    unsigned long b;
+    entry_t *e;
+    long count = 0, i;
+    int s, ok = 1;
+
+    pthread_once(&hash_once, hash_init);
+    for (s = 0; ok && s < NSTRIPES; s++) {
+	RDLOCK(&stripes[s].lock);
+	/* Buckets already moved out of the old table are empty */
+	for (b = s; ok && b < old_nbuckets; b += NSTRIPES)
+	    for (e = old_table[b]; ok && e; e = e->next)
+		ok = scan_entry(&found, e, lo, hi);
+	for (b = s; ok && b < nbuckets; b += NSTRIPES)
+	    for (e = table[b]; ok && e; e = e->next)
+		ok = scan_entry(&found, e, lo, hi);
+	RWUNLOCK(&stripes[s].lock);
+    }
+
+    if (ok) {
+	qsort(found.pairs, found.n, sizeof(char *), by_name);
+	for (i = 0; i < found.n; i++) {
+	    count++;
+	    if (fn(found.pairs[i], found.pairs[i] + strlen(found.pairs[i]) + 1,
+			arg))
+		break;
+	}
+    } else count = -1;
+    for (i = 0; i < found.n; i++) free(found.pairs[i]);
+    free(found.pairs);
+    return count;
+}
+
+/* This backend keeps no statistics */
+void db_stats(FILE *f) {
+    (void) f;
+}
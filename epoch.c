@@ -0,0 +1,162 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "epoch.h"
+
+/*
+ * Classic three-epoch reclamation.  There is a global epoch counter.  A thread
+ * entering a read section announces the epoch it saw; the global epoch can
+ * only move forward once every thread inside a read section has announced the
+ * current one.  Something retired while the global epoch was e was unlinked
+ * before any reader that starts in e+1, so once the global epoch reaches e+2
+ * no reader can still hold a pointer to it and it is freed.
+ *
+ * Each thread keeps its own list of retired objects and only looks at the
+ * other threads when that list gets long, so read sections cost a store and a
+ * fence and nothing shared is written on the read path.
+ */
+
+/* Retired objects a thread collects before it tries to free some */
+#define RETIRE_BATCH 64
+
+/* An object waiting to be freed */
+typedef struct Retired {
+    void *ptr;
+    void (*destroy)(void *);
+    unsigned long epoch;	/* global epoch when it was retired */
+} retired_t;
+
+/* Per thread state.  These are never freed; when a thread exits its record
+ * (and whatever it still had waiting) is picked up by the next new thread. */
+typedef struct EpochThread {
+    /* (epoch << 1) | 1 while in a read section, 0 otherwise */
+    unsigned long local;
+    int in_use;
+    retired_t *retired;
+    int nretired;
+    int cap;
+    struct EpochThread *next;
+} __attribute__((aligned(64))) epoch_thread_t;
+
+static unsigned long global_epoch = 1;
+/* All the thread records ever created.  Only ever pushed onto. */
+static epoch_thread_t *threads = NULL;
+/* Protects handing out thread records */
+static pthread_mutex_t mutex_threads = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static __thread epoch_thread_t *self = NULL;
+
+/* Thread exit: give the record back.  Anything still waiting to be freed
+ * stays on it for the next owner. */
+static void release_self(void *arg) {
+    epoch_thread_t *t = (epoch_thread_t *) arg;
+
+    __atomic_store_n(&t->local, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&mutex_threads);
+    t->in_use = 0;
+    pthread_mutex_unlock(&mutex_threads);
+}
+
+static void make_key(void) {
+    pthread_key_create(&thread_key, release_self);
+}
+
+/* Find or create this thread's record. */
+static epoch_thread_t *register_self(void) {
+    epoch_thread_t *t;
+
+    pthread_once(&key_once, make_key);
+    pthread_mutex_lock(&mutex_threads);
+    for (t = threads; t; t = t->next)
+	if (!t->in_use) break;
+    if (!t) {
+	if (!(t = (epoch_thread_t *) calloc(1, sizeof(epoch_thread_t)))) {
+	    perror("epoch");
+	    exit(1);
+	}
+	t->next = threads;
+	/* Readers of the list walk it without the lock */
+	__atomic_store_n(&threads, t, __ATOMIC_RELEASE);
+    }
+    t->in_use = 1;
+    pthread_mutex_unlock(&mutex_threads);
+
+    pthread_setspecific(thread_key, t);
+    return (self = t);
+}
+
+/* Start a read section. */
+void epoch_enter(void) {
+    epoch_thread_t *t = (self) ? self : register_self();
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    /* The announcement must be visible before any of the section's reads */
+    __atomic_store_n(&t->local, (e << 1) | 1, __ATOMIC_SEQ_CST);
+}
+
+/* End a read section. */
+void epoch_exit(void) {
+    __atomic_store_n(&self->local, 0, __ATOMIC_RELEASE);
+}
+
+/* Move the global epoch forward if every thread in a read section has seen
+ * the current one.  Return the (possibly new) global epoch. */
+static unsigned long try_advance(void) {
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    epoch_thread_t *t;
+    unsigned long local;
+
+    for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+	local = __atomic_load_n(&t->local, __ATOMIC_SEQ_CST);
+	if ((local & 1) && (local >> 1) != e) return e;
+    }
+    __atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0,
+	    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+/* Free everything on this thread's list that no reader can still see. */
+static void reclaim(epoch_thread_t *t) {
+    unsigned long e = try_advance();
+    int i, kept = 0;
+
+    for (i = 0; i < t->nretired; i++) {
+	if (t->retired[i].epoch + 2 <= e)
+	    t->retired[i].destroy(t->retired[i].ptr);
+	else
+	    t->retired[kept++] = t->retired[i];
+    }
+    t->nretired = kept;
+}
+
+/* Arrange for destroy(ptr) to be called once no read section can still be
+ * looking at ptr.  ptr must already be unreachable for new readers. */
+void epoch_retire(void *ptr, void (*destroy)(void *)) {
+    epoch_thread_t *t = (self) ? self : register_self();
+
+    if (t->nretired == t->cap) {
+	int ncap = (t->cap > 0) ? 2 * t->cap : RETIRE_BATCH;
+	retired_t *r = (retired_t *) realloc(t->retired, ncap * sizeof(retired_t));
+
+	if (!r) {
+	    /* Can't defer it, so wait until every current reader is done */
+	    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+	    while (try_advance() < e + 2)
+		sched_yield();
+	    destroy(ptr);
+	    return;
+	}
+	t->retired = r;
+	t->cap = ncap;
+    }
+    t->retired[t->nretired].ptr = ptr;
+    t->retired[t->nretired].destroy = destroy;
+    t->retired[t->nretired].epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    t->nretired++;
+
+    if (t->nretired % RETIRE_BATCH == 0) reclaim(t);
+}
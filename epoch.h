@@ -0,0 +1,13 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+/*
+ * Epoch-based reclamation.  Code that reads shared structures without locks
+ * brackets the reads with epoch_enter() and epoch_exit().  Code that unlinks
+ * something such a reader might still be looking at hands it to
+ * epoch_retire() instead of freeing it; it is freed once every thread that
+ * could have seen it has left its read section.
+ */
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *, void (*)(void *));
+#endif
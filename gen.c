@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+/*
+ * Workload generator.  Writes a command script in the format the E clients
+ * and bench read (a name value, q name, d name) to stdout, for example
+ *
+ *   gen -n 1000000 -k 100000 -D zipf -m 90,5,5 -p > zipf90
+ *   bench_fine zipf90
+ *
+ * Keys are k followed by a zero-padded number below the key count, padded
+ * to the key length asked for.  Which key each command uses is drawn from
+ *
+ *   uniform	every key equally often
+ *   zipf	key of rank r about 1/(r+1)^theta as often as the most popular
+ *		(Gray et al.'s generator, as in YCSB); theta is below 1
+ *   seq	every key in name order, over and over
+ *
+ * Ranks are spread over the names by a fixed permutation, so the popular
+ * keys of a zipf workload are scattered through the tree rather than
+ * bunched at one end of it.  With -p every key is added first, in the same
+ * scattered order, so the queries find something.  The output depends only
+ * on the options and the seed.
+ */
+
+/* Longest line the clients read whole, newline included (see bulk.c) */
+#define GEN_LINE_MAX 255
+
+static unsigned long rng_state;
+
+/* xorshift64*: a uniformly random 64 bit number */
+static unsigned long rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717UL;
+}
+
+/* A uniformly random number in [0, 1) */
+static double rng_unit(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* A uniformly random number in [0, n) */
+static unsigned long rng_below(unsigned long n) {
+    return rng_next() % n;
+}
+
+/* The Zipfian generator's constants for n keys with skew theta */
+typedef struct Zipf {
+    unsigned long n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipf_t;
+
+static double zeta(unsigned long n, double theta) {
+    double sum = 0;
+    unsigned long i;
+
+    for (i = 1; i <= n; i++) sum += 1.0 / pow((double) i, theta);
+    return sum;
+}
+
+static void zipf_init(zipf_t *z, unsigned long n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1.0 / (1.0 - theta);
+    z->zetan = zeta(n, theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / z->zetan);
+}
+
+/* A rank in [0, n), 0 the most popular */
+static unsigned long zipf_next(zipf_t *z) {
+    double u = rng_unit();
+    double uz = u * z->zetan;
+    unsigned long r;
+
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, z->theta)) return 1;
+    r = (unsigned long) (z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return (r < z->n) ? r : z->n - 1;
+}
+
+static unsigned long gcd(unsigned long a, unsigned long b) {
+    while (b) {
+	unsigned long t = a % b;
+
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+/* Rank r's key number: r times a large multiplier prime to nkeys, which
+ * takes 0 .. nkeys-1 to each of them once */
+static unsigned long key_of(unsigned long r, unsigned long nkeys,
+	unsigned long mult) {
+    return (unsigned long) ((unsigned __int128) r * mult % nkeys);
+}
+
+/* Write key number k as a name keylen characters long */
+static void key_name(char *buf, unsigned long k, int keylen) {
+    snprintf(buf, keylen + 1, "k%0*lu", keylen - 1, k);
+}
+
+/* Write a value of random lowercase letters between vmin and vmax long */
+static void value(char *buf, int vmin, int vmax) {
+    int len = vmin + (int) rng_below(vmax - vmin + 1);
+    int i;
+
+    for (i = 0; i < len; i++) buf[i] = 'a' + (char) rng_below(26);
+    buf[len] = '\0';
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-n commands] [-k keys] [-l keylen] "
+	    "[-v size[,max]] [-m query,add,delete] [-D uniform|zipf|seq] "
+	    "[-z theta] [-p] [-s seed]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long ncmds = 100000, nkeys = 10000, seed = 1;
+    unsigned long mult, seq = 0, i;
+    int keylen = 0, vmin = 8, vmax = 8, preload = 0;
+    int mix[3] = { 90, 5, 5 };
+    char *dist = "uniform";
+    double theta = 0.99;
+    char name[GEN_LINE_MAX + 1], val[GEN_LINE_MAX + 1];
+    zipf_t z;
+    int digits, opt;
+
+    while ((opt = getopt(argc, argv, "n:k:l:v:m:D:z:ps:")) != -1) {
+	switch (opt) {
+	case 'n':
+	    ncmds = strtoul(optarg, NULL, 10);
+	    break;
+	case 'k':
+	    if ((nkeys = strtoul(optarg, NULL, 10)) < 1) usage(argv[0]);
+	    break;
+	case 'l':
+	    keylen = atoi(optarg);
+	    break;
+	case 'v':
+	    if (sscanf(optarg, "%d,%d", &vmin, &vmax) == 1) vmax = vmin;
+	    if (vmin < 1 || vmax < vmin) usage(argv[0]);
+	    break;
+	case 'm':
+	    if (sscanf(optarg, "%d,%d,%d", &mix[0], &mix[1], &mix[2]) != 3 ||
+		    mix[0] < 0 || mix[1] < 0 || mix[2] < 0 ||
+		    mix[0] + mix[1] + mix[2] == 0)
+		usage(argv[0]);
+	    break;
+	case 'D':
+	    dist = optarg;
+	    if (strcmp(dist, "uniform") && strcmp(dist, "zipf") && strcmp(dist, "seq"))
+		usage(argv[0]);
+	    break;
+	case 'z':
+	    theta = atof(optarg);
+	    if (theta <= 0 || theta >= 1) usage(argv[0]);
+	    break;
+	case 'p':
+	    preload = 1;
+	    break;
+	case 's':
+	    seed = strtoul(optarg, NULL, 10);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind != argc) usage(argv[0]);
+
+    /* The shortest names that number every key, unless asked for longer */
+    for (digits = 1, i = nkeys - 1; i >= 10; i /= 10) digits++;
+    if (keylen == 0) keylen = digits + 1;
+    if (keylen < digits + 1) {
+	fprintf(stderr, "%s: %lu keys need names of at least %d characters\n",
+		argv[0], nkeys, digits + 1);
+	exit(1);
+    }
+    /* "a name value\n" has to fit in a line */
+    if (keylen + vmax + 4 > GEN_LINE_MAX) {
+	fprintf(stderr, "%s: names and values add up to more than %d "
+		"characters a line\n", argv[0], GEN_LINE_MAX);
+	exit(1);
+    }
+
+    /* Never 0, which xorshift would stay at */
+    rng_state = seed * 0x9E3779B97F4A7C15UL + 1;
+    if (!rng_state) rng_state = 1;
+    for (mult = 2654435761UL % nkeys; nkeys > 1 && gcd(mult, nkeys) != 1; mult++)
+	;
+    if (nkeys == 1 || mult == 0) mult = 1;
+    if (strcmp(dist, "zipf") == 0) zipf_init(&z, nkeys, theta);
+
+    if (preload)
+	for (i = 0; i < nkeys; i++) {
+	    key_name(name, key_of(i, nkeys, mult), keylen);
+	    value(val, vmin, vmax);
+	    printf("a %s %s\n", name, val);
+	}
+
+    for (i = 0; i < ncmds; i++) {
+	int pick = (int) rng_below(mix[0] + mix[1] + mix[2]);
+	unsigned long k;
+
+	if (dist[0] == 'z') k = key_of(zipf_next(&z), nkeys, mult);
+	else if (dist[0] == 'u') k = rng_below(nkeys);
+	else k = seq++ % nkeys;
+	key_name(name, k, keylen);
+
+	if (pick < mix[0]) printf("q %s\n", name);
+	else if (pick < mix[0] + mix[1]) {
+	    value(val, vmin, vmax);
+	    printf("a %s %s\n", name, val);
+	} else printf("d %s\n", name);
+    }
+    if (fflush(stdout) != 0) {
+	perror(argv[0]);
+	return 1;
+    }
+    return 0;
+}
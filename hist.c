@@ -0,0 +1,76 @@
+#include <string.h>
+#include <time.h>
+#include "hist.h"
+
+/* The bucket value v falls in.  Values below HIST_SUB get a bucket each;
+ * above that, the top HIST_SUB_BITS + 1 bits of v pick the bucket. */
+static inline int hist_bucket(unsigned long v) {
+    int msb;
+
+    if (v < HIST_SUB) return (int) v;
+    msb = 63 - __builtin_clzl(v);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	(int) ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The smallest value that falls in bucket b */
+static inline unsigned long hist_floor(int b) {
+    int msb;
+
+    if (b < HIST_SUB) return b;
+    msb = b / HIST_SUB + HIST_SUB_BITS - 1;
+    return (unsigned long) (HIST_SUB + b % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+/* Empty h */
+void hist_init(hist_t *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+/* Record the sample v in h */
+void hist_add(hist_t *h, unsigned long v) {
+    h->count[hist_bucket(v)]++;
+    h->n++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+/* Add everything recorded in src to dst */
+void hist_merge(hist_t *dst, hist_t *src) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) dst->count[i] += src->count[i];
+    dst->n += src->n;
+    dst->sum += src->sum;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+/* Return the value below which fraction p (0 to 1) of the samples in h fall.
+ * The answer is the middle of the bucket that sample falls in, but never
+ * more than the largest sample.  An empty histogram gives 0. */
+unsigned long hist_percentile(hist_t *h, double p) {
+    unsigned long rank = (unsigned long) (p * h->n);
+    unsigned long seen = 0;
+    int i;
+
+    if (h->n == 0) return 0;
+    if (rank >= h->n) rank = h->n - 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+	if ((seen += h->count[i]) > rank) {
+	    unsigned long lo = hist_floor(i);
+	    unsigned long hi = (i + 1 < HIST_BUCKETS) ? hist_floor(i + 1) : h->max + 1;
+	    unsigned long mid = lo + (hi - lo) / 2;
+
+	    return (mid > h->max) ? h->max : mid;
+	}
+    }
+    return h->max;
+}
+
+/* A monotonic timestamp in nanoseconds, for timing samples */
+unsigned long hist_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
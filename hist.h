@@ -0,0 +1,26 @@
+#ifndef HIST_H
+#define HIST_H
+/*
+ * Latency histograms.  Buckets are log-linear: each power of two is split
+ * into HIST_SUB equal steps, so any value is recorded to within about 6% with
+ * a fixed, small table and adding a sample is a few instructions.  A
+ * histogram is plain data with no lock; each thread records into its own and
+ * they are merged when read.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct Hist {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long n;		/* Samples recorded */
+    unsigned long max;		/* Largest sample */
+    unsigned long sum;		/* Sum of the samples, for the mean */
+} hist_t;
+
+void hist_init(hist_t *);
+void hist_add(hist_t *, unsigned long);
+void hist_merge(hist_t *, hist_t *);
+unsigned long hist_percentile(hist_t *, double);
+unsigned long hist_now(void);
+#endif
@@ -8,10 +8,13 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include "ring.h"
 
 /*
    Program to run in an xterm window to interact with the capital cities
-   database program.
+   database program.  It talks to the server through two named pipes, or,
+   given -r and a name, through the server's pair of shared memory rings
+   (see ring.h).
  */
 
 /* if true, exit the main loop */
@@ -51,25 +54,39 @@ int main(int argc, const char *argv[]) {
 
     /* Check the args */
     if (argc != 3) {
-	fprintf(stderr, "Usage: interface infile outfile\n");
+	fprintf(stderr, "Usage: interface infile outfile\n"
+		"       interface -r ring\n");
 	exit(1);
     }
 
+    if (strcmp(argv[1], "-r") == 0) {
+	/* Attaching is the handshake: the server waits for it */
+	ring_pair_t *ring = ring_attach((char *) argv[2]);
 
-    /* Open the named pipes for talking to the server.  We need to open these
-     * in the same order as the server so the two programs do not deadlock */
-    if (!(ofd = fopen(argv[1], "w"))) {
-	fprintf(stderr, "%s", argv[1]);
-	perror("open ofifo");
-	sleep(10);
-	exit(1);
-    }
+	if (!ring || !(ofd = ring_fopen(ring, "w")) ||
+		!(ifd = ring_fopen(ring, "r"))) {
+	    fprintf(stderr, "%s", argv[2]);
+	    perror("attach ring");
+	    sleep(10);
+	    exit(1);
+	}
+    } else {
+	/* Open the named pipes for talking to the server.  We need to open
+	 * these in the same order as the server so the two programs do not
+	 * deadlock */
+	if (!(ofd = fopen(argv[1], "w"))) {
+	    fprintf(stderr, "%s", argv[1]);
+	    perror("open ofifo");
+	    sleep(10);
+	    exit(1);
+	}
 
-    if (!(ifd = fopen(argv[2], "r"))) {
-	fprintf(stderr, "%s", argv[2]);
-	perror("open ififo");
-	sleep(10);
-	exit(1);
+	if (!(ifd = fopen(argv[2], "r"))) {
+	    fprintf(stderr, "%s", argv[2]);
+	    perror("open ififo");
+	    sleep(10);
+	    exit(1);
+	}
     }
 
     /* Loop until this program is terminated, passing commands and getting
@@ -94,8 +111,17 @@ int main(int argc, const char *argv[]) {
 	    sleep(10);
 	    exit(1);
 	}
-	/* print the response and the prompt */
+	/* print the response and the prompt.  Lines that start with a tab
+	 * (the results of a scan) come ahead of the response itself. */
 	printf("%s", rbuf);
+	while (rbuf[0] == '\t') {
+	    if (getline(&rbuf, &rlen, ifd) == -1) {
+		perror("read");
+		sleep(10);
+		exit(1);
+	    }
+	    printf("%s", rbuf);
+	}
 	fflush(stdout);
     }
 }
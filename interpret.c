@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "db.h"
+#include "words.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "bulk.h"
+#include "opstats.h"
+#include "lockprof.h"
+#include "qcache.h"
+
+static void interpret(char *, char *, int, unsigned long *,
+	void (*)(char *, void *), void *);
+
+/* Where a scan's lines go */
+typedef struct Emit {
+    void (*emit)(char *, void *);
+    void *arg;
+} emit_t;
+
+/*
+ * Parse the command in command, execute it on the DB and return a string
+ * describing the results.  Response must be a writable string that can hold
+ * len characters.  The response is stored in response.
+ *
+ * Commands are a single-letter opcode followed by whitespace-separated
+ * arguments.  The opcode picks the case directly and tokenize() then splits
+ * just the arguments that opcode takes, in place, so the names and values
+ * handed to the DB point into command itself.  Nothing is copied or
+ * allocated, and command is left modified.
+ *
+ * If the write-ahead log is on, the response is not returned until the
+ * changes the command made are on disk.
+ */
+void interpret_command(char *command, char *response, int len) {
+    interpret_stream(command, response, len, NULL, NULL);
+}
+
+/* interpret_command(), handing the lines of a scan to emit along with arg */
+void interpret_stream(char *command, char *response, int len,
+	void (*emit)(char *, void *), void *arg) {
+    unsigned long lsn = 0;
+
+    interpret(command, response, len, &lsn, emit, arg);
+    wal_sync(lsn);
+}
+
+/* db_scan() callback: hand one pair on as a line */
+static int scan_line(char *name, char *value, void *arg) {
+    emit_t *e = (emit_t *) arg;
+    char buf[256];
+    char *line = buf;
+    size_t n = strlen(name) + strlen(value) + 3;
+
+    if (!e->emit) return 0;
+    if (n > sizeof(buf) && !(line = (char *) malloc(n))) return 1;
+    snprintf(line, n, "\t%s %s", name, value);
+    e->emit(line, e->arg);
+    if (line != buf) free(line);
+    return 0;
+}
+
+/* Scan the names from lo up to hi and report how many there were */
+static void scan(char *lo, char *hi, char *response, int len, emit_t *e) {
+    unsigned long t0 = hist_now();
+    long n = db_scan(lo, hi, scan_line, e);
+
+    opstats_add(OP_SCAN, hist_now() - t0);
+
+    if (n < 0) strncpy(response, "scan failed", len - 1);
+    else snprintf(response, len, "%ld found", n);
+}
+
+/* Record the time since t0 as parsing, and return the time now */
+static unsigned long parsed(unsigned long t0) {
+    unsigned long t = hist_now();
+
+    opstats_add(OP_PARSE, t - t0);
+    return t;
+}
+
+/* Hand the latency histograms and db_stats() on, a line each */
+static void stats(char *response, int len, emit_t *e) {
+    char *text = NULL, *line, *save;
+    char buf[256];
+    size_t size = 0;
+    FILE *f = open_memstream(&text, &size);
+
+    if (!f) {
+	strncpy(response, "stats failed", len - 1);
+	return;
+    }
+    opstats_print(f);
+    db_stats(f);
+    lockprof_report(f, LOCKPROF_TOP);
+    qcache_print(f);
+    if (fclose(f) != 0) {
+	free(text);
+	strncpy(response, "stats failed", len - 1);
+	return;
+    }
+    for (line = strtok_r(text, "\n", &save); line && e->emit;
+	    line = strtok_r(NULL, "\n", &save)) {
+	snprintf(buf, sizeof(buf), "\t%s", line);
+	e->emit(buf, e->arg);
+    }
+    free(text);
+    strncpy(response, "stats reported", len - 1);
+}
+
+/* Hand on one line per key of a batch, if anyone wants them */
+static void batch_lines(emit_t *e, char **lines, int n) {
+    char buf[WORD_MAX + 2];
+    int i;
+
+    if (!e->emit) return;
+    for (i = 0; i < n; i++) {
+	snprintf(buf, sizeof(buf), "\t%s", lines[i]);
+	e->emit(buf, e->arg);
+    }
+}
+
+/*
+ * The batch commands: Q name..., A name value ... and D name....  Each key's
+ * answer, as q, a or d would give it, goes out as a line of its own, in the
+ * order the keys were given, and the response is the count found, added or
+ * removed.  The keys are handed to the backend together, so that it can
+ * sort them and take each lock once for all of them.
+ */
+static void batch(int op, char *args, char *response, int len,
+	unsigned long *lsn, emit_t *e) {
+    int max = strlen(args) / 2 + 1;	/* More words than can fit */
+    word_t *words = (word_t *) malloc(max * sizeof(word_t));
+    char **names = (char **) malloc(max * sizeof(char *));
+    char **values = (char **) malloc(max * sizeof(char *));
+    int *done = (int *) malloc(max * sizeof(int));
+    char *results = NULL;
+    unsigned long l, t0 = hist_now();
+    int n = 0, count, i;
+
+    if (!words || !names || !values || !done) {
+	strncpy(response, "batch failed", len - 1);
+	goto out;
+    }
+    n = tokenize(args, words, max);
+    if (n < 1 || (op == 'A' && n % 2 != 0)) {
+	strncpy(response, "ill-formed command", len - 1);
+	goto out;
+    }
+    if (op == 'A') n /= 2;
+    for (i = 0; i < n; i++) {
+	if (op == 'A') {
+	    names[i] = words[2 * i].p;
+	    values[i] = words[2 * i + 1].p;
+	} else names[i] = words[i].p;
+    }
+    opstats_add(OP_PARSE, hist_now() - t0);
+    t0 = hist_now();
+
+    switch (op) {
+    case 'Q':
+	/* values[] holds the answers, each len characters */
+	if (!(results = (char *) calloc(n, len))) {
+	    strncpy(response, "batch failed", len - 1);
+	    goto out;
+	}
+	for (i = 0; i < n; i++) values[i] = results + (size_t) i * len;
+	count = query_batch(names, values, len, n);
+	opstats_add(OP_BATCH, hist_now() - t0);
+	batch_lines(e, values, n);
+	snprintf(response, len, "%d found", count);
+	break;
+    case 'A':
+	count = wal_add_batch(names, values, done, n, &l);
+	opstats_add(OP_BATCH, hist_now() - t0);
+	if (l > *lsn) *lsn = l;
+	for (i = 0; i < n; i++)
+	    values[i] = done[i] ? "added" : "already in database";
+	batch_lines(e, values, n);
+	snprintf(response, len, "%d added", count);
+	break;
+    case 'D':
+	count = wal_remove_batch(names, done, n, &l);
+	opstats_add(OP_BATCH, hist_now() - t0);
+	if (l > *lsn) *lsn = l;
+	for (i = 0; i < n; i++)
+	    values[i] = done[i] ? "removed" : "not in database";
+	batch_lines(e, values, n);
+	snprintf(response, len, "%d removed", count);
+	break;
+    }
+
+out:
+    free(results);
+    free(words);
+    free(names);
+    free(values);
+    free(done);
+}
+
+/* Carry out a command for interpret_command().  Changes are logged but not
+ * waited for; *lsn is raised to the last log record written, so a command
+ * file run with f waits for the log once, at the end. */
+static void interpret(char *command, char *response, int len, unsigned long *lsn,
+	void (*emit)(char *, void *), void *arg) {
+    emit_t e = { emit, arg };
+    word_t args[2];
+    char ibuf[256];
+    unsigned long l, t0 = hist_now();
+
+    if (command[0] == '\0' || command[1] == '\0') {
+	strncpy(response, "ill-formed command", len - 1);
+	return;
+    }
+
+    switch (command[0]) {
+    case 'q':
+	/* Query */
+	if (tokenize(&command[1], args, 1) < 1) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+
+	t0 = parsed(t0);
+	qcache_query(args[0].p, response, len);
+	opstats_add(OP_QUERY, hist_now() - t0);
+	if (strlen(response) == 0) {
+	    strncpy(response, "not found", len - 1);
+	}
+
+	return;
+
+    case 'a':
+	/* Add to the database */
+	if (tokenize(&command[1], args, 2) < 2) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+
+	t0 = parsed(t0);
+	if (wal_add(args[0].p, args[1].p, &l)) {
+	    strncpy(response, "added", len - 1);
+	} else {
+	    strncpy(response, "already in database", len - 1);
+	}
+	opstats_add(OP_ADD, hist_now() - t0);
+	if (l > *lsn) *lsn = l;
+
+	return;
+
+    case 'd':
+	/* Delete from the database */
+	if (tokenize(&command[1], args, 1) < 1) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+
+	t0 = parsed(t0);
+	if (wal_remove(args[0].p, &l)) {
+	    strncpy(response, "removed", len - 1);
+	} else {
+	    strncpy(response, "not in database", len - 1);
+	}
+	opstats_add(OP_REMOVE, hist_now() - t0);
+	if (l > *lsn) *lsn = l;
+
+	return;
+
+    case 'Q':
+    case 'A':
+    case 'D':
+	/* Query, add to or delete from the database many keys at once */
+	batch(command[0], &command[1], response, len, lsn, &e);
+	return;
+
+    case 'f':
+	/* process the commands in a file (silently) */
+	if (tokenize(&command[1], args, 1) < 1) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+
+	/* A file of adds, deletes and queries is loaded in bulk */
+	switch (bulk_load(args[0].p, lsn)) {
+	case -1:
+	    strncpy(response, "bad file name", len - 1);
+	    return;
+	case 0:
+	    {
+		FILE *finput = fopen(args[0].p, "r");
+		if (!finput) {
+		    strncpy(response, "bad file name", len - 1);
+		    return;
+		}
+		while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
+		    interpret(ibuf, response, len, lsn, NULL, NULL);
+		}
+		fclose(finput);
+	    }
+	}
+	strncpy(response, "file processed", len - 1);
+	return;
+
+    case 's':
+	/* Save a snapshot of the database to a file */
+	if (tokenize(&command[1], args, 1) < 1) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+
+	if (snapshot_write(args[0].p) >= 0) {
+	    strncpy(response, "snapshot written", len - 1);
+	} else {
+	    strncpy(response, "snapshot failed", len - 1);
+	}
+
+	return;
+
+    case 'r':
+	/* Scan the names from lo up to, but not including, hi */
+	if (tokenize(&command[1], args, 2) < 2) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+
+	parsed(t0);
+	scan(args[0].p, args[1].p, response, len, &e);
+	return;
+
+    case 'p':
+	/* Scan the names that start with a prefix */
+	if (tokenize(&command[1], args, 1) < 1) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+
+	parsed(t0);
+	{
+	    /* They sort before the prefix with its last byte incremented,
+	     * once any trailing 0xff bytes (which cannot be) are dropped.  A
+	     * prefix of nothing but 0xff bytes has no upper bound. */
+	    char *hi = strdup(args[0].p);
+	    int i;
+
+	    if (!hi) {
+		strncpy(response, "scan failed", len - 1);
+		return;
+	    }
+	    for (i = strlen(hi) - 1; i >= 0 && (unsigned char) hi[i] == 0xff; i--)
+		hi[i] = '\0';
+	    if (i >= 0) hi[i]++;
+	    scan(args[0].p, i >= 0 ? hi : NULL, response, len, &e);
+	    free(hi);
+	}
+	return;
+
+    case 'i':
+	/* Report the latencies recorded so far, and the backend's own
+	 * measurements, a line each */
+	stats(response, len, &e);
+	return;
+
+    default:
+	strncpy(response, "ill-formed command", len - 1);
+	return;
+    }
+}
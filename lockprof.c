@@ -0,0 +1,133 @@
+#ifdef LOCK_PROFILE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hist.h"
+#include "lockprof.h"
+
+/*
+ * A site's counters are shared by every thread that passes through it, and
+ * are added to atomically; this is a profiling build, and the extra traffic
+ * on them is part of its cost.  Sites put themselves on the list the first
+ * time they are used.  Each thread keeps the locks it holds, with when it got
+ * them, so a release can be charged to the site that took the lock.
+ */
+
+typedef struct Held {
+    void *lock;
+    lock_site_t *site;
+    unsigned long since;
+} held_t;
+
+/* Every site used so far.  Only ever pushed onto. */
+static lock_site_t *sites = NULL;
+/* Protects adding to sites */
+static pthread_mutex_t mutex_sites = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread held_t held[LOCKPROF_HELD];
+static __thread int nheld = 0;
+
+static void register_site(lock_site_t *site) {
+    pthread_mutex_lock(&mutex_sites);
+    if (!site->registered) {
+	site->next = sites;
+	/* Readers of the list walk it without the lock */
+	__atomic_store_n(&sites, site, __ATOMIC_RELEASE);
+	__atomic_store_n(&site->registered, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&mutex_sites);
+}
+
+/* lock has been taken at site after waiting wait nanoseconds; contended is
+ * set if it was held when site first tried for it */
+void lockprof_acquired(lock_site_t *site, void *lock, int contended,
+	unsigned long wait) {
+    unsigned long max;
+
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE))
+	register_site(site);
+    __atomic_fetch_add(&site->acquired, 1, __ATOMIC_RELAXED);
+    if (contended) __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->wait, wait, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&site->max_wait, __ATOMIC_RELAXED);
+    while (wait > max &&
+	    !__atomic_compare_exchange_n(&site->max_wait, &max, wait, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+
+    if (nheld < LOCKPROF_HELD) {
+	held[nheld].lock = lock;
+	held[nheld].site = site;
+	held[nheld].since = hist_now();
+	nheld++;
+    }
+}
+
+/* lock is about to be released: charge the time it was held to the site
+ * that took it */
+void lockprof_released(void *lock) {
+    int i;
+
+    for (i = nheld - 1; i >= 0; i--)
+	if (held[i].lock == lock) {
+	    lock_site_t *site = held[i].site;
+
+	    __atomic_fetch_add(&site->held, 1, __ATOMIC_RELAXED);
+	    __atomic_fetch_add(&site->hold, hist_now() - held[i].since,
+		    __ATOMIC_RELAXED);
+	    held[i] = held[--nheld];
+	    return;
+	}
+}
+
+/* Order sites by the time waited there, longest first */
+static int by_wait(const void *a, const void *b) {
+    unsigned long x = ((const lock_site_t *) a)->wait;
+    unsigned long y = ((const lock_site_t *) b)->wait;
+
+    return (x < y) - (x > y);
+}
+
+/* Print the top sites by time waited.  The counters are copied first, so the
+ * sort sees them hold still. */
+void lockprof_report(FILE *f, int top) {
+    lock_site_t *head = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    lock_site_t *all, *site;
+    int n = 0, i;
+
+    for (site = head; site; site = site->next) n++;
+    if (n == 0 || !(all = (lock_site_t *) malloc(n * sizeof(lock_site_t))))
+	return;
+    for (site = head, i = 0; site; site = site->next, i++) {
+	all[i].file = site->file;
+	all[i].line = site->line;
+	all[i].acquired = __atomic_load_n(&site->acquired, __ATOMIC_RELAXED);
+	all[i].contended = __atomic_load_n(&site->contended, __ATOMIC_RELAXED);
+	all[i].wait = __atomic_load_n(&site->wait, __ATOMIC_RELAXED);
+	all[i].max_wait = __atomic_load_n(&site->max_wait, __ATOMIC_RELAXED);
+	all[i].held = __atomic_load_n(&site->held, __ATOMIC_RELAXED);
+	all[i].hold = __atomic_load_n(&site->hold, __ATOMIC_RELAXED);
+    }
+    qsort(all, n, sizeof(lock_site_t), by_wait);
+
+    fprintf(f, "lock sites by time waited (top %d of %d):\n",
+	    (top < n) ? top : n, n);
+    fprintf(f, "%-20s %10s %10s %6s %12s %12s %12s %12s\n", "site", "acquired",
+	    "contended", "%", "wait ms", "max wait ns", "hold ms",
+	    "mean hold ns");
+    for (i = 0; i < n && i < top; i++) {
+	char where[64];
+	const char *file = strrchr(all[i].file, '/');
+
+	snprintf(where, sizeof(where), "%s:%d", file ? file + 1 : all[i].file,
+		all[i].line);
+	fprintf(f, "%-20s %10lu %10lu %6.2f %12.3f %12lu %12.3f %12lu\n", where,
+		all[i].acquired, all[i].contended,
+		all[i].acquired ? 100.0 * all[i].contended / all[i].acquired : 0.0,
+		all[i].wait / 1e6, all[i].max_wait, all[i].hold / 1e6,
+		all[i].held ? all[i].hold / all[i].held : 0);
+    }
+    free(all);
+}
+#endif
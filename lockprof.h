@@ -0,0 +1,108 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+#include <stdio.h>
+#include <pthread.h>
+#include "hist.h"
+#include "opstats.h"
+/*
+ * Lock contention profiling.  The backends take and release their locks
+ * through the macros below, which normally are just the calls themselves
+ * (timed for OP_LOCK, see opstats.h).  Built with -DLOCK_PROFILE (make
+ * PROFILE=1, after a make clean), every place a lock is taken becomes a site
+ * that counts how often it took the lock, how often it found it held, how
+ * long it waited and how long the lock was then held.  lockprof_report()
+ * prints the sites that waited longest, at most top of them.
+ *
+ * Hold times run from the acquisition to the matching release by the same
+ * thread.  A thread holding more than LOCKPROF_HELD profiled locks at once
+ * (only the whole-DB walks do) is not timed for the extra ones.
+ */
+#define LOCKPROF_TOP 10
+
+#ifdef LOCK_PROFILE
+#define LOCKPROF_HELD 64
+
+typedef struct LockSite {
+    const char *file;
+    int line;
+    int registered;		/* On the list of sites */
+    unsigned long acquired;
+    unsigned long contended;	/* Acquisitions that found the lock held */
+    unsigned long wait;		/* Nanoseconds waited, in all */
+    unsigned long max_wait;
+    unsigned long held;		/* Acquisitions whose hold was timed */
+    unsigned long hold;		/* Nanoseconds held, in all */
+    struct LockSite *next;
+} lock_site_t;
+
+void lockprof_acquired(lock_site_t *, void *, int, unsigned long);
+void lockprof_released(void *);
+void lockprof_report(FILE *, int);
+
+/* The site for the place this is expanded in (a GNU statement expression,
+ * so each expansion gets a static of its own) */
+#define LOCKPROF_SITE() \
+    ({ static lock_site_t lockprof_site_ = { __FILE__, __LINE__ }; &lockprof_site_; })
+
+/* Take pthread lock l (evaluated once) with trylock or, failing that, lock */
+#define LOCKPROF_PTHREAD(l, trylock, lock) do { \
+	__typeof__(l) l_ = (l); \
+	lock_site_t *site_ = LOCKPROF_SITE(); \
+	unsigned long t0_; \
+	if (trylock(l_) == 0) { \
+	    opstats_add(OP_LOCK, 0); \
+	    lockprof_acquired(site_, l_, 0, 0); \
+	} else { \
+	    t0_ = hist_now(); \
+	    lock(l_); \
+	    t0_ = hist_now() - t0_; \
+	    opstats_add(OP_LOCK, t0_); \
+	    lockprof_acquired(site_, l_, 1, t0_); \
+	} \
+    } while (0)
+
+/* Take an rwlock_t, which times itself for OP_LOCK and says if it waited */
+#define LOCKPROF_RWLOCK(l, take) do { \
+	__typeof__(l) l_ = (l); \
+	lock_site_t *site_ = LOCKPROF_SITE(); \
+	unsigned long t0_ = hist_now(); \
+	int waited_ = take(l_); \
+	lockprof_acquired(site_, l_, waited_, hist_now() - t0_); \
+    } while (0)
+
+#define MUTEX_LOCK(m) \
+    LOCKPROF_PTHREAD(m, pthread_mutex_trylock, pthread_mutex_lock)
+#define RDLOCK(l) \
+    LOCKPROF_PTHREAD(l, pthread_rwlock_tryrdlock, pthread_rwlock_rdlock)
+#define WRLOCK(l) \
+    LOCKPROF_PTHREAD(l, pthread_rwlock_trywrlock, pthread_rwlock_wrlock)
+#define RWLOCK_RDLOCK(l) LOCKPROF_RWLOCK(l, rwlock_rdlock)
+#define RWLOCK_WRLOCK(l) LOCKPROF_RWLOCK(l, rwlock_wrlock)
+
+/* Release lock l (evaluated once) with unlock */
+#define LOCKPROF_RELEASE(l, unlock) \
+    ({ __typeof__(l) l_ = (l); lockprof_released(l_); unlock(l_); })
+
+#define MUTEX_UNLOCK(m) LOCKPROF_RELEASE(m, pthread_mutex_unlock)
+#define RWUNLOCK(l) LOCKPROF_RELEASE(l, pthread_rwlock_unlock)
+#define RWLOCK_RDUNLOCK(l) LOCKPROF_RELEASE(l, rwlock_rdunlock)
+#define RWLOCK_WRUNLOCK(l) LOCKPROF_RELEASE(l, rwlock_wrunlock)
+
+#else
+
+#define MUTEX_LOCK(m) opstats_mutex_lock(m)
+#define MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#define RDLOCK(l) opstats_rdlock(l)
+#define WRLOCK(l) opstats_wrlock(l)
+#define RWUNLOCK(l) pthread_rwlock_unlock(l)
+#define RWLOCK_RDLOCK(l) rwlock_rdlock(l)
+#define RWLOCK_WRLOCK(l) rwlock_wrlock(l)
+#define RWLOCK_RDUNLOCK(l) rwlock_rdunlock(l)
+#define RWLOCK_WRUNLOCK(l) rwlock_wrunlock(l)
+
+static inline void lockprof_report(FILE *f, int top) {
+    (void) f;
+    (void) top;
+}
+#endif
+#endif
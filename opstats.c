@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "hist.h"
+#include "opstats.h"
+
+/*
+ * Every thread that records gets a record of its own, found through a thread
+ * local pointer.  As in epoch.c the records are never freed: when a thread
+ * exits its record is handed to the next new thread, samples and all, so the
+ * totals cover threads that have come and gone without anything having to be
+ * merged at exit.
+ */
+
+typedef struct OpThread {
+    hist_t hist[OP_KINDS];
+    int in_use;
+    struct OpThread *next;
+} __attribute__((aligned(64))) op_thread_t;
+
+static char *op_names[OP_KINDS] = {
+    "query", "add", "xremove", "batch", "scan", "parse", "lock wait"
+};
+
+/* All the records ever created.  Only ever pushed onto. */
+static op_thread_t *threads = NULL;
+/* Protects handing out records */
+static pthread_mutex_t mutex_threads = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static __thread op_thread_t *self = NULL;
+
+/* Thread exit: give the record back */
+static void release_self(void *arg) {
+    op_thread_t *t = (op_thread_t *) arg;
+
+    pthread_mutex_lock(&mutex_threads);
+    t->in_use = 0;
+    pthread_mutex_unlock(&mutex_threads);
+}
+
+static void make_key(void) {
+    pthread_key_create(&thread_key, release_self);
+}
+
+/* Find or create this thread's record.  Returns NULL if out of memory, and
+ * the sample is dropped. */
+static op_thread_t *register_self(void) {
+    op_thread_t *t;
+    int i;
+
+    pthread_once(&key_once, make_key);
+    pthread_mutex_lock(&mutex_threads);
+    for (t = threads; t; t = t->next)
+	if (!t->in_use) break;
+    if (!t) {
+	if (!(t = (op_thread_t *) malloc(sizeof(op_thread_t)))) {
+	    pthread_mutex_unlock(&mutex_threads);
+	    return NULL;
+	}
+	for (i = 0; i < OP_KINDS; i++) hist_init(&t->hist[i]);
+	t->next = threads;
+	/* Readers of the list walk it without the lock */
+	__atomic_store_n(&threads, t, __ATOMIC_RELEASE);
+    }
+    t->in_use = 1;
+    pthread_mutex_unlock(&mutex_threads);
+
+    pthread_setspecific(thread_key, t);
+    return (self = t);
+}
+
+/* Record a sample of ns nanoseconds for kind */
+void opstats_add(op_kind_t kind, unsigned long ns) {
+    op_thread_t *t = (self) ? self : register_self();
+
+    if (t) hist_add(&t->hist[kind], ns);
+}
+
+/* Merge every thread's samples into hist, which holds OP_KINDS histograms */
+void opstats_read(hist_t *hist) {
+    op_thread_t *t;
+    int i;
+
+    for (i = 0; i < OP_KINDS; i++) hist_init(&hist[i]);
+    for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t; t = t->next)
+	for (i = 0; i < OP_KINDS; i++) hist_merge(&hist[i], &t->hist[i]);
+}
+
+/* Print a line for each kind of operation recorded so far */
+void opstats_print(FILE *f) {
+    hist_t *hist = (hist_t *) malloc(OP_KINDS * sizeof(hist_t));
+    int i;
+
+    if (!hist) return;
+    opstats_read(hist);
+    for (i = 0; i < OP_KINDS; i++) {
+	if (hist[i].n == 0) continue;
+	fprintf(f, "%s: n=%lu mean=%luns p50=%luns p99=%luns p999=%luns "
+		"max=%luns\n", op_names[i], hist[i].n, hist[i].sum / hist[i].n,
+		hist_percentile(&hist[i], 0.50), hist_percentile(&hist[i], 0.99),
+		hist_percentile(&hist[i], 0.999), hist[i].max);
+    }
+    free(hist);
+}
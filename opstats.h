@@ -0,0 +1,65 @@
+#ifndef OPSTATS_H
+#define OPSTATS_H
+#include <stdio.h>
+#include <pthread.h>
+#include "hist.h"
+/*
+ * Per-operation latency histograms.  Each thread records into histograms of
+ * its own, so recording takes no lock and touches nothing shared; reading
+ * merges every thread's histograms.  A read made while other threads are
+ * recording may miss the samples they are in the middle of adding.
+ *
+ * The times are in nanoseconds: OP_PARSE is splitting a command's
+ * arguments, OP_QUERY to OP_SCAN carrying it out (logging included, but not
+ * waiting for the log; a scan's time includes handing on its lines), and
+ * OP_LOCK each wait for a DB or key lock.
+ */
+typedef enum {
+    OP_QUERY, OP_ADD, OP_REMOVE, OP_BATCH, OP_SCAN, OP_PARSE, OP_LOCK, OP_KINDS
+} op_kind_t;
+
+void opstats_add(op_kind_t, unsigned long);
+void opstats_read(hist_t *);
+void opstats_print(FILE *);
+
+/*
+ * Lock acquisition that records the wait in OP_LOCK.  The clock is only read
+ * when the lock is not free, so an uncontended acquisition costs a trylock
+ * and records a wait of 0.
+ */
+static inline void opstats_mutex_lock(pthread_mutex_t *m) {
+    unsigned long t0;
+
+    if (pthread_mutex_trylock(m) == 0) {
+	opstats_add(OP_LOCK, 0);
+	return;
+    }
+    t0 = hist_now();
+    pthread_mutex_lock(m);
+    opstats_add(OP_LOCK, hist_now() - t0);
+}
+
+static inline void opstats_rdlock(pthread_rwlock_t *rw) {
+    unsigned long t0;
+
+    if (pthread_rwlock_tryrdlock(rw) == 0) {
+	opstats_add(OP_LOCK, 0);
+	return;
+    }
+    t0 = hist_now();
+    pthread_rwlock_rdlock(rw);
+    opstats_add(OP_LOCK, hist_now() - t0);
+}
+
+static inline void opstats_wrlock(pthread_rwlock_t *rw) {
+    unsigned long t0;
+
+    if (pthread_rwlock_trywrlock(rw) == 0) {
+	opstats_add(OP_LOCK, 0);
+	return;
+    }
+    t0 = hist_now();
+    pthread_rwlock_wrlock(rw);
+    opstats_add(OP_LOCK, hist_now() - t0);
+}
+#endif
@@ -0,0 +1,127 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+/* Initial number of queue slots.  The queue doubles when it fills. */
+#define POOL_QUEUE_INIT 64
+
+struct Pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;	/* Signalled when an item is queued or on exit */
+    void **items;		/* Circular queue of submitted items */
+    int first;			/* Index of the oldest item */
+    int count;			/* Items queued */
+    int size;			/* Slots in items */
+    int stopping;		/* Set by pool_destroy */
+    void (*run)(void *);
+    pthread_t *workers;
+    int nworkers;
+};
+
+/* Worker thread body: take the oldest item off the queue and run it, until
+ * the pool is being destroyed and the queue is empty. */
+static void *pool_worker(void *arg) {
+    pool_t *pool = (pool_t *) arg;
+    void *item;
+
+    for (;;) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count == 0 && !pool->stopping)
+	    pthread_cond_wait(&pool->work, &pool->lock);
+	if (pool->count == 0) {
+	    pthread_mutex_unlock(&pool->lock);
+	    return NULL;
+	}
+	item = pool->items[pool->first];
+	pool->first = (pool->first + 1) % pool->size;
+	pool->count--;
+	pthread_mutex_unlock(&pool->lock);
+
+	pool->run(item);
+    }
+}
+
+/*
+ * Create a pool of nworkers threads that call run on each item submitted.
+ * Returns NULL if the pool or any of its threads cannot be created.  The pool
+ * must be disposed of with pool_destroy().
+ */
+pool_t *pool_create(int nworkers, void (*run)(void *)) {
+    pool_t *pool = (pool_t *) malloc(sizeof(pool_t));
+    int i;
+
+    if (!pool) return NULL;
+    pool->items = (void **) malloc(POOL_QUEUE_INIT * sizeof(void *));
+    pool->workers = (pthread_t *) malloc(nworkers * sizeof(pthread_t));
+    if (!pool->items || !pool->workers) {
+	free(pool->items);
+	free(pool->workers);
+	free(pool);
+	return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pool->first = 0;
+    pool->count = 0;
+    pool->size = POOL_QUEUE_INIT;
+    pool->stopping = 0;
+    pool->run = run;
+    pool->nworkers = 0;
+
+    for (i = 0; i < nworkers; i++) {
+	if (pthread_create(&pool->workers[i], NULL, pool_worker, pool)) {
+	    pool_destroy(pool);
+	    return NULL;
+	}
+	pool->nworkers++;
+    }
+    return pool;
+}
+
+/* Queue item to be run by one of the workers.  Returns 0 on success and -1 if
+ * the queue could not be grown to hold it. */
+int pool_submit(pool_t *pool, void *item) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == pool->size) {
+	/* Double the queue, unwrapping it so the oldest item is first */
+	void **items = (void **) malloc(2 * pool->size * sizeof(void *));
+	int wrap = pool->size - pool->first;
+
+	if (!items) {
+	    pthread_mutex_unlock(&pool->lock);
+	    return -1;
+	}
+	memcpy(items, pool->items + pool->first, wrap * sizeof(void *));
+	memcpy(items + wrap, pool->items, pool->first * sizeof(void *));
+	free(pool->items);
+	pool->items = items;
+	pool->first = 0;
+	pool->size *= 2;
+    }
+    pool->items[(pool->first + pool->count) % pool->size] = item;
+    pool->count++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/* Run whatever is still queued, then stop and join the workers and free the
+ * pool.  Nothing may be submitted once this has been called. */
+void pool_destroy(pool_t *pool) {
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nworkers; i++)
+	pthread_join(pool->workers[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    free(pool->items);
+    free(pool->workers);
+    free(pool);
+}
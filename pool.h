@@ -0,0 +1,14 @@
+#ifndef POOL_H
+#define POOL_H
+/*
+ * A fixed set of worker threads sharing one queue of work items.  Each item
+ * submitted is handed to the pool's run function by whichever worker gets to
+ * it first, so items submitted by different threads run in no particular
+ * order.  An item that needs to run again resubmits itself.
+ */
+typedef struct Pool pool_t;
+
+pool_t *pool_create(int, void (*)(void *));
+int pool_submit(pool_t *, void *);
+void pool_destroy(pool_t *);
+#endif
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "db.h"
+#include "qcache.h"
+
+/*
+ * Each thread has a direct-mapped table of answers, allocated the first time
+ * it queries with the cache on.  As in opstats.c the tables are never freed:
+ * a thread's table is handed to the next new thread when it exits, still
+ * good since every entry is checked against its stripe's version.
+ */
+
+/* Entries in each thread's table; a power of two */
+#define QCACHE_SLOTS 2048
+/* Version stripes; a power of two */
+#define QCACHE_STRIPES 4096
+/* Room for a name and its value, both NUL terminated.  Longer pairs are not
+ * cached. */
+#define QCACHE_TEXT 112
+
+typedef struct QEntry {
+    unsigned long version;	/* The stripe's version before the DB was asked */
+    unsigned int hash;
+    int used;
+    char text[QCACHE_TEXT];	/* name, NUL, value, NUL */
+} qentry_t;
+
+typedef struct QThread {
+    qentry_t slot[QCACHE_SLOTS];
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;	/* Misses on an entry a change had made stale */
+    int in_use;
+    struct QThread *next;
+} __attribute__((aligned(64))) qthread_t;
+
+static int qcache_on = 0;
+static unsigned long stripes[QCACHE_STRIPES];
+
+/* All the tables ever created.  Only ever pushed onto. */
+static qthread_t *threads = NULL;
+/* Protects handing out tables */
+static pthread_mutex_t mutex_threads = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static __thread qthread_t *self = NULL;
+
+/* Thread exit: give the table back */
+static void release_self(void *arg) {
+    qthread_t *t = (qthread_t *) arg;
+
+    pthread_mutex_lock(&mutex_threads);
+    t->in_use = 0;
+    pthread_mutex_unlock(&mutex_threads);
+}
+
+static void make_key(void) {
+    pthread_key_create(&thread_key, release_self);
+}
+
+/* Find or create this thread's table.  Returns NULL if out of memory, and
+ * the thread goes without. */
+static qthread_t *register_self(void) {
+    qthread_t *t;
+
+    pthread_once(&key_once, make_key);
+    pthread_mutex_lock(&mutex_threads);
+    for (t = threads; t; t = t->next)
+	if (!t->in_use) break;
+    if (!t) {
+	if (!(t = (qthread_t *) calloc(1, sizeof(qthread_t)))) {
+	    pthread_mutex_unlock(&mutex_threads);
+	    return NULL;
+	}
+	t->next = threads;
+	/* Readers of the list walk it without the lock */
+	__atomic_store_n(&threads, t, __ATOMIC_RELEASE);
+    }
+    t->in_use = 1;
+    pthread_mutex_unlock(&mutex_threads);
+
+    pthread_setspecific(thread_key, t);
+    return (self = t);
+}
+
+/* FNV-1a, as db_shard() uses: the low bits pick the slot, the high bits the
+ * stripe */
+static unsigned int qhash(char *name) {
+    unsigned int h = 2166136261u;
+
+    while (*name) h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h;
+}
+
+static unsigned long *stripe_of(unsigned int h) {
+    return &stripes[(h >> 20) & (QCACHE_STRIPES - 1)];
+}
+
+/* Turn the cache on or off.  Call before any thread queries. */
+void qcache_enable(int on) {
+    qcache_on = on;
+}
+
+/* query(), answered from this thread's cache when it can be */
+void qcache_query(char *name, char *result, int len) {
+    unsigned int h;
+    unsigned long version;
+    size_t nlen, vlen;
+    qentry_t *e;
+    qthread_t *t;
+
+    if (!qcache_on || !(t = (self) ? self : register_self())) {
+	query(name, result, len);
+	return;
+    }
+
+    h = qhash(name);
+    e = &t->slot[h & (QCACHE_SLOTS - 1)];
+    /* Read before the DB is asked, so a change made after this makes what
+     * is filled in below stale */
+    version = __atomic_load_n(stripe_of(h), __ATOMIC_ACQUIRE);
+    if (e->used && e->hash == h && strcmp(e->text, name) == 0) {
+	if (e->version == version) {
+	    vlen = strlen(e->text + strlen(name) + 1);
+	    if (vlen > (size_t) len - 1) vlen = len - 1;
+	    memcpy(result, e->text + strlen(name) + 1, vlen);
+	    result[vlen] = '\0';
+	    t->hits++;
+	    return;
+	}
+	t->stale++;
+    }
+    t->misses++;
+
+    query(name, result, len);
+    nlen = strlen(name);
+    vlen = strlen(result);
+    /* Keep answers that found something and were not cut short */
+    if (vlen == 0 || vlen >= (size_t) len - 1 || nlen + vlen + 2 > QCACHE_TEXT)
+	return;
+    memcpy(e->text, name, nlen + 1);
+    memcpy(e->text + nlen + 1, result, vlen + 1);
+    e->hash = h;
+    e->version = version;
+    e->used = 1;
+}
+
+/* Make every cached answer for name stale.  Call after changing name. */
+void qcache_changed(char *name) {
+    if (qcache_on) __atomic_add_fetch(stripe_of(qhash(name)), 1, __ATOMIC_RELEASE);
+}
+
+/* Print the hits and misses so far, if the cache is on */
+void qcache_print(FILE *f) {
+    unsigned long hits = 0, misses = 0, stale = 0;
+    qthread_t *t;
+
+    if (!qcache_on) return;
+    for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+	hits += t->hits;
+	misses += t->misses;
+	stale += t->stale;
+    }
+    fprintf(f, "query cache: hits=%lu misses=%lu stale=%lu hit rate=%.1f%%\n",
+	    hits, misses, stale,
+	    (hits + misses) ? 100.0 * hits / (hits + misses) : 0.0);
+}
@@ -0,0 +1,24 @@
+#ifndef QCACHE_H
+#define QCACHE_H
+#include <stdio.h>
+/*
+ * Query result cache.  With the cache on (qcache_enable(), server -c),
+ * qcache_query() answers a query from a small cache of the thread's own
+ * before it goes to the DB, so a thread asking for the same few hot keys
+ * over and over mostly never touches the tree or its locks.  Off, it is
+ * just query().
+ *
+ * Keys hash to one of a fixed set of stripes, each with a version number
+ * that qcache_changed() bumps after every change to one of its keys (wal.c
+ * does this for every successful add and remove).  A cached answer carries
+ * the version its stripe had before the DB was asked, and is only used
+ * while the stripe still has it, so nothing needs to find and drop entries
+ * when a key changes.  Only answers that found something are cached.
+ *
+ * qcache_print() reports the hits and misses, when the cache is on.
+ */
+void qcache_enable(int);
+void qcache_query(char *, char *, int);
+void qcache_changed(char *);
+void qcache_print(FILE *);
+#endif
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "hist.h"
+#include "trace.h"
+
+/*
+ * Trace replayer.  Plays a trace recorded with server -T back against a
+ * server listening on a socket (server -s), whatever its backend:
+ *
+ *   replay -s /tmp/kv.sock [-x speed] trace
+ *
+ * Every client in the trace gets a connection and a thread of its own, and
+ * sends its commands in order, each one no earlier than it was sent when the
+ * trace was recorded, counting from when the replay starts.  -x 2 plays the
+ * trace twice as fast, and -x 0 as fast as the server will go.  A client
+ * waits for the answer to each command before it sends the next, as the
+ * window clients do.
+ *
+ * At the end the latency of the commands (from sending one to reading the
+ * last line of its answer) is printed, and, unless -x 0, how far behind
+ * their time they went out: a server that cannot keep up shows up there.
+ */
+
+/* A command to send, at when nanoseconds into the trace */
+typedef struct Cmd {
+    unsigned long when;
+    unsigned long client;
+    unsigned long seq;		/* Position in the trace */
+    char *text;			/* With its newline, not NUL terminated */
+    size_t off;			/* Where text is in the text of them all */
+    size_t len;
+} cmd_t;
+
+/* One client of the trace, played back by a thread of its own */
+typedef struct Player {
+    pthread_t thread;
+    cmd_t *cmds;
+    long n;
+    int fd;
+    hist_t latency;
+    hist_t behind;
+    int failed;
+} player_t;
+
+static char *sock_path;
+static double speed = 1.0;
+static unsigned long start;		/* When the replay started */
+static pthread_barrier_t ready;
+
+/* Order commands by client, then by place in the trace */
+static int by_client(const void *a, const void *b) {
+    const cmd_t *x = (const cmd_t *) a;
+    const cmd_t *y = (const cmd_t *) b;
+
+    if (x->client != y->client) return (x->client > y->client) - (x->client < y->client);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static int sock_connect(char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd == -1) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/* Sleep until t on the hist_now() clock */
+static void sleep_until(unsigned long t) {
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000000UL;
+    ts.tv_nsec = t % 1000000000UL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	;
+}
+
+static int write_all(int fd, char *p, size_t len) {
+    while (len > 0) {
+	ssize_t n = write(fd, p, len);
+
+	if (n == -1) {
+	    if (errno == EINTR) continue;
+	    return 0;
+	}
+	p += n;
+	len -= n;
+    }
+    return 1;
+}
+
+/* Thread body: play one client's commands */
+static void *player_run(void *arg) {
+    player_t *pl = (player_t *) arg;
+    FILE *in = fdopen(dup(pl->fd), "r");
+    char *line = NULL;
+    size_t cap = 0;
+    long i;
+
+    if (!in) pl->failed = 1;
+    pthread_barrier_wait(&ready);
+    for (i = 0; i < pl->n && !pl->failed; i++) {
+	cmd_t *c = &pl->cmds[i];
+	unsigned long sent;
+
+	if (speed > 0) {
+	    unsigned long due = start + (unsigned long) (c->when / speed);
+
+	    if (hist_now() < due) sleep_until(due);
+	    sent = hist_now();
+	    hist_add(&pl->behind, (sent > due) ? sent - due : 0);
+	} else sent = hist_now();
+
+	if (!write_all(pl->fd, c->text, c->len)) {
+	    pl->failed = 1;
+	    break;
+	}
+	/* The answer ends with the first line that does not start with a tab */
+	do {
+	    if (getline(&line, &cap, in) == -1) {
+		pl->failed = 1;
+		break;
+	    }
+	} while (line[0] == '\t');
+	hist_add(&pl->latency, hist_now() - sent);
+    }
+    free(line);
+    if (in) fclose(in);
+    return NULL;
+}
+
+/* Read the whole trace into *cmds; the commands' text is in *text.  Returns
+ * the number of commands, or -1. */
+static long load(char *path, cmd_t **cmds, char **text) {
+    FILE *f = fopen(path, "r");
+    trace_rec_t rec;
+    size_t text_len = 0, text_size = 0;
+    long n = 0, cap = 0, i;
+    int r;
+
+    *cmds = NULL;
+    *text = NULL;
+    if (!f) {
+	perror(path);
+	return -1;
+    }
+    if (!trace_start(f)) {
+	fprintf(stderr, "%s: not a trace\n", path);
+	fclose(f);
+	return -1;
+    }
+    memset(&rec, 0, sizeof(rec));
+    while ((r = trace_read(f, &rec)) == 1) {
+	if (n == cap) {
+	    cap = cap ? 2 * cap : 65536;
+	    if (!(*cmds = (cmd_t *) realloc(*cmds, cap * sizeof(cmd_t)))) break;
+	}
+	if (text_len + rec.len + 1 > text_size) {
+	    text_size = text_size ? 2 * text_size : 1 << 20;
+	    while (text_size < text_len + rec.len + 1) text_size *= 2;
+	    if (!(*text = (char *) realloc(*text, text_size))) break;
+	}
+	(*cmds)[n].when = rec.when;
+	(*cmds)[n].client = rec.client;
+	(*cmds)[n].seq = n;
+	(*cmds)[n].len = rec.len + 1;
+	/* The text may still move, so only its offset is kept for now */
+	(*cmds)[n].off = text_len;
+	memcpy(*text + text_len, rec.command, rec.len);
+	(*text)[text_len + rec.len] = '\n';
+	text_len += rec.len + 1;
+	n++;
+    }
+    free(rec.command);
+    fclose(f);
+    if (r == 1 || r == -1) {
+	fprintf(stderr, "%s: out of memory\n", path);
+	return -1;
+    }
+    for (i = 0; i < n; i++) (*cmds)[i].text = *text + (*cmds)[i].off;
+    return n;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s -s socket [-x speed] trace\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    player_t *players;
+    cmd_t *cmds;
+    char *text;
+    hist_t latency, behind;
+    unsigned long length = 0;
+    long n, i, j;
+    int nplayers = 0, failed = 0, opt, p;
+    double secs;
+
+    while ((opt = getopt(argc, argv, "s:x:")) != -1) {
+	switch (opt) {
+	case 's':
+	    sock_path = optarg;
+	    break;
+	case 'x':
+	    if ((speed = atof(optarg)) < 0) usage(argv[0]);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (!sock_path || optind != argc - 1) usage(argv[0]);
+
+    if ((n = load(argv[optind], &cmds, &text)) < 0) return 1;
+    if (n == 0) {
+	fprintf(stderr, "%s: empty trace\n", argv[optind]);
+	return 1;
+    }
+    for (i = 0; i < n; i++)
+	if (cmds[i].when > length) length = cmds[i].when;
+    qsort(cmds, n, sizeof(cmd_t), by_client);
+    for (i = 0; i < n; i++)
+	if (i == 0 || cmds[i].client != cmds[i - 1].client) nplayers++;
+    if (!(players = (player_t *) calloc(nplayers, sizeof(player_t)))) {
+	perror("replay");
+	return 1;
+    }
+    for (i = 0, p = 0; i < n; i = j, p++) {
+	for (j = i; j < n && cmds[j].client == cmds[i].client; j++)
+	    ;
+	players[p].cmds = &cmds[i];
+	players[p].n = j - i;
+	hist_init(&players[p].latency);
+	hist_init(&players[p].behind);
+	if ((players[p].fd = sock_connect(sock_path)) == -1) {
+	    perror(sock_path);
+	    return 1;
+	}
+    }
+
+    pthread_barrier_init(&ready, NULL, nplayers + 1);
+    for (p = 0; p < nplayers; p++)
+	if (pthread_create(&players[p].thread, NULL, player_run, &players[p])) {
+	    perror("pthread_create");
+	    return 1;
+	}
+    start = hist_now();
+    pthread_barrier_wait(&ready);
+    hist_init(&latency);
+    hist_init(&behind);
+    for (p = 0; p < nplayers; p++) {
+	pthread_join(players[p].thread, NULL);
+	hist_merge(&latency, &players[p].latency);
+	hist_merge(&behind, &players[p].behind);
+	if (players[p].failed) failed++;
+	close(players[p].fd);
+    }
+    secs = (hist_now() - start) / 1e9;
+
+    printf("replayed %lu of %ld commands from %d clients in %.3fs (%.0f/s), "
+	    "trace %.3fs long\n", latency.n, n, nplayers, secs,
+	    (secs > 0) ? latency.n / secs : 0.0, length / 1e9);
+    printf("latency: mean=%luns p50=%luns p99=%luns p999=%luns max=%luns\n",
+	    latency.n ? latency.sum / latency.n : 0,
+	    hist_percentile(&latency, 0.50), hist_percentile(&latency, 0.99),
+	    hist_percentile(&latency, 0.999), latency.max);
+    if (speed > 0)
+	printf("behind schedule: p50=%luns p99=%luns p999=%luns max=%luns\n",
+		hist_percentile(&behind, 0.50), hist_percentile(&behind, 0.99),
+		hist_percentile(&behind, 0.999), behind.max);
+    if (failed) fprintf(stderr, "%d clients lost their connection\n", failed);
+
+    pthread_barrier_destroy(&ready);
+    free(players);
+    free(cmds);
+    free(text);
+    return failed ? 1 : 0;
+}
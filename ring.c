@@ -0,0 +1,310 @@
+/* fopencookie */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "ring.h"
+
+/* Bytes each ring holds; a power of two */
+#define RING_SIZE (1 << 16)
+/* Times a side looks again before it goes to sleep, if there is another CPU
+ * for the other side to be running on */
+#define RING_SPIN 1024
+/* Milliseconds a sleeper waits before it checks the other side is alive */
+#define RING_CHECK_MS 200
+#define RING_NAME 64
+
+/*
+ * One direction.  tail and head count the bytes written and read since the
+ * start, wrapping; the bytes between them are in the ring.  A side that goes
+ * to sleep sets its asleep flag and waits on a wake-up counter, which the
+ * other side bumps (and wakes) only when it sees the flag.  Waiting on the
+ * counter rather than on tail or head means a wake-up for closed cannot be
+ * missed.  What each side writes is on cache lines of its own.
+ */
+typedef struct Ring {
+    /* Written by the producer */
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t closed;		/* The producer is done writing */
+    uint32_t writer_asleep;	/* Waiting for room */
+    uint32_t data_wakes;	/* Bumped to wake a reader */
+    /* Written by the consumer */
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t reader_asleep;	/* Waiting for data */
+    uint32_t room_wakes;	/* Bumped to wake a writer */
+    char data[RING_SIZE] __attribute__((aligned(64)));
+} ring_t;
+
+/* The shared object */
+typedef struct RingShm {
+    pid_t pid[2];		/* Creator, attacher (0 until it attaches) */
+    ring_t ring[2];		/* ring[0] runs from the attacher to the creator */
+} ring_shm_t;
+
+/* One side's view of a pair */
+struct RingPair {
+    ring_shm_t *shm;
+    int side;			/* 0 for the creator, 1 for the attacher */
+    int spin;			/* RING_SPIN, or 0 on one CPU */
+    int fd;			/* The object, with this side's byte locked */
+    ring_t *in;
+    ring_t *out;
+    char name[RING_NAME];
+};
+
+/* Rings created by this process, to keep their names distinct */
+static unsigned ring_count = 0;
+
+static int futex_wait(uint32_t *addr, uint32_t val, int ms) {
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Lock (or, with F_GETLK, test the lock on) the byte of the object that
+ * stands for side.  Each side holds its byte locked as long as it lives; the
+ * kernel drops the lock when the process exits, however it exits. */
+static int side_lock(int fd, int cmd, int side, struct flock *fl) {
+    memset(fl, 0, sizeof(*fl));
+    fl->l_type = F_WRLCK;
+    fl->l_whence = SEEK_SET;
+    fl->l_start = side;
+    fl->l_len = 1;
+    return fcntl(fd, cmd, fl);
+}
+
+/* True unless the process on the other side has attached and since gone */
+static int peer_alive(ring_pair_t *rp) {
+    struct flock fl;
+
+    if (!ring_attached(rp) || side_lock(rp->fd, F_GETLK, !rp->side, &fl) == -1)
+	return 1;
+    return fl.l_type != F_UNLCK;
+}
+
+/* Wait for *pos to move on from seen or for r to close.  Returns 0 if the
+ * other side has gone away instead. */
+static int ring_sleep(ring_pair_t *rp, ring_t *r, uint32_t *pos, uint32_t seen,
+	uint32_t *asleep, uint32_t *wakes) {
+    uint32_t w;
+    int i, gone = 0;
+
+    for (i = 0; i < rp->spin; i++)
+	if (__atomic_load_n(pos, __ATOMIC_ACQUIRE) != seen ||
+		__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+	    return 1;
+
+    w = __atomic_load_n(wakes, __ATOMIC_SEQ_CST);
+    __atomic_store_n(asleep, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(pos, __ATOMIC_SEQ_CST) == seen &&
+	    !__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST) &&
+	    futex_wait(wakes, w, RING_CHECK_MS) == -1 && errno == ETIMEDOUT)
+	gone = !peer_alive(rp);
+    __atomic_store_n(asleep, 0, __ATOMIC_RELAXED);
+    return !gone;
+}
+
+/* Wake the other side if it said it was asleep.  Follows a SEQ_CST store of
+ * what it is waiting for. */
+static void ring_wake(uint32_t *asleep, uint32_t *wakes) {
+    if (__atomic_load_n(asleep, __ATOMIC_SEQ_CST)) {
+	__atomic_add_fetch(wakes, 1, __ATOMIC_SEQ_CST);
+	futex_wake(wakes);
+    }
+}
+
+/* Map the object open on fd as side, which keeps fd */
+static ring_pair_t *ring_map(char *name, int fd, int side) {
+    ring_pair_t *rp = (ring_pair_t *) malloc(sizeof(ring_pair_t));
+    struct flock fl;
+    void *shm;
+
+    if (!rp) return NULL;
+    if (side_lock(fd, F_SETLK, side, &fl) == -1) {
+	free(rp);
+	return NULL;
+    }
+    shm = mmap(NULL, sizeof(ring_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+	free(rp);
+	return NULL;
+    }
+    rp->shm = (ring_shm_t *) shm;
+    rp->fd = fd;
+    rp->side = side;
+    rp->spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? RING_SPIN : 0;
+    rp->in = &rp->shm->ring[side];
+    rp->out = &rp->shm->ring[!side];
+    strncpy(rp->name, name, RING_NAME - 1);
+    rp->name[RING_NAME - 1] = '\0';
+    __atomic_store_n(&rp->shm->pid[side], getpid(), __ATOMIC_RELEASE);
+    return rp;
+}
+
+/* Create a new, empty pair of rings for another process to attach to.
+ * Returns NULL on failure. */
+ring_pair_t *ring_create(void) {
+    ring_pair_t *rp;
+    char name[RING_NAME];
+    int fd;
+
+    snprintf(name, RING_NAME, "/kvring.%d.%u", (int) getpid(),
+	    __atomic_fetch_add(&ring_count, 1, __ATOMIC_RELAXED));
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1)
+	return NULL;
+    /* A new object reads as zeroes: both rings empty, nobody attached */
+    if (ftruncate(fd, sizeof(ring_shm_t)) == -1 ||
+	    !(rp = ring_map(name, fd, 0))) {
+	close(fd);
+	shm_unlink(name);
+	return NULL;
+    }
+    return rp;
+}
+
+/* Attach to the pair of rings called name, made by ring_create() in another
+ * process.  Returns NULL on failure. */
+ring_pair_t *ring_attach(char *name) {
+    ring_pair_t *rp = NULL;
+    struct stat st;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDWR, 0)) == -1) return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size == (off_t) sizeof(ring_shm_t))
+	rp = ring_map(name, fd, 1);
+    else errno = EINVAL;
+    if (!rp) close(fd);
+    return rp;
+}
+
+/* The name to pass to ring_attach() */
+char *ring_name(ring_pair_t *rp) {
+    return rp->name;
+}
+
+/* True once the other side has attached */
+int ring_attached(ring_pair_t *rp) {
+    return __atomic_load_n(&rp->shm->pid[!rp->side], __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Read up to len bytes from the other side into buf.  If there are none,
+ * wait for some if block is set.  Returns the number read, 0 once the other
+ * side has closed its ring (and it is drained) or gone away, and -1 with
+ * errno EAGAIN if there is nothing to read and block is not set. */
+ssize_t ring_read(ring_pair_t *rp, char *buf, size_t len, int block) {
+    ring_t *r = rp->in;
+    uint32_t head = r->head, tail, at;
+    size_t n, first;
+
+    while ((tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == head) {
+	/* Anything written before the close is read first */
+	if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE) &&
+		__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head)
+	    return 0;
+	if (!block) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+	if (!ring_sleep(rp, r, &r->tail, head, &r->reader_asleep, &r->data_wakes))
+	    return 0;
+    }
+    n = tail - head;
+    if (n > len) n = len;
+    at = head & (RING_SIZE - 1);
+    first = (n < RING_SIZE - at) ? n : RING_SIZE - at;
+    memcpy(buf, r->data + at, first);
+    memcpy(buf + first, r->data, n - first);
+    __atomic_store_n(&r->head, head + (uint32_t) n, __ATOMIC_SEQ_CST);
+    ring_wake(&r->writer_asleep, &r->room_wakes);
+    return n;
+}
+
+/* Write all len bytes of buf to the other side, waiting for room as needed.
+ * Returns len, or -1 with errno EPIPE if the other side has gone away. */
+ssize_t ring_write(ring_pair_t *rp, const char *buf, size_t len) {
+    ring_t *r = rp->out;
+    uint32_t tail = r->tail, head, at;
+    size_t done = 0, n, first;
+
+    while (done < len) {
+	while (tail - (head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == RING_SIZE)
+	    if (!ring_sleep(rp, r, &r->head, head, &r->writer_asleep, &r->room_wakes)) {
+		errno = EPIPE;
+		return -1;
+	    }
+	n = RING_SIZE - (tail - head);
+	if (n > len - done) n = len - done;
+	at = tail & (RING_SIZE - 1);
+	first = (n < RING_SIZE - at) ? n : RING_SIZE - at;
+	memcpy(r->data + at, buf + done, first);
+	memcpy(r->data, buf + done + first, n - first);
+	tail += (uint32_t) n;
+	__atomic_store_n(&r->tail, tail, __ATOMIC_SEQ_CST);
+	ring_wake(&r->reader_asleep, &r->data_wakes);
+	done += n;
+    }
+    return len;
+}
+
+/* Close this side's ring to the other side: it reads an end of input once it
+ * has read what was written before. */
+void ring_shutdown(ring_pair_t *rp) {
+    __atomic_store_n(&rp->out->closed, 1, __ATOMIC_SEQ_CST);
+    ring_wake(&rp->out->reader_asleep, &rp->out->data_wakes);
+}
+
+/* Close this side's ring and unmap the pair.  The creator also removes its
+ * name; the mapping of a side still attached stays good. */
+void ring_destroy(ring_pair_t *rp) {
+    if (!rp) return;
+    ring_shutdown(rp);
+    munmap(rp->shm, sizeof(ring_shm_t));
+    close(rp->fd);
+    if (rp->side == 0) shm_unlink(rp->name);
+    free(rp);
+}
+
+static ssize_t cookie_read(void *c, char *buf, size_t size) {
+    return ring_read((ring_pair_t *) c, buf, size, 1);
+}
+
+/* stdio takes 0 as a failed write */
+static ssize_t cookie_write(void *c, const char *buf, size_t size) {
+    return (ring_write((ring_pair_t *) c, buf, size) == -1) ? 0 : (ssize_t) size;
+}
+
+static int cookie_close_write(void *c) {
+    ring_shutdown((ring_pair_t *) c);
+    return 0;
+}
+
+/* A stream reading from the other side (mode "r") or writing to it ("w").
+ * Closing the writing stream calls ring_shutdown(); neither stream's close
+ * unmaps the pair, which still needs ring_destroy(). */
+FILE *ring_fopen(ring_pair_t *rp, const char *mode) {
+    cookie_io_functions_t io;
+
+    memset(&io, 0, sizeof(io));
+    if (mode[0] == 'r') io.read = cookie_read;
+    else {
+	io.write = cookie_write;
+	io.close = cookie_close_write;
+    }
+    return fopencookie(rp, mode, io);
+}
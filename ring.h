@@ -0,0 +1,33 @@
+#ifndef RING_H
+#define RING_H
+#include <stdio.h>
+#include <sys/types.h>
+/*
+ * A pair of single-producer, single-consumer byte rings in a shared memory
+ * object, for the server and an interface process to exchange commands and
+ * responses without a system call per message.  The server creates the pair
+ * with ring_create() and passes its name to the interface, which maps it with
+ * ring_attach().  Each side writes to one ring and reads the other.
+ *
+ * A reader with nothing to read and a writer with no room spin briefly, then
+ * sleep on a futex; the other side only makes the wake-up call when someone is
+ * actually asleep, so while both sides are busy nothing enters the kernel.
+ * Sleepers wake up every so often to check the other process is still there,
+ * so a side that dies without closing its ring reads as an end of input.
+ *
+ * ring_fopen() wraps a side's half as a stdio stream, so the usual fprintf,
+ * getline and fflush work over it; closing the writing stream closes that
+ * ring, which the reader sees as end of input once it has drained.
+ */
+typedef struct RingPair ring_pair_t;
+
+ring_pair_t *ring_create(void);
+ring_pair_t *ring_attach(char *);
+char *ring_name(ring_pair_t *);
+int ring_attached(ring_pair_t *);
+ssize_t ring_read(ring_pair_t *, char *, size_t, int);
+ssize_t ring_write(ring_pair_t *, const char *, size_t);
+void ring_shutdown(ring_pair_t *);
+void ring_destroy(ring_pair_t *);
+FILE *ring_fopen(ring_pair_t *, const char *);
+#endif
@@ -0,0 +1,151 @@
+#include <string.h>
+#include <pthread.h>
+#include "hist.h"
+#include "rwlock.h"
+#include "opstats.h"
+
+/*
+ * The lock is a mutex guarding a little state, with readers and writers
+ * sleeping on condition variables of their own.  The policies differ only in
+ * when a reader may come in and in whom a departing writer wakes.
+ *
+ * Phase-fair readers that have to wait are let in by the writer ahead of
+ * them: when it leaves it counts them all in at once and bumps phase, and
+ * they wake up already holding the lock.  That way a writer that arrives
+ * while they are still waking cannot slip in ahead of them.
+ */
+
+void rwlock_init(rwlock_t *rw, rw_policy_t policy) {
+    pthread_mutex_init(&rw->mutex, NULL);
+    pthread_cond_init(&rw->readers_ok, NULL);
+    pthread_cond_init(&rw->writer_ok, NULL);
+    rw->policy = policy;
+    rw->readers = rw->writer = 0;
+    rw->readers_waiting = rw->writers_waiting = 0;
+    rw->phase = 0;
+    hist_init(&rw->read_wait);
+    hist_init(&rw->write_wait);
+}
+
+static char *policy_names[] = { "reader", "writer", "phase" };
+
+/* Set *policy to the policy called name.  Returns 0 if there is none. */
+int rwlock_policy(char *name, rw_policy_t *policy) {
+    int i;
+
+    for (i = 0; i < (int) (sizeof(policy_names) / sizeof(policy_names[0])); i++)
+	if (strcmp(name, policy_names[i]) == 0) {
+	    *policy = (rw_policy_t) i;
+	    return 1;
+	}
+    return 0;
+}
+
+char *rwlock_policy_name(rw_policy_t policy) {
+    return policy_names[policy];
+}
+
+/* Returns whether the lock had to be waited for */
+int rwlock_rdlock(rwlock_t *rw) {
+    unsigned long t0 = hist_now(), wait;
+    int waited = 0;
+
+    pthread_mutex_lock(&rw->mutex);
+    switch (rw->policy) {
+    case RW_READER:
+	while (rw->writer) {
+	    rw->readers_waiting++;
+	    pthread_cond_wait(&rw->readers_ok, &rw->mutex);
+	    rw->readers_waiting--;
+	    waited = 1;
+	}
+	rw->readers++;
+	break;
+    case RW_WRITER:
+	while (rw->writer || rw->writers_waiting) {
+	    rw->readers_waiting++;
+	    pthread_cond_wait(&rw->readers_ok, &rw->mutex);
+	    rw->readers_waiting--;
+	    waited = 1;
+	}
+	rw->readers++;
+	break;
+    case RW_PHASE:
+	if (rw->writer || rw->writers_waiting) {
+	    unsigned long phase = rw->phase;
+
+	    /* Wait to be let in by the writer ahead */
+	    rw->readers_waiting++;
+	    while (rw->phase == phase)
+		pthread_cond_wait(&rw->readers_ok, &rw->mutex);
+	    waited = 1;
+	} else rw->readers++;
+	break;
+    }
+    wait = hist_now() - t0;
+    hist_add(&rw->read_wait, wait);
+    pthread_mutex_unlock(&rw->mutex);
+    opstats_add(OP_LOCK, wait);
+    return waited;
+}
+
+/* Returns whether the lock had to be waited for */
+int rwlock_wrlock(rwlock_t *rw) {
+    unsigned long t0 = hist_now(), wait;
+    int waited = 0;
+
+    pthread_mutex_lock(&rw->mutex);
+    rw->writers_waiting++;
+    while (rw->writer || rw->readers) {
+	pthread_cond_wait(&rw->writer_ok, &rw->mutex);
+	waited = 1;
+    }
+    rw->writers_waiting--;
+    rw->writer = 1;
+    wait = hist_now() - t0;
+    hist_add(&rw->write_wait, wait);
+    pthread_mutex_unlock(&rw->mutex);
+    opstats_add(OP_LOCK, wait);
+    return waited;
+}
+
+void rwlock_rdunlock(rwlock_t *rw) {
+    pthread_mutex_lock(&rw->mutex);
+    if (--rw->readers == 0 && rw->writers_waiting)
+	pthread_cond_signal(&rw->writer_ok);
+    pthread_mutex_unlock(&rw->mutex);
+}
+
+/* The last reader out wakes a writer, so a writer that lets readers in need
+ * not wake one as well */
+void rwlock_wrunlock(rwlock_t *rw) {
+    pthread_mutex_lock(&rw->mutex);
+    rw->writer = 0;
+    switch (rw->policy) {
+    case RW_READER:
+	if (rw->readers_waiting) pthread_cond_broadcast(&rw->readers_ok);
+	else if (rw->writers_waiting) pthread_cond_signal(&rw->writer_ok);
+	break;
+    case RW_WRITER:
+	if (rw->writers_waiting) pthread_cond_signal(&rw->writer_ok);
+	else if (rw->readers_waiting) pthread_cond_broadcast(&rw->readers_ok);
+	break;
+    case RW_PHASE:
+	if (rw->readers_waiting) {
+	    rw->readers += rw->readers_waiting;
+	    rw->readers_waiting = 0;
+	    rw->phase++;
+	    pthread_cond_broadcast(&rw->readers_ok);
+	} else if (rw->writers_waiting) pthread_cond_signal(&rw->writer_ok);
+	break;
+    }
+    pthread_mutex_unlock(&rw->mutex);
+}
+
+/* Add the lock's read and write wait histograms into read and write */
+void rwlock_waits(rwlock_t *rw, hist_t *read, hist_t *write) {
+    pthread_mutex_lock(&rw->mutex);
+    hist_merge(read, &rw->read_wait);
+    hist_merge(write, &rw->write_wait);
+    pthread_mutex_unlock(&rw->mutex);
+}
@@ -0,0 +1,47 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+#include <pthread.h>
+#include "hist.h"
+/*
+ * A reader/writer lock with a choice of policy for who goes next when both
+ * readers and writers are waiting:
+ *
+ *   RW_READER	 readers get in whenever no writer holds the lock, so a steady
+ *		 stream of readers can keep writers out indefinitely
+ *   RW_WRITER	 a waiting writer keeps new readers out, so writers can only be
+ *		 held up by each other (and can starve readers)
+ *   RW_PHASE	 phase-fair: readers and writers take turns.  A writer waits
+ *		 for the readers already in; readers that arrive after it wait
+ *		 for it and then all get in together before the next writer.
+ *		 Neither side waits for more than one phase of the other.
+ *
+ * Unlike a mutex handed from the first reader to the last, any thread may
+ * release a read lock it holds.  The time each acquisition waited is recorded
+ * in the lock's read and write histograms, and rwlock_rdlock() and
+ * rwlock_wrlock() return whether they had to wait at all.
+ */
+typedef enum { RW_READER, RW_WRITER, RW_PHASE } rw_policy_t;
+
+typedef struct RWLock {
+    pthread_mutex_t mutex;	/* Protects everything below */
+    pthread_cond_t readers_ok;
+    pthread_cond_t writer_ok;
+    rw_policy_t policy;
+    int readers;		/* Readers in (or let in, for RW_PHASE) */
+    int writer;			/* A writer is in */
+    int readers_waiting;
+    int writers_waiting;
+    unsigned long phase;	/* RW_PHASE: bumped when waiting readers are let in */
+    hist_t read_wait;		/* Nanoseconds each acquisition waited */
+    hist_t write_wait;
+} rwlock_t;
+
+void rwlock_init(rwlock_t *, rw_policy_t);
+int rwlock_policy(char *, rw_policy_t *);
+char *rwlock_policy_name(rw_policy_t);
+int rwlock_rdlock(rwlock_t *);
+int rwlock_wrlock(rwlock_t *);
+void rwlock_rdunlock(rwlock_t *);
+void rwlock_wrunlock(rwlock_t *);
+void rwlock_waits(rwlock_t *, hist_t *, hist_t *);
+#endif
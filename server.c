@@ -12,7 +12,16 @@
 #include "window.h"
 #include "db.h"
 #include "words.h"
+#include "pool.h"
+#include "sock.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "opstats.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "qcache.h"
 #include <pthread.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <time.h>
 #include <signal.h>
@@ -23,51 +32,143 @@ typedef struct Client {
 	pthread_t thread;
 	window_t *win;
     int threadID;
+    /* Pool mode only: the line being worked on, kept across steps */
+    char *command;
+    size_t clen;
+    //When the client started and finished being served
+    struct timeval start_time;
+    struct timeval end_time;
+    //Next on the queue of finished clients waiting for the reaper
+    struct Client *next_done;
 } client_t;
 
+/* Commands a pool worker runs for one client before it lets other clients
+ * have a turn */
+#define CLIENT_BATCH 64
+
 /* Creates, Runs, and Eventually Destroys Client */
 void* client_runner(void* c);
 /* Interface with a client: get requests, carry them out and report results */
 void *client_run(void *);
 /* Way to destroy the client */
 void client_destroy(client_t *client);
-/* Interface to the db routines.  Pass a command, get a result */
-int handle_command(char *, char *, int len);
+/* Record a finished client's service time, destroy it and queue it for the
+ * reaper */
+void client_done(client_t *client);
+/* Join finished clients and free them as they finish */
+void *reaper_run(void *);
+/* Pool mode: run a batch of commands for a client with input waiting */
+void client_step(void *);
+/* Pool mode: hand a client to the poller to wait for input */
+void poller_watch(client_t *client);
+/* Interface to the db routines.  Pass the number of the client sending it
+ * and a command, get a result (and any extra lines of it passed to the
+ * function given) */
+int handle_command(int, char *, char *, int len, void (*)(char *, void *), void *);
 /* Way to spawn more threads and such */
 char menu();
-/*Mutex to keep track of threads that need to be joined*/
+/*Mutex to keep track of threads that need to be joined: protects the
+ * registry count and the queue of finished clients below*/
 pthread_mutex_t mutex_joinThreads;
-
-/* Mutex and Condition Variable to deal with s and g commands */
+/* Signalled when the last registered client has been reaped */
+pthread_cond_t cond_clientDone;
+/* Signalled when a client is queued for the reaper, or the reaper should
+ * stop */
+pthread_cond_t cond_reap;
+
+/* Clients started and not yet reaped.  There is no fixed limit: a client
+ * registers itself in client_start() and the reaper takes it off. */
+int clients_live = 0;
+/* Finished clients waiting for the reaper, oldest first */
+client_t *done_head = NULL;
+client_t **done_tail = &done_head;
+int reaper_stopping = 0;
+pthread_t reaper_thread;
+
+/* The worker pool, or NULL when every client gets its own thread */
+pool_t *pool = NULL;
+
+/* Pool mode: clients waiting to be added to the poller's set, and a pipe the
+ * poller also waits on so it notices them (and poller_stopping) */
+pthread_mutex_t mutex_poller;
+client_t **poller_new = NULL;
+int poller_nnew = 0;
+int poller_new_size = 0;
+int poller_pipe[2];
+int poller_stopping = 0;
+pthread_t poller_thread;
+
+/* Mutex and Condition Variable to deal with s and g commands.  Clients read
+ * lockDownClients atomically and only take the mutex while it is set; it is
+ * changed under the mutex so that a client deciding to wait cannot miss the
+ * g that clears it. */
 pthread_mutex_t mutex_ClientLock;
 pthread_cond_t cond_ClientWait;
-char lockDownClients; //0 = not lock, 1 = lock
-
-/* Way to show which thread IDs (basic ints) are working/need to be joined */
-/* '0' = not in use, '1' = in use, '2' = need to be joined */
-char* threadStatus;
-
-/* Way to measure the service time for each thread */
-unsigned int* thread_service_times;
-
-//Arrays to hold all the time values
-struct timeval* thread_start_times;
-struct timeval* thread_end_times;
+char lockDownClients; //'0' = not lock, '1' = lock
 
 void* client_runner(void* c)
 {   
     client_run((client_t*)c);
+    client_done((client_t*)c);
+    return  0;
+}
 
-    gettimeofday(&(thread_end_times[ ((client_t*)c)->threadID ]), NULL);
+void client_done(client_t *c)
+{
+    gettimeofday(&c->end_time, NULL);
 
-    thread_service_times[ ((client_t*)c)->threadID ] = 
-        (unsigned int)((thread_end_times[ ((client_t*)c)->threadID ].tv_sec * 1000 + 
-            thread_end_times[ ((client_t*)c)->threadID ].tv_usec * 0.001) 
-            - (thread_start_times[ ((client_t*)c)->threadID ].tv_sec * 1000 + 
-                thread_start_times[ ((client_t*)c)->threadID ].tv_usec * 0.001));
+    client_destroy(c);
 
-    client_destroy((client_t*)c);
-    return  0;
+    //Queue the client for the reaper, which joins its thread and frees it
+    pthread_mutex_lock(&mutex_joinThreads);
+    c->next_done = NULL;
+    *done_tail = c;
+    done_tail = &c->next_done;
+    pthread_cond_signal(&cond_reap);
+    pthread_mutex_unlock(&mutex_joinThreads);
+}
+
+/* How long a finished client was served, in milliseconds */
+unsigned int client_service_time(client_t *c)
+{
+    return (unsigned int)((c->end_time.tv_sec * 1000 + c->end_time.tv_usec * 0.001)
+        - (c->start_time.tv_sec * 1000 + c->start_time.tv_usec * 0.001));
+}
+
+/*
+ * The reaper: joins each client's thread as soon as the client finishes and
+ * frees it, so the cost of reaping grows with the clients that finish and
+ * nothing else.  Takes the last client off the registry and wakes anyone
+ * waiting for them all (the w command).  Runs until reaper_stopping is set
+ * and the queue is empty.
+ */
+void *reaper_run(void *arg)
+{
+    client_t *c;
+
+    pthread_mutex_lock(&mutex_joinThreads);
+    for (;;)
+    {
+        while (!done_head && !reaper_stopping)
+            pthread_cond_wait(&cond_reap, &mutex_joinThreads);
+        if (!done_head) break;
+        c = done_head;
+        if (!(done_head = c->next_done)) done_tail = &done_head;
+        pthread_mutex_unlock(&mutex_joinThreads);
+
+        //A finished pool mode client has no thread left to join
+        if (pool || pthread_join(c->thread, NULL) == 0)
+        {
+            fprintf(stderr, "Thread %i Terminated and Joined! Service Time: %u milliseconds\n",
+                c->threadID, client_service_time(c));
+        }
+        free(c);
+
+        pthread_mutex_lock(&mutex_joinThreads);
+        if (--clients_live == 0) pthread_cond_broadcast(&cond_clientDone);
+    }
+    pthread_mutex_unlock(&mutex_joinThreads);
+    return 0;
 }
 
 /*
@@ -84,13 +185,8 @@ client_t *client_create(int ID) {
     if (!new_Client) return NULL;
 
     new_Client->threadID = ID;
-
-    //Lock Mutex to enter critical section
-    pthread_mutex_lock(&mutex_joinThreads);
-    //Change status
-    threadStatus[new_Client->threadID] = '1';
-    //Exit critical section
-    pthread_mutex_unlock(&mutex_joinThreads);
+    new_Client->command = NULL;
+    new_Client->clen = 0;
 
     sprintf(title, "Client %d", new_Client->threadID);
 
@@ -115,18 +211,14 @@ client_t *client_create_no_window(char *in, char *out, int ID) {
 
     client_t *new_Client = (client_t *) malloc(sizeof(client_t));
 
+    if (!new_Client) return NULL;
+
     //fprintf(stderr, "%c\n", in[0]);
     //fprintf(stderr, "%s\n", outf);
     new_Client->threadID = ID;
+    new_Client->command = NULL;
+    new_Client->clen = 0;
 
-    //Lock Mutex to enter critical section
-    pthread_mutex_lock(&mutex_joinThreads);
-    //Change status
-    threadStatus[new_Client->threadID] = '1';
-    //Exit critical section
-    pthread_mutex_unlock(&mutex_joinThreads);
-
-    if (!new_Client) return NULL;
     /* Creates a window and set up a communication channel with it */
     if( (new_Client->win = nowindow_create(in, outf))) return new_Client;
     else {
@@ -145,28 +237,194 @@ void client_destroy(client_t *client) {
 	/* Remove the window */
 
 	window_destroy(client->win);
+	client->win = NULL;
+	free(client->command);
+	client->command = NULL;
+}
 
-    //Lock Mutex to enter critical section
+/* Wait until every client started so far has finished and been reaped */
+void clients_wait()
+{
     pthread_mutex_lock(&mutex_joinThreads);
-    //Change status
-    //fprintf(stderr, "\nThread %i Terminated, Need to Join\n", client->threadID);
-    threadStatus[client->threadID] = '2';
-    //Exit critical section
+    while (clients_live > 0)
+        pthread_cond_wait(&cond_clientDone, &mutex_joinThreads);
     pthread_mutex_unlock(&mutex_joinThreads);
+}
 
-    pthread_exit(0);
-	//free(client);
+/* Start serving a new client: register it, then give it a thread of its own,
+ * or in pool mode start its clock and let the poller wait for its first
+ * command.  If no thread can be made, the client is destroyed and freed. */
+int client_start(client_t *client)
+{
+    int err;
+
+    pthread_mutex_lock(&mutex_joinThreads);
+    clients_live++;
+    pthread_mutex_unlock(&mutex_joinThreads);
+
+    if (pool)
+    {
+        gettimeofday(&client->start_time, NULL);
+        poller_watch(client);
+        return 0;
+    }
+
+    err = pthread_create(&client->thread, NULL, client_runner, (void*)client);
+    if (err)
+    {
+        client_destroy(client);
+        free(client);
+        pthread_mutex_lock(&mutex_joinThreads);
+        if (--clients_live == 0) pthread_cond_broadcast(&cond_clientDone);
+        pthread_mutex_unlock(&mutex_joinThreads);
+    }
+    return err;
 }
 
-/* Code executed by the client */
-void *client_run(void *arg)
+/* Block while the server has clients stopped (the s command).  Called before
+ * every command, so when clients are not stopped it takes no lock. */
+void client_pause()
 {
+    if (__atomic_load_n(&lockDownClients, __ATOMIC_ACQUIRE) != '1') return;
+
     pthread_mutex_lock(&mutex_ClientLock);
-    if(lockDownClients == '1')
+    while(lockDownClients == '1')
     {
         pthread_cond_wait(&cond_ClientWait,&mutex_ClientLock);
     }
     pthread_mutex_unlock(&mutex_ClientLock);
+}
+
+/*
+ * Pool mode: the work done for a client each time it is picked off the
+ * queue.  Runs the commands already waiting on its input, up to CLIENT_BATCH
+ * of them, and writes all their responses with one flush.  Then the client
+ * goes back on the queue if it has more input, back to the poller if it has
+ * none, or is finished if its input has ended.  A client is only ever on the
+ * queue or in the poller once, so its commands run in order.
+ */
+void client_step(void *arg)
+{
+    client_t *client = (client_t *) arg;
+    window_t *win = client->win;
+    char response[256] = { 0 };
+    ssize_t len;
+    int n = 0;
+
+    if ((len = window_getline(win, &client->command, &client->clen)) == 0)
+    {
+        window_fill(win);
+        len = window_getline(win, &client->command, &client->clen);
+    }
+    while (len > 0)
+    {
+        client_pause();
+        handle_command(client->threadID, client->command, response,
+            sizeof(response), window_emit, win);
+        window_reply(win, response);
+        if (++n == CLIENT_BATCH) break;
+        len = window_getline(win, &client->command, &client->clen);
+    }
+    window_flush(win);
+
+    if (len < 0) client_done(client);
+    else if (len > 0) pool_submit(pool, client);
+    else poller_watch(client);
+}
+
+/* Pool mode: add a client to the set the poller waits on */
+void poller_watch(client_t *client)
+{
+    pthread_mutex_lock(&mutex_poller);
+    if (poller_nnew == poller_new_size)
+    {
+        poller_new_size = poller_new_size ? 2 * poller_new_size : 16;
+        poller_new = realloc(poller_new, poller_new_size * sizeof(client_t*));
+    }
+    poller_new[poller_nnew++] = client;
+    pthread_mutex_unlock(&mutex_poller);
+    //Wake the poller.  If the pipe is full a wakeup is already pending.
+    if (write(poller_pipe[1], "", 1) == -1 && errno != EAGAIN)
+        perror("poller wakeup");
+}
+
+/*
+ * Pool mode: the one thread that waits for input on behalf of every idle
+ * client.  When a client's input becomes readable the client leaves the set
+ * and goes on the pool's queue; client_step() puts it back when it is out of
+ * input again.
+ */
+void *poller_run(void *arg)
+{
+    struct pollfd *fds = NULL;
+    client_t **watched = NULL;
+    int nwatched = 0;
+    int size = 0;
+    char drain[64];
+    int i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&mutex_poller);
+        if (poller_stopping)
+        {
+            pthread_mutex_unlock(&mutex_poller);
+            break;
+        }
+        if (nwatched + poller_nnew + 1 > size)
+        {
+            size = 2 * (nwatched + poller_nnew + 1);
+            watched = realloc(watched, size * sizeof(client_t*));
+            fds = realloc(fds, size * sizeof(struct pollfd));
+        }
+        for (i = 0; i < poller_nnew; i++)
+        {
+            watched[nwatched++] = poller_new[i];
+        }
+        poller_nnew = 0;
+        pthread_mutex_unlock(&mutex_poller);
+
+        fds[0].fd = poller_pipe[0];
+        fds[0].events = POLLIN;
+        for (i = 0; i < nwatched; i++)
+        {
+            fds[i + 1].fd = window_fd(watched[i]->win);
+            fds[i + 1].events = POLLIN;
+        }
+
+        if (poll(fds, nwatched + 1, -1) == -1)
+        {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents)
+        {
+            while (read(poller_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        //Walk backwards so that moving the last client into a freed slot
+        //only moves one that has already been looked at
+        for (i = nwatched - 1; i >= 0; i--)
+        {
+            if (fds[i + 1].revents)
+            {
+                pool_submit(pool, watched[i]);
+                watched[i] = watched[--nwatched];
+            }
+        }
+    }
+    free(watched);
+    free(fds);
+    return 0;
+}
+
+
+/* Code executed by the client */
+void *client_run(void *arg)
+{
+    client_pause();
 	client_t *client = (client_t *) arg;
 
 	/* main loop of the client: fetch commands from window, interpret
@@ -177,38 +435,41 @@ void *client_run(void *arg)
 	char response[256] = { 0 };
 
     //Start timing the execution time of the thread
-    gettimeofday(&(thread_start_times[ (client)->threadID ]), NULL);
+    gettimeofday(&client->start_time, NULL);
 
 	/* Serve until the other side closes the pipe */
 	while (serve(client->win, response, &command, &clen) != -1) {
         //fprintf(stderr, "Thread %i A\n", client->threadID);
-        //Lock to check to see if this needs to block
-        pthread_mutex_lock(&mutex_ClientLock);
-        //fprintf(stderr, "Thread %i C\n", client->threadID);
-        if(lockDownClients == '1')
-        {
-            //fprintf(stderr, "Thread %i D\n", client->threadID);
-            pthread_cond_wait(&cond_ClientWait,&mutex_ClientLock);
-        }
-
-        pthread_mutex_unlock(&mutex_ClientLock);
+        //Check to see if this needs to block
+        client_pause();
         //fprintf(stderr, "Thread %i E\n", client->threadID);
         //fprintf(stderr, "Thread %i F\n", client->threadID);
-        handle_command(command, response, sizeof(response));
+        handle_command(client->threadID, command, response, sizeof(response),
+            window_emit, client->win);
         //fprintf(stderr, "Thread %i G\n", client->threadID);
 	}
 	return 0;
 }
 
-int handle_command(char *command, char *response, int len) {
+int handle_command(int id, char *command, char *response, int len,
+	void (*emit)(char *, void *), void *arg) {
     if (command[0] == EOF) {
 	strncpy(response, "all done", len - 1);
 	return 0;
     }
-    interpret_command(command, response, len);
+    trace_command(id, command);
+    interpret_stream(command, response, len, emit, arg);
     return 1;
 }
 
+/* Socket front end entry point: socket clients are stopped by s like any
+ * other client */
+int sock_command(char *command, char *response, int len,
+	void (*emit)(char *, void *), void *arg) {
+    client_pause();
+    return handle_command(sock_client(arg), command, response, len, emit, arg);
+}
+
 char menu()
 {
     //Print out the menu and return the command that the user inputs
@@ -218,6 +479,7 @@ char menu()
     fprintf(stderr, "s: Stop Processing Command from Clients\n");
     fprintf(stderr, "g: Continue Processing Command from Clients\n");
     fprintf(stderr, "w: Stop Processing Server Commands\n");
+    fprintf(stderr, "i: Show Operation Latencies\n");
     fprintf(stderr, "\nPlease Choose a Command: ");
 
     int getlineCharsRead;
@@ -241,43 +503,158 @@ char menu()
 
 int main(int argc, char *argv[]) {
     //fprintf(stderr, "%i\n", getpid());
-    int MAX_SIZE = 1000;
-    //Allows for a max of 100 threads
-    client_t** client_array = malloc(MAX_SIZE * sizeof(client_t*));
-    //Array to Signify which threads what to be joined
-    threadStatus = malloc(MAX_SIZE * sizeof(char));
-    //Array to hold how long a thread takes to run
-    thread_service_times = malloc(MAX_SIZE * sizeof(unsigned int));
-
-    thread_start_times = malloc(MAX_SIZE * sizeof(struct timeval));
-    thread_end_times = malloc(MAX_SIZE * sizeof(struct timeval));
-
     //Initialize the Mutex!
     pthread_mutex_init(&mutex_joinThreads,NULL);
 
     pthread_mutex_init(&mutex_ClientLock,NULL);
     pthread_cond_init(&cond_ClientWait,NULL);
+    pthread_cond_init(&cond_clientDone,NULL);
+    pthread_cond_init(&cond_reap,NULL);
+    pthread_mutex_init(&mutex_poller,NULL);
 
     char* myEfileInput;
     char* myEfileOutput;
 
     lockDownClients = '0';
 
-    int i;
-    for(i = 0; i < MAX_SIZE; i++)
+    client_t *c = NULL;	    /* A client to serve */
+    int started = 0;	    /* Number of clients started */
+
+    int opt;
+    int use_pool = 0;
+    int use_rings = 0;
+    char *sock_path = NULL;
+    char *log_path = NULL;
+    char *snap_path = NULL;
+    char *trace_path = NULL;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpus < 1) ncpus = 1;
+
+    while ((opt = getopt(argc, argv, "prs:l:i:n:T:c")) != -1)
     {
-        client_array[i] = 0;
-        threadStatus[i] = '0';
-    }
+        switch (opt)
+        {
+            //Serve clients from a pool of workers, one per core
+            case 'p':
+                use_pool = 1;
+            break;
 
-    //client_t *c = NULL;	    /* A client to serve */
-    int started = 0;	    /* Number of clients started */
+            //Talk to window clients through shared memory rings
+            case 'r':
+                use_rings = 1;
+            break;
 
-    if (argc != 1) {
-	fprintf(stderr, "Usage: server\n");
+            //Also accept clients on a Unix-domain socket
+            case 's':
+                sock_path = optarg;
+            break;
+
+            //Log changes to a write-ahead log, replaying it first
+            case 'l':
+                log_path = optarg;
+            break;
+
+            //Start from a snapshot saved with the s command
+            case 'i':
+                snap_path = optarg;
+            break;
+
+            //Split the DB into this many independently locked trees
+            case 'n':
+                if (!db_init(atoi(optarg)))
+                {
+                    fprintf(stderr, "The number of shards must be 1 to %d\n",
+                        DB_SHARDS_MAX);
+                    exit(1);
+                }
+            break;
+
+            //Record every command clients send, for replay
+            case 'T':
+                trace_path = optarg;
+            break;
+
+            //Cache query results in each thread
+            case 'c':
+                qcache_enable(1);
+            break;
+
+            default:
+                fprintf(stderr, "Usage: server [-p] [-r] [-s socket] [-l logfile] [-i snapshot] [-n shards] [-T trace] [-c]\n");
+                exit(1);
+        }
+    }
+    if (optind != argc) {
+	fprintf(stderr, "Usage: server [-p] [-r] [-s socket] [-l logfile] [-i snapshot] [-n shards] [-T trace] [-c]\n");
 	exit(1);
     }
 
+    //The snapshot is loaded first, then the log replayed over it (replaying
+    //changes the snapshot already holds does nothing)
+    if (snap_path)
+    {
+        long loaded = snapshot_load(snap_path);
+
+        if (loaded < 0)
+        {
+            fprintf(stderr, "Could not load snapshot %s\n", snap_path);
+            exit(1);
+        }
+        fprintf(stderr, "Loaded %ld entries from %s\n", loaded, snap_path);
+    }
+
+    //The log is replayed before anything can reach the DB
+    if (log_path && wal_open(log_path) == -1)
+    {
+        fprintf(stderr, "Could not open log %s\n", log_path);
+        exit(1);
+    }
+
+    if (trace_path && trace_open(trace_path) == -1)
+    {
+        fprintf(stderr, "Could not open trace %s\n", trace_path);
+        exit(1);
+    }
+
+    //The poller waits on file descriptors, which rings do not have
+    if (use_rings && use_pool)
+    {
+        fprintf(stderr, "Window clients use fifos in pool mode\n");
+        use_rings = 0;
+    }
+    window_use_rings(use_rings);
+
+    if (use_pool)
+    {
+        if (pipe(poller_pipe) == -1 ||
+            fcntl(poller_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+            fcntl(poller_pipe[1], F_SETFL, O_NONBLOCK) == -1 ||
+            !(pool = pool_create((int)ncpus, client_step)) ||
+            pthread_create(&poller_thread, NULL, poller_run, NULL))
+        {
+            fprintf(stderr, "Could not start the worker pool\n");
+            exit(1);
+        }
+        fprintf(stderr, "Serving clients with %ld workers\n", ncpus);
+    }
+
+    if (sock_path)
+    {
+        if (sock_start(sock_path, (int)ncpus, sock_command) == -1)
+        {
+            fprintf(stderr, "Could not listen on %s\n", sock_path);
+            exit(1);
+        }
+        fprintf(stderr, "Accepting clients on %s\n", sock_path);
+    }
+
+    if (pthread_create(&reaper_thread, NULL, reaper_run, NULL))
+    {
+        fprintf(stderr, "Could not start the reaper\n");
+        exit(1);
+    }
+
     //if ((c = client_create(started++)) )  {
 	//   client_run(c);
 	//   client_destroy(c);
@@ -295,10 +672,10 @@ int main(int argc, char *argv[]) {
         {
             //Window Client Create
             case 'e':
-                client_array[started] = client_create(started);
-                if(client_array[started])
+                c = client_create(started);
+                if(c)
                 {
-                    int threadCreate = pthread_create(&(client_array[started]->thread), NULL, client_runner, (void*)client_array[started]);
+                    int threadCreate = client_start(c);
                     if(threadCreate == 0)
                     {
                         fprintf(stderr, "Thread %i Created!\n", started);
@@ -334,15 +711,14 @@ int main(int argc, char *argv[]) {
                 myEfileInput[getlineCharsReadIn - 1] = '\0';
                 myEfileOutput[getlineCharsReadOut - 1] = '\0';
 
-                if(getlineCharsReadOut == 1)
+                //The names are only needed to open the files
+                c = client_create_no_window(myEfileInput,
+                    (getlineCharsReadOut == 1) ? NULL : myEfileOutput, started);
+                free(myEfileInput);
+                free(myEfileOutput);
+                if(c)
                 {
-                    myEfileOutput = 0;
-                }
-
-                client_array[started] = client_create_no_window(myEfileInput,myEfileOutput,started);
-                if(client_array[started])
-                {
-                    int threadCreate = pthread_create(&(client_array[started]->thread), NULL, client_runner, (void*)client_array[started]);
+                    int threadCreate = client_start(c);
                     //fprintf(stderr, "%i\n", threadCreate);
                     if(threadCreate == 0)
                     {  
@@ -360,7 +736,7 @@ int main(int argc, char *argv[]) {
             case 's':
                 //Lock the mutex to prevent the clients from continuing to process
                 pthread_mutex_lock(&mutex_ClientLock);
-                lockDownClients = '1';
+                __atomic_store_n(&lockDownClients, '1', __ATOMIC_RELEASE);
                 pthread_mutex_unlock(&mutex_ClientLock);
             break;
 
@@ -368,34 +744,23 @@ int main(int argc, char *argv[]) {
             case 'g':
                 //Boreadcast condition variable to unlock clients to allow them to continue
                 pthread_mutex_lock(&mutex_ClientLock);
-                lockDownClients = '0';
+                __atomic_store_n(&lockDownClients, '0', __ATOMIC_RELEASE);
                 pthread_mutex_unlock(&mutex_ClientLock);
                 pthread_cond_broadcast(&cond_ClientWait);
             break;
 
-            //Wait for all the threads to terminate and join them
+            //Wait for all the threads to terminate and be joined (the
+            //reaper joins them)
             case 'w':
-                //Goes To find any Threads that need to be joined
-                //Lock Mutex to enter critical section
-                pthread_mutex_lock(&mutex_joinThreads);
-                int j;
-                for(j = 0; j < MAX_SIZE; j++)
-                {
-                    if(threadStatus[j] != '0')
-                    {
-                        //Join the thread
-                        pthread_mutex_unlock(&mutex_joinThreads);
-                        int endedThreadJoin = pthread_join(client_array[j]->thread,NULL);
-                        free(client_array[j]);
-                        if(endedThreadJoin == 0)
-                        {
-                            fprintf(stderr, "Thread %i Terminated and Joined! Service Time: %i milliseconds\n", j, thread_service_times[j]);
-                        }
-                        pthread_mutex_lock(&mutex_joinThreads);
-                        threadStatus[j] = '0';
-                    }
-                }
-                pthread_mutex_unlock(&mutex_joinThreads);
+                clients_wait();
+            break;
+
+            //Show the latencies recorded so far, while clients keep going
+            case 'i':
+                opstats_print(stderr);
+                db_stats(stderr);
+                lockprof_report(stderr, LOCKPROF_TOP);
+                qcache_print(stderr);
             break;
 
             default:
@@ -403,71 +768,51 @@ int main(int argc, char *argv[]) {
             break;
         }
 
-        //Lock Mutex to enter critical section
-        pthread_mutex_lock(&mutex_joinThreads);
-
-        int k;
-        for(k = 0; k < MAX_SIZE; k++)
-        {
-            if(threadStatus[k] == '2')
-            {
-                //Join the thread
-                fprintf(stderr, "Thread %i Terminated, Need to Join! Service Time: %i milliseconds\n", k, thread_service_times[k]);
-
-                int threadJoin = pthread_join(client_array[k]->thread,NULL);
-                free(client_array[k]);
-                threadStatus[k] = '0';
-
-                if(threadJoin == 0)
-                {
-                    fprintf(stderr, "Thread %i Joined!\n", k);
-                }
-            }
-        }
-        //Exit critical section
-        pthread_mutex_unlock(&mutex_joinThreads);
-
         inputCommand = menu();
     }
 
     fprintf(stderr, "\nTerminating.\n");
 
-    //Goes To find any Threads that need to be joined
-    //Lock Mutex to enter critical section
-    pthread_mutex_lock(&mutex_joinThreads);
-    int l;
-    for(l = 0; l < MAX_SIZE; l++)
+    //Wait for every client to finish and be joined
+    clients_wait();
+
+    //Socket clients are not waited for; their connections are just closed
+    if (sock_path) sock_stop();
+
+    if (pool)
     {
-        if(threadStatus[l] != '0')
-        {
-            //Join the thread
-            pthread_mutex_unlock(&mutex_joinThreads);
-            int endedThreadJoin = pthread_join(client_array[l]->thread,NULL);
-            free(client_array[l]);
-            if(endedThreadJoin == 0)
-            {
-                fprintf(stderr, "Thread %i Terminated and Joined! Service Time: %i milliseconds\n", l, thread_service_times[l]);
-            }
-            pthread_mutex_lock(&mutex_joinThreads);
-            threadStatus[l] = '0';
-        }
+        //Every client has finished, so nothing is queued or being polled
+        pthread_mutex_lock(&mutex_poller);
+        poller_stopping = 1;
+        pthread_mutex_unlock(&mutex_poller);
+        if (write(poller_pipe[1], "", 1) == -1) perror("poller wakeup");
+        pthread_join(poller_thread, NULL);
+        pool_destroy(pool);
+        close(poller_pipe[0]);
+        close(poller_pipe[1]);
+        free(poller_new);
     }
+
+    //Nothing is left to finish, so the reaper has nothing left to do
+    pthread_mutex_lock(&mutex_joinThreads);
+    reaper_stopping = 1;
+    pthread_cond_signal(&cond_reap);
     pthread_mutex_unlock(&mutex_joinThreads);
+    pthread_join(reaper_thread, NULL);
+
+    wal_close();
+    trace_close();
 
     /* Clean up the window data */
     //window_cleanup();
 
     //Cleanup Routines
-    //free(myEfileInput);
-    //free(myEfileOutput);
     pthread_mutex_destroy(&mutex_joinThreads);
     pthread_mutex_destroy(&mutex_ClientLock);
     pthread_cond_destroy(&cond_ClientWait);
-    free(client_array);
-    free(threadStatus);
-    free(thread_service_times);
-    free(thread_start_times);
-    free(thread_end_times);
+    pthread_cond_destroy(&cond_clientDone);
+    pthread_cond_destroy(&cond_reap);
+    pthread_mutex_destroy(&mutex_poller);
 
     return 0;
 }
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include "db.h"
+
+/* The number of shards the tree backends split the DB into (see db.h) */
+int db_nshards = 1;
+
+int db_init(int nshards) {
+    if (nshards < 1 || nshards > DB_SHARDS_MAX) return 0;
+    db_nshards = nshards;
+    return 1;
+}
+
+/* The shard name belongs in (FNV-1a) */
+int db_shard(char *name) {
+    unsigned int h = 2166136261u;
+
+    if (db_nshards == 1) return 0;
+    while (*name) h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h % db_nshards;
+}
+
+/*
+ * Split the n pairs in names/values up by shard for db_build().  *pnames and
+ * *pvalues are set to new arrays (for the caller to free) holding the pairs of
+ * shard 0, then those of shard 1 and so on, each in their original order;
+ * shard s's run is start[s] up to start[s + 1], so start must have room for
+ * db_nshards + 1 entries.  Returns 0 if out of memory.
+ */
+int db_partition(char **names, char **values, int n, char ***pnames,
+	char ***pvalues, int *start) {
+    int *shard = (int *) malloc((n ? n : 1) * sizeof(int));
+    char **sn = (char **) malloc((n ? n : 1) * sizeof(char *));
+    char **sv = (char **) malloc((n ? n : 1) * sizeof(char *));
+    int next[DB_SHARDS_MAX];
+    int i, s;
+
+    if (!shard || !sn || !sv) {
+	free(shard);
+	free(sn);
+	free(sv);
+	return 0;
+    }
+    for (s = 0; s <= db_nshards; s++) start[s] = 0;
+    for (i = 0; i < n; i++) start[(shard[i] = db_shard(names[i])) + 1]++;
+    for (s = 0; s < db_nshards; s++) {
+	start[s + 1] += start[s];
+	next[s] = start[s];
+    }
+    for (i = 0; i < n; i++) {
+	sn[next[shard[i]]] = names[i];
+	sv[next[shard[i]]++] = values[i];
+    }
+    free(shard);
+    *pnames = sn;
+    *pvalues = sv;
+    return 1;
+}
+
+/* qsort comparison for batch keys: by shard, then name, then position */
+static int by_shard_name(const void *a, const void *b) {
+    const batch_key_t *x = (const batch_key_t *) a;
+    const batch_key_t *y = (const batch_key_t *) b;
+    int cmp;
+
+    if (x->shard != y->shard) return x->shard - y->shard;
+    if ((cmp = strcmp(x->name, y->name)) != 0) return cmp;
+    return x->i - y->i;
+}
+
+batch_key_t *db_batch_sort(char **names, int n) {
+    batch_key_t *keys = (batch_key_t *) malloc((n ? n : 1) * sizeof(batch_key_t));
+    int i;
+
+    if (!keys) return NULL;
+    for (i = 0; i < n; i++) {
+	keys[i].name = names[i];
+	keys[i].shard = db_shard(names[i]);
+	keys[i].i = i;
+    }
+    qsort(keys, n, sizeof(batch_key_t), by_shard_name);
+    return keys;
+}
+
+/* Pairs db_scan_merge() asks a shard for at a time */
+#define SCAN_BATCH 64
+
+/* One shard's pairs fetched by db_scan_merge() but not yet passed on */
+typedef struct ScanBuf {
+    char *text;		/* name '\0' value '\0' for each pair, back to back */
+    size_t len;
+    size_t size;
+    size_t off[SCAN_BATCH];	/* Where each pair starts in text */
+    int n;		/* Pairs in text */
+    int next;		/* The next one to pass on */
+    int failed;		/* Ran out of memory */
+} scanbuf_t;
+
+/* Batch callback: copy one pair into the buffer */
+static int scan_copy(char *name, char *value, void *arg) {
+    scanbuf_t *b = (scanbuf_t *) arg;
+    size_t nlen = strlen(name) + 1;
+    size_t vlen = strlen(value) + 1;
+
+    if (b->len + nlen + vlen > b->size) {
+	size_t nsize = b->size ? 2 * b->size : 4096;
+	char *ntext;
+
+	while (nsize < b->len + nlen + vlen) nsize *= 2;
+	if (!(ntext = (char *) realloc(b->text, nsize))) {
+	    b->failed = 1;
+	    return 1;
+	}
+	b->text = ntext;
+	b->size = nsize;
+    }
+    b->off[b->n++] = b->len;
+    memcpy(b->text + b->len, name, nlen);
+    memcpy(b->text + b->len + nlen, value, vlen);
+    b->len += nlen + vlen;
+    return 0;
+}
+
+/* Refill shard s's buffer with its next batch.  Returns 0 if out of memory. */
+static int scan_fill(scanbuf_t *b, int s, char *from, int after, char *hi,
+	void (*batch)(int, char *, int, char *, int,
+	    int (*)(char *, char *, void *), void *)) {
+    b->len = b->n = b->next = 0;
+    batch(s, from, after, hi, SCAN_BATCH, scan_copy, b);
+    return !b->failed;
+}
+
+/*
+ * Each shard's pairs are copied out a batch at a time, so its locks are only
+ * held while a batch is copied, and the next pair overall is the least of
+ * the shards' next pairs.  A shard that filled its last batch is asked for
+ * more, starting after the last name it gave, when that batch runs out.
+ */
+long db_scan_merge(char *lo, char *hi, int (*fn)(char *, char *, void *),
+	void *arg, void (*batch)(int, char *, int, char *, int,
+	    int (*)(char *, char *, void *), void *)) {
+    scanbuf_t *bufs = (scanbuf_t *) calloc(db_nshards, sizeof(scanbuf_t));
+    long count = 0;
+    int s, best;
+
+    if (!bufs) return -1;
+    for (s = 0; s < db_nshards; s++)
+	if (!scan_fill(&bufs[s], s, lo, 0, hi, batch)) {
+	    count = -1;
+	    goto done;
+	}
+
+    for (;;) {
+	char *name, *value;
+
+	best = -1;
+	for (s = 0; s < db_nshards; s++) {
+	    scanbuf_t *b = &bufs[s];
+
+	    if (b->next == b->n && b->n == SCAN_BATCH) {
+		/* The batch is about to be overwritten */
+		char *last = strdup(b->text + b->off[b->n - 1]);
+		int ok = last && scan_fill(b, s, last, 1, hi, batch);
+
+		free(last);
+		if (!ok) {
+		    count = -1;
+		    goto done;
+		}
+	    }
+	    if (b->next < b->n && (best < 0 ||
+		    strcmp(b->text + b->off[b->next],
+			bufs[best].text + bufs[best].off[bufs[best].next]) < 0))
+		best = s;
+	}
+	if (best < 0) break;
+
+	name = bufs[best].text + bufs[best].off[bufs[best].next++];
+	value = name + strlen(name) + 1;
+	count++;
+	if (fn(name, value, arg)) break;
+    }
+
+done:
+    for (s = 0; s < db_nshards; s++) free(bufs[s].text);
+    free(bufs);
+    return count;
+}
@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include "slab.h"
+
+/*
+ * Size classes are multiples of 16 up to 256 bytes and then go up by halves
+ * of a power of two to 2048.  Objects are carved out of 64k chunks that are
+ * never returned to the system; freed objects go on the freeing thread's list
+ * for their class.
+ *
+ * When a thread's list for a class gets longer than two batches, one batch is
+ * moved to a global depot, and a thread whose list is empty takes a batch
+ * from the depot before carving a new chunk.  This bounds what one thread can
+ * hoard when objects are allocated by one client and freed by another.  A
+ * thread that exits hands all its lists to the depot.
+ */
+
+#define SMALL_MAX 256
+#define NCLASSES (SMALL_MAX / 16 + 6)
+#define CHUNK_SIZE (64 * 1024)
+/* Objects moved between a thread and the depot at a time */
+#define BATCH 32
+
+/* Byte size of each class */
+static const size_t class_size[NCLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+    384, 512, 768, 1024, 1536, 2048
+};
+
+/* A free object.  The first object of a batch in the depot also links to the
+ * next batch. */
+typedef struct Free {
+    struct Free *next;
+    struct Free *next_batch;
+} free_t;
+
+/* Per thread free lists */
+typedef struct Cache {
+    free_t *list[NCLASSES];
+    int count[NCLASSES];
+} cache_t;
+
+/* Global store of full batches for each class */
+typedef struct Depot {
+    pthread_mutex_t lock;
+    free_t *batches;
+} depot_t;
+
+static depot_t depot[NCLASSES];
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static __thread cache_t *cache = NULL;
+
+/* Size class for size, or -1 if it is too big for any */
+static inline int class_of(size_t size) {
+    int c;
+
+    if (size <= SMALL_MAX) return (size > 0) ? (int) ((size - 1) / 16) : 0;
+    for (c = SMALL_MAX / 16; c < NCLASSES; c++)
+	if (size <= class_size[c]) return c;
+    return -1;
+}
+
+/* Push the first BATCH objects of the thread's list for class c to the
+ * depot. */
+static void push_batch(cache_t *tc, int c) {
+    free_t *first = tc->list[c];
+    free_t *last = first;
+    int i;
+
+    for (i = 1; i < BATCH; i++) last = last->next;
+    tc->list[c] = last->next;
+    tc->count[c] -= BATCH;
+    last->next = NULL;
+
+    pthread_mutex_lock(&depot[c].lock);
+    first->next_batch = depot[c].batches;
+    depot[c].batches = first;
+    pthread_mutex_unlock(&depot[c].lock);
+}
+
+/* Thread exit: give everything back to the depot.  Lists are pushed whole,
+ * so a batch may be shorter than BATCH. */
+static void cache_flush(void *arg) {
+    cache_t *tc = (cache_t *) arg;
+    int c;
+
+    for (c = 0; c < NCLASSES; c++) {
+	if (!tc->list[c]) continue;
+	pthread_mutex_lock(&depot[c].lock);
+	tc->list[c]->next_batch = depot[c].batches;
+	depot[c].batches = tc->list[c];
+	pthread_mutex_unlock(&depot[c].lock);
+    }
+    free(tc);
+    cache = NULL;
+}
+
+static void slab_init(void) {
+    int c;
+
+    for (c = 0; c < NCLASSES; c++) {
+	pthread_mutex_init(&depot[c].lock, NULL);
+	depot[c].batches = NULL;
+    }
+    pthread_key_create(&cache_key, cache_flush);
+}
+
+/* This thread's cache, created on first use.  NULL if out of memory. */
+static cache_t *my_cache(void) {
+    if (cache) return cache;
+    pthread_once(&slab_once, slab_init);
+    if (!(cache = (cache_t *) calloc(1, sizeof(cache_t)))) return NULL;
+    pthread_setspecific(cache_key, cache);
+    return cache;
+}
+
+/* Refill the thread's empty list for class c, from the depot if it has
+ * anything and from a new chunk otherwise.  Return false if out of memory. */
+static int refill(cache_t *tc, int c) {
+    size_t size = class_size[c];
+    free_t *batch;
+    free_t *obj;
+    char *chunk;
+    int n;
+
+    pthread_mutex_lock(&depot[c].lock);
+    if ((batch = depot[c].batches)) depot[c].batches = batch->next_batch;
+    pthread_mutex_unlock(&depot[c].lock);
+
+    if (batch) {
+	for (n = 0, obj = batch; obj; obj = obj->next) n++;
+	tc->list[c] = batch;
+	tc->count[c] = n;
+	return 1;
+    }
+
+    if (!(chunk = (char *) malloc(CHUNK_SIZE))) return 0;
+    for (n = 0; (n + 1) * size <= CHUNK_SIZE; n++) {
+	obj = (free_t *) (chunk + n * size);
+	obj->next = tc->list[c];
+	tc->list[c] = obj;
+    }
+    tc->count[c] = n;
+    return 1;
+}
+
+/* Allocate size bytes.  Return NULL if out of memory. */
+void *slab_alloc(size_t size) {
+    int c = class_of(size);
+    cache_t *tc;
+    free_t *obj;
+
+    if (c < 0) return malloc(size);
+    /* Without a cache, still allocate the full class size for slab_free() */
+    if (!(tc = my_cache())) return malloc(class_size[c]);
+    if (!tc->list[c] && !refill(tc, c)) return NULL;
+
+    obj = tc->list[c];
+    tc->list[c] = obj->next;
+    tc->count[c]--;
+    return obj;
+}
+
+/* Release ptr, which was allocated by slab_alloc(size). */
+void slab_free(void *ptr, size_t size) {
+    int c = class_of(size);
+    cache_t *tc;
+    free_t *obj = (free_t *) ptr;
+
+    if (!ptr) return;
+    if (c < 0) {
+	free(ptr);
+	return;
+    }
+    if (!(tc = my_cache())) {
+	/* No cache to put it on; leave it to the depot */
+	pthread_mutex_lock(&depot[c].lock);
+	obj->next = NULL;
+	obj->next_batch = depot[c].batches;
+	depot[c].batches = obj;
+	pthread_mutex_unlock(&depot[c].lock);
+	return;
+    }
+
+    obj->next = tc->list[c];
+    tc->list[c] = obj;
+    if (++tc->count[c] > 2 * BATCH) push_batch(tc, c);
+}
@@ -0,0 +1,13 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include <stddef.h>
+/*
+ * A small-object allocator for tree nodes and the strings they hold.  Sizes
+ * are rounded up to a size class; each thread keeps its own free list per
+ * class, so allocating and freeing normally touches no shared state.  The
+ * caller passes the size back to slab_free() instead of the allocator keeping
+ * a header on every object.  Sizes beyond the largest class go to malloc.
+ */
+void *slab_alloc(size_t);
+void slab_free(void *, size_t);
+#endif
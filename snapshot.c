@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "db.h"
+#include "snapshot.h"
+
+/*
+ * Snapshot format.  Everything is addressed by file offset, so the file can
+ * be mapped anywhere and used in place:
+ *
+ *   char   magic[8]	SNAP_MAGIC
+ *   uint64 count	number of pairs
+ *   uint64 table	offset of the offset table
+ *   records		count times: name '\0' value '\0'
+ *   uint64 offset[count]	offset of each record, in name order
+ *
+ * The strings are stored with their terminators so a mapped snapshot hands
+ * db_build() ready-made strings without copying anything.
+ */
+#define SNAP_MAGIC "KVSNAP1\n"
+#define SNAP_HEADER 24
+
+/* The pairs collected by db_walk() */
+typedef struct Collect {
+    char *text;		/* name '\0' value '\0' for every pair, back to back */
+    size_t len;
+    size_t size;
+    size_t *offs;	/* Where each pair starts in text */
+    long n;
+    long cap;
+    int failed;		/* Ran out of memory */
+} collect_t;
+
+/* db_walk() callback: copy one pair.  The DB is held still during the walk,
+ * so this does nothing but copy. */
+static int collect(char *name, char *value, void *arg) {
+    collect_t *c = (collect_t *) arg;
+    size_t nlen = strlen(name) + 1;
+    size_t vlen = strlen(value) + 1;
+
+    if (c->len + nlen + vlen > c->size) {
+	size_t nsize = c->size ? 2 * c->size : 1 << 20;
+	char *ntext;
+
+	while (nsize < c->len + nlen + vlen) nsize *= 2;
+	if (!(ntext = (char *) realloc(c->text, nsize))) {
+	    c->failed = 1;
+	    return 1;
+	}
+	c->text = ntext;
+	c->size = nsize;
+    }
+    if (c->n == c->cap) {
+	long ncap = c->cap ? 2 * c->cap : 65536;
+	size_t *noffs = (size_t *) realloc(c->offs, ncap * sizeof(size_t));
+
+	if (!noffs) {
+	    c->failed = 1;
+	    return 1;
+	}
+	c->offs = noffs;
+	c->cap = ncap;
+    }
+    c->offs[c->n++] = c->len;
+    memcpy(c->text + c->len, name, nlen);
+    memcpy(c->text + c->len + nlen, value, vlen);
+    c->len += nlen + vlen;
+    return 0;
+}
+
+/* qsort comparison for pairs, by name */
+static int by_name(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Write a snapshot of the DB to path.  The DB is copied in memory while it is
+ * held still, then sorted (the tree backends hand it over sorted already) and
+ * written out.  The file is written under a temporary name, synced and then
+ * renamed, so path always holds a complete snapshot.
+ */
+long snapshot_write(char *path) {
+    collect_t c;
+    char **pairs = NULL;
+    char tmp[1024];
+    FILE *f = NULL;
+    uint64_t count, table, off;
+    long i;
+    int sorted = 1;
+
+    memset(&c, 0, sizeof(c));
+    db_walk(collect, &c);
+    if (c.failed) goto fail;
+
+    if (c.n && !(pairs = (char **) malloc(c.n * sizeof(char *)))) goto fail;
+    for (i = 0; i < c.n; i++) {
+	pairs[i] = c.text + c.offs[i];
+	if (i > 0 && strcmp(pairs[i - 1], pairs[i]) > 0) sorted = 0;
+    }
+    if (!sorted) qsort(pairs, c.n, sizeof(char *), by_name);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!(f = fopen(tmp, "w"))) goto fail;
+    count = c.n;
+    table = SNAP_HEADER + c.len;
+    if (fwrite(SNAP_MAGIC, 1, 8, f) != 8 ||
+	    fwrite(&count, sizeof(count), 1, f) != 1 ||
+	    fwrite(&table, sizeof(table), 1, f) != 1)
+	goto fail;
+    for (i = 0; i < c.n; i++) {
+	char *value = pairs[i] + strlen(pairs[i]) + 1;
+	size_t len = value + strlen(value) + 1 - pairs[i];
+
+	if (fwrite(pairs[i], 1, len, f) != len) goto fail;
+    }
+    for (i = 0, off = SNAP_HEADER; i < c.n; i++) {
+	char *value = pairs[i] + strlen(pairs[i]) + 1;
+
+	if (fwrite(&off, sizeof(off), 1, f) != 1) goto fail;
+	off += value + strlen(value) + 1 - pairs[i];
+    }
+    if (fflush(f) != 0 || fsync(fileno(f)) == -1) goto fail;
+    if (fclose(f) != 0) {
+	f = NULL;
+	goto fail;
+    }
+    f = NULL;
+    if (rename(tmp, path) == -1) goto fail;
+
+    free(pairs);
+    free(c.text);
+    free(c.offs);
+    return c.n;
+
+fail:
+    perror(path);
+    if (f) {
+	fclose(f);
+	unlink(tmp);
+    }
+    free(pairs);
+    free(c.text);
+    free(c.offs);
+    return -1;
+}
+
+/*
+ * Build the DB from the snapshot at path.  The file is mapped, checked (every
+ * record must lie inside it, be properly terminated and sort after the one
+ * before it) and handed to db_build() straight from the mapping; it is
+ * unmapped again once the DB has its own copies.  The DB must be empty.
+ */
+long snapshot_load(char *path) {
+    struct stat st;
+    char *map = MAP_FAILED;
+    char **names = NULL;
+    char **values = NULL;
+    uint64_t count, table, off;
+    size_t size = 0;
+    long i;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+	perror(path);
+	if (fd != -1) close(fd);
+	return -1;
+    }
+    size = st.st_size;
+    if (size >= SNAP_HEADER)
+	map = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED || memcmp(map, SNAP_MAGIC, 8) != 0) goto bad;
+
+    memcpy(&count, map + 8, sizeof(count));
+    memcpy(&table, map + 16, sizeof(table));
+    if (table < SNAP_HEADER || table > size ||
+	    count > (size - table) / sizeof(uint64_t))
+	goto bad;
+    /* Let the kernel read ahead: the records are used front to back */
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    if (count &&
+	    (!(names = (char **) malloc(count * sizeof(char *))) ||
+	     !(values = (char **) malloc(count * sizeof(char *)))))
+	goto bad;
+    for (i = 0; i < (long) count; i++) {
+	char *nend, *vend;
+
+	memcpy(&off, map + table + i * sizeof(uint64_t), sizeof(off));
+	if (off < SNAP_HEADER || off >= table ||
+		!(nend = (char *) memchr(map + off, '\0', table - off)) ||
+		!(vend = (char *) memchr(nend + 1, '\0', map + table - nend - 1)))
+	    goto bad;
+	names[i] = map + off;
+	values[i] = nend + 1;
+	if (i > 0 && strcmp(names[i - 1], names[i]) >= 0) goto bad;
+    }
+
+    if (!db_build(names, values, (int) count)) {
+	fprintf(stderr, "%s: cannot load a snapshot into a DB that is not "
+		"empty\n", path);
+	count = -1;
+    }
+    free(names);
+    free(values);
+    munmap(map, size);
+    return (long) count;
+
+bad:
+    fprintf(stderr, "%s: not a valid snapshot\n", path);
+    free(names);
+    free(values);
+    if (map != MAP_FAILED) munmap(map, size);
+    return -1;
+}
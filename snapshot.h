@@ -0,0 +1,12 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+/*
+ * Snapshots of the whole DB.  snapshot_write() saves the DB, sorted by name,
+ * to a compact binary file; snapshot_load() maps such a file and builds the
+ * (empty) DB from it in one go with db_build(), which is far quicker than
+ * replaying the commands that made it.  Both return the number of pairs, or
+ * -1 on failure.
+ */
+long snapshot_write(char *);
+long snapshot_load(char *);
+#endif
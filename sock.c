@@ -0,0 +1,355 @@
+/* accept4 */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "sock.h"
+
+/* Bytes of free input buffer a connection reads into at a time */
+#define SOCK_READ 16384
+/* A connection sending a line longer than this is dropped */
+#define SOCK_LINE_MAX (1 << 20)
+/* A connection with this many response bytes unsent is not read from until
+ * they drain, so a client that never reads cannot pile up unbounded output */
+#define SOCK_OUT_MAX (1 << 20)
+/* Events taken from epoll per call */
+#define SOCK_EVENTS 64
+
+/* A client connection.  Each belongs to one event loop for its lifetime. */
+typedef struct Conn {
+    int fd;
+    int id;		/* See sock_client() */
+    char *in;		/* Bytes read but not yet run as commands */
+    size_t in_size;
+    size_t in_len;
+    char *out;		/* Responses not yet written */
+    size_t out_size;
+    size_t out_start;	/* First byte not yet written */
+    size_t out_len;
+    unsigned events;	/* The epoll events currently asked for */
+    int closing;	/* The client is done sending; close once drained */
+    int lost;		/* An extra line of an answer did not fit in memory */
+    struct Conn *prev;
+    struct Conn *next;
+} conn_t;
+
+/* An event loop thread and the connections it serves */
+typedef struct Loop {
+    pthread_t thread;
+    int epfd;
+    conn_t *conns;
+} loop_t;
+
+/* The listening socket and its name in the file system */
+static int listen_fd = -1;
+static char *listen_path = NULL;
+/* Never read; writing a byte to it wakes every loop for good */
+static int stop_pipe[2] = { -1, -1 };
+static loop_t *loops = NULL;
+static int nloops = 0;
+static int (*handler)(char *, char *, int, void (*)(char *, void *), void *);
+/* Number for the next connection */
+static int next_id = SOCK_ID_BASE;
+
+/* Close a connection and release everything it holds */
+static void conn_close(loop_t *loop, conn_t *c) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->prev) c->prev->next = c->next;
+    else loop->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+/* Queue response and a newline for writing to the client.  Returns 0 if
+ * there is no memory for it. */
+static int conn_append(conn_t *c, char *response) {
+    size_t len = strlen(response);
+
+    if (c->out_len + len + 1 > c->out_size) {
+	size_t nsize = c->out_size ? c->out_size : 4096;
+	char *nout;
+
+	while (nsize < c->out_len + len + 1) nsize *= 2;
+	if (!(nout = (char *) realloc(c->out, nsize))) return 0;
+	c->out = nout;
+	c->out_size = nsize;
+    }
+    memcpy(c->out + c->out_len, response, len);
+    c->out[c->out_len + len] = '\n';
+    c->out_len += len + 1;
+    return 1;
+}
+
+/* Queue one of the extra lines of an answer, ahead of its response */
+static void conn_emit(char *line, void *arg) {
+    conn_t *c = (conn_t *) arg;
+
+    if (!conn_append(c, line)) c->lost = 1;
+}
+
+int sock_client(void *arg) {
+    return ((conn_t *) arg)->id;
+}
+
+/* Run command (NUL terminated, newline included if it had one) and queue its
+ * response, after any extra lines it has */
+static int conn_command(conn_t *c, char *command) {
+    char response[256] = { 0 };
+
+    handler(command, response, sizeof(response), conn_emit, c);
+    return conn_append(c, response) && !c->lost;
+}
+
+/* Run every complete line in the input buffer, in order, and keep whatever
+ * partial line follows them.  The byte after each line is saved and restored
+ * around the call so the line can be handed over as a string in place. */
+static int conn_run(conn_t *c) {
+    size_t start = 0;
+    char *nl;
+
+    while ((nl = (char *) memchr(c->in + start, '\n', c->in_len - start))) {
+	char *line = c->in + start;
+	size_t len = nl - line + 1;
+	char saved = line[len];
+	int ok;
+
+	line[len] = '\0';
+	ok = conn_command(c, line);
+	line[len] = saved;
+	if (!ok) return 0;
+	start += len;
+    }
+    if (start > 0) {
+	memmove(c->in, c->in + start, c->in_len - start);
+	c->in_len -= start;
+    }
+    return 1;
+}
+
+/* Write as much pending output as the socket takes, then ask epoll for
+ * what the connection needs next: input only when nothing is pending, input
+ * and room to write while some is, and only room to write once too much is
+ * (or the client has finished sending).  Returns 0 if the connection was
+ * closed. */
+static int conn_flush(loop_t *loop, conn_t *c) {
+    struct epoll_event ev;
+    unsigned events;
+
+    while (c->out_start < c->out_len) {
+	ssize_t sent = send(c->fd, c->out + c->out_start,
+		c->out_len - c->out_start, MSG_NOSIGNAL);
+
+	if (sent > 0) c->out_start += sent;
+	else if (sent == -1 && errno == EINTR) continue;
+	else if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+	else {
+	    conn_close(loop, c);
+	    return 0;
+	}
+    }
+    if (c->out_start == c->out_len) {
+	c->out_start = c->out_len = 0;
+	if (c->closing) {
+	    conn_close(loop, c);
+	    return 0;
+	}
+    }
+
+    if (c->out_len == 0) events = EPOLLIN;
+    else if (c->closing || c->out_len - c->out_start >= SOCK_OUT_MAX)
+	events = EPOLLOUT;
+    else events = EPOLLIN | EPOLLOUT;
+    if (events != c->events) {
+	c->events = events;
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+    return 1;
+}
+
+/* The connection has input (or has been closed by the client): read once,
+ * run the complete commands and send back their responses.  When the client
+ * has stopped sending, a last line without a newline is run as getline would
+ * return it, and the connection closes once its responses are out. */
+static void conn_readable(loop_t *loop, conn_t *c) {
+    ssize_t got;
+
+    if (c->in_size - c->in_len < SOCK_READ + 1) {
+	size_t nsize = c->in_size ? 2 * c->in_size : SOCK_READ + 1;
+	char *nin;
+
+	if (nsize > SOCK_LINE_MAX + SOCK_READ + 1 ||
+		!(nin = (char *) realloc(c->in, nsize))) {
+	    conn_close(loop, c);
+	    return;
+	}
+	c->in = nin;
+	c->in_size = nsize;
+    }
+
+    /* Leave a byte spare so the last line can always be NUL terminated */
+    got = read(c->fd, c->in + c->in_len, c->in_size - c->in_len - 1);
+    if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	return;
+    if (got <= 0) {
+	c->closing = 1;
+	if (c->in_len > 0) {
+	    c->in[c->in_len] = '\0';
+	    conn_command(c, c->in);
+	    c->in_len = 0;
+	}
+    } else {
+	c->in_len += got;
+	if (!conn_run(c)) {
+	    conn_close(loop, c);
+	    return;
+	}
+    }
+    conn_flush(loop, c);
+}
+
+/* Accept a connection waiting on the listener and make it this loop's.  Each
+ * loop takes one at a time, so a burst of connections spreads out. */
+static void sock_accept(loop_t *loop) {
+    struct epoll_event ev;
+    conn_t *c;
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd == -1) return;
+    if (!(c = (conn_t *) calloc(1, sizeof(conn_t)))) {
+	close(fd);
+	return;
+    }
+    c->fd = fd;
+    c->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    c->events = ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+	close(fd);
+	free(c);
+	return;
+    }
+    c->next = loop->conns;
+    if (c->next) c->next->prev = c;
+    loop->conns = c;
+}
+
+/* Event loop thread body.  The listener and the stop pipe are registered
+ * with their own addresses as tags; anything else is a connection. */
+static void *loop_run(void *arg) {
+    loop_t *loop = (loop_t *) arg;
+    struct epoll_event ev[SOCK_EVENTS];
+    int n, i;
+
+    for (;;) {
+	if ((n = epoll_wait(loop->epfd, ev, SOCK_EVENTS, -1)) == -1) {
+	    if (errno == EINTR) continue;
+	    perror("epoll_wait");
+	    break;
+	}
+	for (i = 0; i < n; i++) {
+	    conn_t *c = (conn_t *) ev[i].data.ptr;
+
+	    if (ev[i].data.ptr == (void *) stop_pipe) goto done;
+	    if (ev[i].data.ptr == (void *) &listen_fd) sock_accept(loop);
+	    else if ((ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+		    (c->events & EPOLLOUT) && !conn_flush(loop, c))
+		continue;
+	    else if ((ev[i].events & ~EPOLLOUT) && (c->events & EPOLLIN))
+		conn_readable(loop, c);
+	}
+    }
+done:
+    while (loop->conns) conn_close(loop, loop->conns);
+    return NULL;
+}
+
+/*
+ * Listen on a Unix-domain socket at path and serve connections to it from
+ * nthreads event loops, passing every command to handle.  A stale socket left
+ * at path by an earlier run is replaced; any other file there is an error.
+ * Returns 0 on success and -1 (with the reason printed) on failure.
+ */
+int sock_start(char *path, int nthreads,
+	int (*handle)(char *, char *, int, void (*)(char *, void *), void *)) {
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+    struct stat st;
+    int i = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "socket path too long: %s\n", path);
+	return -1;
+    }
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ||
+	    bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    listen(listen_fd, SOMAXCONN) == -1 ||
+	    pipe(stop_pipe) == -1) {
+	perror(path);
+	goto fail;
+    }
+    if (!(listen_path = strdup(path)) ||
+	    !(loops = (loop_t *) calloc(nthreads, sizeof(loop_t))))
+	goto fail;
+    handler = handle;
+
+    for (i = 0; i < nthreads; i++) {
+	loop_t *loop = &loops[i];
+
+	if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) goto fail;
+	/* Only one loop is woken per incoming connection */
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = (void *) &listen_fd;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) goto fail;
+	ev.events = EPOLLIN;
+	ev.data.ptr = (void *) stop_pipe;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, stop_pipe[0], &ev) == -1) goto fail;
+	if (pthread_create(&loop->thread, NULL, loop_run, loop)) goto fail;
+	nloops++;
+    }
+    return 0;
+
+fail:
+    /* Tear down whatever was started; sock_stop copes with a partial start */
+    if (loops && i < nthreads && loops[i].epfd > 0) close(loops[i].epfd);
+    sock_stop();
+    return -1;
+}
+
+/* Stop serving: close every connection and the listener, remove the socket
+ * from the file system and join the event loops. */
+void sock_stop(void) {
+    int i;
+
+    if (stop_pipe[1] != -1 && write(stop_pipe[1], "", 1) == -1)
+	perror("sock_stop");
+    for (i = 0; i < nloops; i++) {
+	pthread_join(loops[i].thread, NULL);
+	close(loops[i].epfd);
+    }
+    nloops = 0;
+    free(loops);
+    loops = NULL;
+    if (listen_fd != -1) { close(listen_fd); listen_fd = -1; }
+    if (stop_pipe[0] != -1) { close(stop_pipe[0]); stop_pipe[0] = -1; }
+    if (stop_pipe[1] != -1) { close(stop_pipe[1]); stop_pipe[1] = -1; }
+    if (listen_path) { unlink(listen_path); free(listen_path); listen_path = NULL; }
+}
@@ -0,0 +1,25 @@
+#ifndef SOCK_H
+#define SOCK_H
+/*
+ * A front end that serves clients connecting to a Unix-domain stream socket.
+ * Clients send the same newline-terminated commands a window does and get
+ * one response line back per command, in order, after the tab-led extra
+ * lines of a scan.  Connections are spread over
+ * a few event loop threads, each multiplexing its share with epoll, so an
+ * idle connection costs a file descriptor and a small buffer but no thread.
+ *
+ * The handler is called for every command with a response buffer and its
+ * length, the way the window clients call handle_command(), and a function to
+ * pass the command's extra lines to along with its last argument.
+ */
+int sock_start(char *, int,
+	int (*)(char *, char *, int, void (*)(char *, void *), void *));
+void sock_stop(void);
+
+/* The number of the connection a handler call is for, given the argument
+ * passed along with its function.  Connections are numbered in the order
+ * they arrive from SOCK_ID_BASE, above the numbers of the server's own
+ * clients. */
+#define SOCK_ID_BASE 1000000
+int sock_client(void *);
+#endif
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hist.h"
+#include "trace.h"
+
+/* Buffer for the trace stream: records go out in large writes */
+#define TRACE_BUFFER (1 << 20)
+
+/* Protects everything below.  The time is read under it too, so the records
+ * are in time order and the gaps between them are never negative. */
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file = NULL;
+static unsigned long trace_last;	/* Time of the record before */
+static int trace_failed = 0;		/* A write failed; stop recording */
+
+/* Append v as a varint to p, and return the end */
+static unsigned char *put_varint(unsigned char *p, unsigned long v) {
+    while (v >= 0x80) {
+	*p++ = (unsigned char) (v | 0x80);
+	v >>= 7;
+    }
+    *p++ = (unsigned char) v;
+    return p;
+}
+
+/* Read a varint from f into *v.  Returns 0 at the end of the file or on a
+ * varint it ends in the middle of. */
+static int get_varint(FILE *f, unsigned long *v) {
+    int c, shift = 0;
+
+    *v = 0;
+    while ((c = getc(f)) != EOF) {
+	*v |= (unsigned long) (c & 0x7f) << shift;
+	if (!(c & 0x80)) return 1;
+	if ((shift += 7) >= 64) return 0;
+    }
+    return 0;
+}
+
+/* Start recording to path, replacing whatever it holds.  Returns -1 if it
+ * cannot be written. */
+int trace_open(char *path) {
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+	perror(path);
+	return -1;
+    }
+    setvbuf(f, NULL, _IOFBF, TRACE_BUFFER);
+    if (fwrite(TRACE_MAGIC, 1, 8, f) != 8) {
+	perror(path);
+	fclose(f);
+	return -1;
+    }
+    pthread_mutex_lock(&trace_mutex);
+    trace_file = f;
+    trace_last = hist_now();
+    trace_failed = 0;
+    pthread_mutex_unlock(&trace_mutex);
+    return 0;
+}
+
+int trace_enabled(void) {
+    return trace_file != NULL;
+}
+
+/* Record command (up to its newline, if it has one) as sent by client */
+void trace_command(int client, char *command) {
+    unsigned char head[30], *p;
+    size_t len = strcspn(command, "\n");
+    unsigned long now;
+
+    if (!trace_file) return;
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file && !trace_failed) {
+	now = hist_now();
+	p = put_varint(head, now - trace_last);
+	p = put_varint(p, (unsigned long) client);
+	p = put_varint(p, len);
+	trace_last = now;
+	if (fwrite(head, 1, p - head, trace_file) != (size_t) (p - head) ||
+		fwrite(command, 1, len, trace_file) != len) {
+	    perror("trace");
+	    trace_failed = 1;
+	}
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+/* Stop recording and write out what is buffered */
+void trace_close(void) {
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file && fclose(trace_file) != 0) perror("trace");
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+/* Check that f starts with a trace header.  Returns 0 if not. */
+int trace_start(FILE *f) {
+    char magic[8];
+
+    return fread(magic, 1, 8, f) == 8 && memcmp(magic, TRACE_MAGIC, 8) == 0;
+}
+
+/* Read the next record from f into rec.  Returns 1 for a record, 0 at the
+ * end of the trace (or of a trace cut short), and -1 if out of memory. */
+int trace_read(FILE *f, trace_rec_t *rec) {
+    unsigned long delta, client, len;
+
+    if (!get_varint(f, &delta) || !get_varint(f, &client) ||
+	    !get_varint(f, &len))
+	return 0;
+    if (len + 1 > rec->cap) {
+	char *command = (char *) realloc(rec->command, len + 1);
+
+	if (!command) return -1;
+	rec->command = command;
+	rec->cap = len + 1;
+    }
+    if (fread(rec->command, 1, len, f) != len) return 0;
+    rec->command[len] = '\0';
+    rec->len = len;
+    rec->client = client;
+    rec->when += delta;
+    return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdio.h>
+/*
+ * Command traces.  With a trace open, trace_command() records every command
+ * a client sends, with the client's number and when it arrived, to a compact
+ * binary file that replay can play back against a server.  The records are
+ * written in arrival order through one buffered stream, and trace_close()
+ * (or exit) flushes it; a trace cut short by a crash ends at the last
+ * complete record.
+ *
+ * Format: the magic "KVTRACE1", then a record per command, each
+ *
+ *   varint  nanoseconds since the record before (since the trace was opened,
+ *	     for the first)
+ *   varint  client number
+ *   varint  length of the command
+ *   bytes   the command, without its newline
+ *
+ * where a varint is 7 bits a byte, low bits first, with the top bit set on
+ * every byte but the last.
+ */
+#define TRACE_MAGIC "KVTRACE1"
+
+/* A command read back from a trace.  Start with it zeroed: trace_read()
+ * keeps the time running from one record to the next, and grows command (NUL
+ * terminated) as getline (3) would.  Free command when done. */
+typedef struct TraceRec {
+    unsigned long when;		/* Nanoseconds since the trace was opened */
+    unsigned long client;
+    char *command;
+    size_t len;
+    size_t cap;			/* Size of command */
+} trace_rec_t;
+
+int trace_open(char *);
+int trace_enabled(void);
+void trace_command(int, char *);
+void trace_close(void);
+
+int trace_start(FILE *);
+int trace_read(FILE *, trace_rec_t *);
+#endif
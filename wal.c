@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "db.h"
+#include "wal.h"
+#include "lockprof.h"
+#include "qcache.h"
+
+/*
+ * Log format.  The file is a sequence of records, each a header followed by a
+ * payload:
+ *
+ *   uint32 crc		CRC-32 of the payload
+ *   uint32 len		bytes of payload
+ *   uint8  op		WAL_ADD or WAL_REMOVE
+ *   uint32 nlen	bytes of name
+ *   uint32 vlen	bytes of value (0 for a remove)
+ *   name, value	without terminators
+ *
+ * in host byte order.  Only changes that succeeded are logged.  A crash can
+ * leave a partly written record at the end; replay stops at the first record
+ * that is short or fails its CRC and cuts the file back to the last good one.
+ *
+ * Ordering: a change is applied to the DB and appended to the log while
+ * holding a lock picked by hashing its key, so the log holds the changes to
+ * any one key in the order they were made.  Changes to different keys
+ * commute, so replaying the log rebuilds the same DB.
+ *
+ * Group commit: appends go into an in-memory buffer.  A thread that needs
+ * its record on disk becomes the leader if no write is in progress: it takes
+ * the whole buffer, writes it and calls fdatasync without holding the lock.
+ * Everyone else whose record is in that batch just waits for it, and records
+ * appended meanwhile go out with the next leader's batch.
+ */
+
+#define WAL_ADD 1
+#define WAL_REMOVE 2
+
+/* Size of a record header, and of the fixed part of the payload */
+#define WAL_HEADER 8
+#define WAL_FIXED 9
+
+/* Locks that keep applying and logging a change to one key together */
+#define WAL_KEY_LOCKS 256
+
+static int wal_fd = -1;
+static pthread_mutex_t key_locks[WAL_KEY_LOCKS];
+
+/* Protects everything below */
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when a batch reaches the disk */
+static pthread_cond_t wal_durable = PTHREAD_COND_INITIALIZER;
+static char *buf = NULL;		/* Records appended but not yet written */
+static size_t buf_len = 0;
+static size_t buf_size = 0;
+static unsigned long appended = 0;	/* Records appended so far */
+static unsigned long durable = 0;	/* Records known to be on disk */
+static int writing = 0;			/* A leader is writing a batch */
+
+static uint32_t crc_table[256];
+
+/* Fill in the table for the standard (reflected 0xEDB88320) CRC-32 */
+static void crc_init(void) {
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+	for (c = i, k = 0; k < 8; k++)
+	    c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+	crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const char *p, size_t len) {
+    uint32_t c = 0xFFFFFFFF;
+
+    while (len--) c = crc_table[(c ^ (unsigned char) *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+/* The lock for key name (FNV-1a) */
+static pthread_mutex_t *key_lock(char *name) {
+    uint32_t h = 2166136261u;
+
+    while (*name) h = (h ^ (unsigned char) *name++) * 16777619u;
+    return &key_locks[h % WAL_KEY_LOCKS];
+}
+
+/* Append a record to the buffer and return its number.  Running out of
+ * memory for the log is fatal: the change has been made and cannot be
+ * reported without being durable. */
+static unsigned long wal_append(int op, char *name, char *value) {
+    uint32_t nlen = strlen(name);
+    uint32_t vlen = value ? strlen(value) : 0;
+    uint32_t len = WAL_FIXED + nlen + vlen;
+    uint32_t crc;
+    unsigned long lsn;
+    char *p;
+
+    pthread_mutex_lock(&wal_mutex);
+    if (buf_len + WAL_HEADER + len > buf_size) {
+	size_t nsize = buf_size ? buf_size : 65536;
+
+	while (nsize < buf_len + WAL_HEADER + len) nsize *= 2;
+	if (!(p = (char *) realloc(buf, nsize))) {
+	    fprintf(stderr, "wal: out of memory\n");
+	    exit(1);
+	}
+	buf = p;
+	buf_size = nsize;
+    }
+    p = buf + buf_len + WAL_HEADER;
+    *p = op;
+    memcpy(p + 1, &nlen, 4);
+    memcpy(p + 5, &vlen, 4);
+    memcpy(p + WAL_FIXED, name, nlen);
+    if (vlen) memcpy(p + WAL_FIXED + nlen, value, vlen);
+    crc = crc32(p, len);
+    memcpy(buf + buf_len, &crc, 4);
+    memcpy(buf + buf_len + 4, &len, 4);
+    buf_len += WAL_HEADER + len;
+    lsn = ++appended;
+    pthread_mutex_unlock(&wal_mutex);
+    return lsn;
+}
+
+/* Wait until record lsn is on disk, writing it (and whatever else is
+ * buffered) if no other thread is already doing so.  A failed write or sync
+ * is fatal for the same reason as in wal_append(). */
+void wal_sync(unsigned long lsn) {
+    if (lsn == 0) return;
+
+    pthread_mutex_lock(&wal_mutex);
+    while (durable < lsn) {
+	char *batch;
+	size_t len, done;
+	unsigned long upto;
+
+	if (writing) {
+	    pthread_cond_wait(&wal_durable, &wal_mutex);
+	    continue;
+	}
+
+	/* Lead a batch: take the buffer and write it unlocked */
+	writing = 1;
+	batch = buf;
+	len = buf_len;
+	upto = appended;
+	buf = NULL;
+	buf_len = buf_size = 0;
+	pthread_mutex_unlock(&wal_mutex);
+
+	for (done = 0; done < len; ) {
+	    ssize_t w = write(wal_fd, batch + done, len - done);
+
+	    if (w == -1 && errno == EINTR) continue;
+	    if (w == -1) {
+		perror("wal: write");
+		exit(1);
+	    }
+	    done += w;
+	}
+	if (fdatasync(wal_fd) == -1) {
+	    perror("wal: fdatasync");
+	    exit(1);
+	}
+	free(batch);
+
+	pthread_mutex_lock(&wal_mutex);
+	writing = 0;
+	durable = upto;
+	pthread_cond_broadcast(&wal_durable);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+/* Add name/value to the DB and log it if the add succeeded.  Either way,
+ * a successful change makes cached answers for name stale (see qcache.h). */
+int wal_add(char *name, char *value, unsigned long *lsn) {
+    pthread_mutex_t *lock;
+    int added;
+
+    *lsn = 0;
+    if (wal_fd == -1) {
+	if ((added = add(name, value))) qcache_changed(name);
+	return added;
+    }
+
+    lock = key_lock(name);
+    MUTEX_LOCK(lock);
+    if ((added = add(name, value))) {
+	qcache_changed(name);
+	*lsn = wal_append(WAL_ADD, name, value);
+    }
+    MUTEX_UNLOCK(lock);
+    return added;
+}
+
+/* Remove name from the DB and log it if the remove succeeded */
+int wal_remove(char *name, unsigned long *lsn) {
+    pthread_mutex_t *lock;
+    int removed;
+
+    *lsn = 0;
+    if (wal_fd == -1) {
+	if ((removed = xremove(name))) qcache_changed(name);
+	return removed;
+    }
+
+    lock = key_lock(name);
+    MUTEX_LOCK(lock);
+    if ((removed = xremove(name))) {
+	qcache_changed(name);
+	*lsn = wal_append(WAL_REMOVE, name, NULL);
+    }
+    MUTEX_UNLOCK(lock);
+    return removed;
+}
+
+
+/* Lock (or with unlock set, unlock) the key locks of every one of the n
+ * names, each once.  They are taken in address order so that two batches
+ * cannot deadlock. */
+static void key_lock_batch(char **names, int n, int unlock) {
+    char held[WAL_KEY_LOCKS];
+    int i;
+
+    memset(held, 0, sizeof(held));
+    for (i = 0; i < n; i++) held[key_lock(names[i]) - key_locks] = 1;
+    if (unlock) {
+	for (i = WAL_KEY_LOCKS - 1; i >= 0; i--)
+	    if (held[i]) MUTEX_UNLOCK(&key_locks[i]);
+    } else {
+	for (i = 0; i < WAL_KEY_LOCKS; i++)
+	    if (held[i]) MUTEX_LOCK(&key_locks[i]);
+    }
+}
+
+/* Batch versions of wal_add() and wal_remove(), on top of add_batch() and
+ * xremove_batch().  The keys' locks are all held while the batch is applied
+ * and logged, and the records go in in batch order, so the log still holds
+ * the changes to each key in the order they were made. */
+int wal_add_batch(char **names, char **values, int *added, int n,
+	unsigned long *lsn) {
+    int count, i;
+
+    *lsn = 0;
+    if (wal_fd == -1) {
+	count = add_batch(names, values, added, n);
+	for (i = 0; i < n; i++)
+	    if (added[i]) qcache_changed(names[i]);
+	return count;
+    }
+
+    key_lock_batch(names, n, 0);
+    count = add_batch(names, values, added, n);
+    for (i = 0; i < n; i++)
+	if (added[i]) {
+	    qcache_changed(names[i]);
+	    *lsn = wal_append(WAL_ADD, names[i], values[i]);
+	}
+    key_lock_batch(names, n, 1);
+    return count;
+}
+
+int wal_remove_batch(char **names, int *removed, int n, unsigned long *lsn) {
+    int count, i;
+
+    *lsn = 0;
+    if (wal_fd == -1) {
+	count = xremove_batch(names, removed, n);
+	for (i = 0; i < n; i++)
+	    if (removed[i]) qcache_changed(names[i]);
+	return count;
+    }
+
+    key_lock_batch(names, n, 0);
+    count = xremove_batch(names, removed, n);
+    for (i = 0; i < n; i++)
+	if (removed[i]) {
+	    qcache_changed(names[i]);
+	    *lsn = wal_append(WAL_REMOVE, names[i], NULL);
+	}
+    key_lock_batch(names, n, 1);
+    return count;
+}
+
+/* Apply the records in the log open on fd to the DB.  Returns the offset
+ * just past the last good record, and the number of records in *count. */
+static off_t wal_replay(int fd, unsigned long *count) {
+    FILE *f = fdopen(dup(fd), "r");
+    char header[WAL_HEADER];
+    char *payload = NULL;
+    size_t psize = 0;
+    off_t good = 0;
+
+    *count = 0;
+    if (!f) return 0;
+    while (fread(header, 1, WAL_HEADER, f) == WAL_HEADER) {
+	uint32_t crc, len, nlen, vlen;
+	char *name, *value;
+
+	memcpy(&crc, header, 4);
+	memcpy(&len, header + 4, 4);
+	if (len < WAL_FIXED) break;
+	if (len + 1 > psize) {
+	    char *np = (char *) realloc(payload, len + 1);
+
+	    if (!np) break;
+	    payload = np;
+	    psize = len + 1;
+	}
+	if (fread(payload, 1, len, f) != len || crc32(payload, len) != crc)
+	    break;
+	memcpy(&nlen, payload + 1, 4);
+	memcpy(&vlen, payload + 5, 4);
+	if (WAL_FIXED + (size_t) nlen + vlen != len) break;
+
+	/* Make the name and value strings.  The value ends the payload, so
+	 * the spare byte terminates it.  The name is terminated over the
+	 * value's first byte, so the value is copied out first. */
+	name = payload + WAL_FIXED;
+	value = name + nlen;
+	value[vlen] = '\0';
+	if (payload[0] == WAL_ADD) {
+	    char *v = strndup(value, vlen);
+
+	    if (!v) break;
+	    name[nlen] = '\0';
+	    add(name, v);
+	    free(v);
+	} else if (payload[0] == WAL_REMOVE) {
+	    name[nlen] = '\0';
+	    xremove(name);
+	} else break;
+
+	good += WAL_HEADER + len;
+	(*count)++;
+    }
+    fclose(f);
+    free(payload);
+    return good;
+}
+
+/*
+ * Open (creating if need be) the log at path, replay it into the DB and keep
+ * it open for appending.  Must be called before any client is served.  A
+ * damaged tail is cut off.  Returns 0 on success and -1 on failure.
+ */
+int wal_open(char *path) {
+    unsigned long count;
+    struct stat st;
+    off_t good;
+    int i;
+
+    crc_init();
+    for (i = 0; i < WAL_KEY_LOCKS; i++) pthread_mutex_init(&key_locks[i], NULL);
+
+    if ((wal_fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) {
+	perror(path);
+	return -1;
+    }
+    good = wal_replay(wal_fd, &count);
+    if (fstat(wal_fd, &st) == 0 && st.st_size > good) {
+	fprintf(stderr, "wal: dropping %ld damaged bytes at the end of %s\n",
+		(long) (st.st_size - good), path);
+	if (ftruncate(wal_fd, good) == -1) {
+	    perror(path);
+	    close(wal_fd);
+	    wal_fd = -1;
+	    return -1;
+	}
+    }
+    if (lseek(wal_fd, good, SEEK_SET) == -1) {
+	perror(path);
+	close(wal_fd);
+	wal_fd = -1;
+	return -1;
+    }
+    fprintf(stderr, "wal: replayed %lu records from %s\n", count, path);
+    return 0;
+}
+
+/* Whether a log is open */
+int wal_enabled(void) {
+    return wal_fd != -1;
+}
+
+/* Write out anything still buffered and close the log */
+void wal_close(void) {
+    if (wal_fd == -1) return;
+    wal_sync(appended);
+    close(wal_fd);
+    wal_fd = -1;
+}
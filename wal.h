@@ -0,0 +1,27 @@
+#ifndef WAL_H
+#define WAL_H
+/*
+ * Write-ahead log.  When a log is open, every add and remove that changes the
+ * DB is appended to it, and the change is only reported once the log has
+ * reached the disk.  Appends from all threads are batched so that one
+ * fdatasync covers every change that arrived while the previous one was in
+ * progress.  On startup the log is replayed into the (empty) DB before any
+ * client is served.
+ *
+ * wal_add() and wal_remove() apply the change and log it, and just apply it
+ * when no log is open.  They return what add() and xremove() do, and set
+ * *lsn to the record to wait for with wal_sync() before answering (0 when
+ * nothing was logged).  Waiting is separate so that a caller applying many
+ * changes can wait once for all of them.  wal_add_batch() and
+ * wal_remove_batch() do the same for add_batch() and xremove_batch().
+ * Every change they make is passed on to qcache_changed().
+ */
+int wal_open(char *);
+void wal_close(void);
+int wal_add(char *, char *, unsigned long *);
+int wal_remove(char *, unsigned long *);
+int wal_add_batch(char **, char **, int *, int, unsigned long *);
+int wal_remove_batch(char **, int *, int, unsigned long *);
+void wal_sync(unsigned long);
+int wal_enabled(void);
+#endif
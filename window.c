@@ -12,9 +12,15 @@
 #include <signal.h>
 #include <string.h>
 #include <dirent.h>
+#include <time.h>
+#include <sys/wait.h>
 #include "window.h"
+#include "ring.h"
 
 #define FNLEN 256
+/* Output buffer size for windows.  Responses are flushed when the window runs
+ * out of input, so this bounds how much of a burst goes out in one write. */
+#define OBUF_SIZE 65536
 
 /* Number of windows created so far.  Used to keep fifo names distinct */
 int window_count = 0;
@@ -22,6 +28,15 @@ int window_count = 0;
 char *tmpdir= NULL;
 /* A template for mkdtemp (3) to create the temp dir */
 static char *template = "/tmp/serverXXXXXX";
+/* Whether new interactive windows talk through rings rather than fifos */
+static int use_rings = 0;
+
+/* Have the windows created from now on exchange commands and responses with
+ * their interface process through a pair of shared memory rings (see ring.h)
+ * instead of a pair of fifos.  This is not thread-safe. */
+void window_use_rings(int on) {
+    use_rings = on;
+}
 
 /* Create the temporary directory that holds this server's named pipes (fifos).
  * That directory is stored in the global tmpdir variable.  This is not
@@ -76,28 +91,53 @@ window_t *window_create(char *label) {
     new_window->out = 0;
     new_window->pid = -1;
     new_window->echo = 0;
+    new_window->ibuf = NULL;
+    new_window->ibuf_size = new_window->ibuf_start = new_window->ibuf_end = 0;
+    new_window->ieof = 0;
+    new_window->ring = NULL;
 
-    if (!create_fifos(new_window)) goto fail;
+    if (use_rings) {
+	if (!(new_window->ring = ring_create())) goto fail;
+    } else if (!create_fifos(new_window)) goto fail;
     window_count++;
 
-    /* Start an interface process and connect to it through the fifos */
+    /* Start an interface process and connect to it through fifos or a ring */
     new_window->pid = fork();
     if (new_window->pid == -1) {
 	/* Fork failed.  There is no child and we're giving up */
 	fprintf(stderr, "could not create process for new window\n");
 	goto fail;
     } else if (new_window->pid == 0) {
-	/* This is the child.  Run xterm in this address space */
+	/* This is the child.  Run xterm in this address space, telling the
+	 * interface the fifos' names or the ring's. */
+	char *arg1 = (new_window->ring) ? "-r" : new_window->ififo;
+	char *arg2 = (new_window->ring) ?
+	    ring_name(new_window->ring) : new_window->ofifo;
+
 	if (execlp("xterm", "xterm", "-T", label, "-n", label, "-ut",
 		   "-geometry", "35x20",
 		   "-e", "./interface",
-		   new_window->ififo, new_window->ofifo, 
+		   arg1, arg2, 
 		   (char *)NULL) == -1) {
 		perror("exec of xterm failed");
 		exit(1);
 	}
 	perror("exec somehow failed");
 	exit(1);
+    } else if (new_window->ring) {
+	/* The same handshake over a ring: wait for the interface to attach,
+	 * giving up if xterm exits first. */
+	struct timespec pause = { 0, 10000000 };
+
+	while (!ring_attached(new_window->ring)) {
+	    if (waitpid(new_window->pid, NULL, WNOHANG) == new_window->pid) {
+		new_window->pid = -1;
+		goto fail;
+	    }
+	    nanosleep(&pause, NULL);
+	}
+	if (!(new_window->out = ring_fopen(new_window->ring, "w"))) goto fail;
+	setvbuf(new_window->out, NULL, _IOFBF, OBUF_SIZE);
     } else {
 	/* This is the parent. Open the input/output streams and fail if we
 	 * cannot. NB: fail includes killing the child. 
@@ -110,6 +150,7 @@ window_t *window_create(char *label) {
 	 */
 	if (!(new_window->in = fopen(new_window->ififo, "r"))) goto fail;
 	if (!(new_window->out = fopen(new_window->ofifo, "w"))) goto fail;
+	setvbuf(new_window->out, NULL, _IOFBF, OBUF_SIZE);
     }
     return new_window;
 
@@ -130,14 +171,21 @@ window_t *nowindow_create(char *infn, char *outfn) {
     if (!new_window) return 0;
     new_window->ififo = NULL;
     new_window->ofifo = NULL;
+    new_window->in = NULL;
+    new_window->out = NULL;
     new_window->pid = -1;
     new_window->echo = 1;
+    new_window->ibuf = NULL;
+    new_window->ibuf_size = new_window->ibuf_start = new_window->ibuf_end = 0;
+    new_window->ieof = 0;
+    new_window->ring = NULL;
 
     if ( !(new_window->in = fopen(infn, "r")) || 
 	    !(new_window->out = fopen(outfn, "w"))) {
 	window_destroy(new_window);
 	return NULL;
     }
+    setvbuf(new_window->out, NULL, _IOFBF, OBUF_SIZE);
     window_count++;
     new_window->pid = -1;
     return new_window;
@@ -145,7 +193,8 @@ window_t *nowindow_create(char *infn, char *outfn) {
 
 /*
  * Release window resources.  If fifos were created, delete them, if a process
- * was created, terminate it, close open files.  Release memory, including win.
+ * was created, terminate it, close open files and unmap any ring.  Release
+ * memory, including win.
  */
 void window_destroy(window_t * win) {
     if (!win) return;
@@ -154,25 +203,164 @@ void window_destroy(window_t * win) {
     if (win->ofifo) { unlink(win->ofifo); free(win->ofifo);win->ofifo = NULL; }
     if (win->in) { fclose(win->in); win->in = NULL; }
     if (win->out) { fclose(win->out); win->out = NULL; }
+    if (win->ring) { ring_destroy(win->ring); win->ring = NULL; }
+    free(win->ibuf);
     free(win);
 }
 
-/* The main interface for the server to interact with a window.  If query
- * points to a string (a non-NULL char *) and the window has echo set, print
- * that query to the output connection.  If response is longer than zero, print
- * that too.  Then wait for the next command.  getline will manage memory for
- * arbitrary sized queries.  This is safe to call from a thread *if* that is
- * the only thread with access to window and the other parameters.
+/* The main interface for the server to interact with a window.  If response
+ * is longer than zero, print it to the output connection.  Then wait for the
+ * next command, which is echoed to the output if the window has echo set.  The
+ * echo is written as the command is read, so the caller is free to modify the
+ * command while carrying it out.  query is managed the way getline
+ * manages it, so queries can be arbitrarily long.  This is safe to call from a
+ * thread *if* that is the only thread with access to window and the other
+ * parameters.
  *
- * The function returns the return code of getline - notably -1 on end of input.
+ * Commands the other side has already sent are handed out straight from the
+ * window's input buffer, and the output is only flushed when there are none
+ * left and serve is about to wait.  A client that sends a burst of commands
+ * gets the responses to the whole burst in one write, in order, instead of a
+ * flush and a read per command.
+ *
+ * The function returns what getline would - notably -1 on end of input.
  */
 int serve(window_t * window, char *response, char **query, size_t *qlen) {
-    if ( window->echo && *query) 
-	fprintf(window->out, ">> %s", *query);
+    ssize_t len;
+
     if (strlen(response) > 0 ) 
 	fprintf(window->out, "%s\n", response);
+
+    while ((len = window_getline(window, query, qlen)) == 0) {
+	fflush(window->out);
+	if (window_fill(window) == -1 && errno != EINTR) return -1;
+    }
+    if (len < 0) fflush(window->out);
+    return len;
+}
+
+/*
+ * The routines below read the window's input with read(2) into a buffer in
+ * the window.  serve() is built on them, and they can also be used directly,
+ * without serve(), by callers that multiplex many windows over a few threads.
+ * For those, the usual pattern is: wait for
+ * window_fd() to be readable, call window_fill() once, then take lines with
+ * window_getline() until it returns 0, answering each with window_reply(),
+ * and finish with window_flush().
+ */
+
+/* Initial size of the window's input buffer */
+#define IBUF_INIT 4096
+
+/* Return the file descriptor the window's input arrives on, switched to
+ * non-blocking mode so that window_fill() never waits.  A window whose input
+ * comes through a ring has none; -1 is returned. */
+int window_fd(window_t *window) {
+    int fd, flags;
+
+    if (window->ring) return -1;
+    fd = fileno(window->in);
+    flags = fcntl(fd, F_GETFL);
+
+    if (flags != -1 && !(flags & O_NONBLOCK))
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    return fd;
+}
+
+/* Read whatever input is available into the window's buffer, making room as
+ * needed.  If the window's input is in blocking mode (it is unless
+ * window_fd() was called) this waits for input.  Returns the number of bytes
+ * read, 0 at end of input (a read error other than having nothing to read
+ * counts as end of input too) and -1 with errno set if there was nothing to
+ * read or no memory to read it into. */
+int window_fill(window_t *window) {
+    ssize_t got;
+
+    if (window->ieof) return 0;
+
+    /* Move the unread bytes to the front, then grow if still full */
+    if (window->ibuf_start > 0) {
+	memmove(window->ibuf, window->ibuf + window->ibuf_start,
+		window->ibuf_end - window->ibuf_start);
+	window->ibuf_end -= window->ibuf_start;
+	window->ibuf_start = 0;
+    }
+    if (window->ibuf_end == window->ibuf_size) {
+	size_t nsize = window->ibuf_size ? 2 * window->ibuf_size : IBUF_INIT;
+	char *nbuf = (char *) realloc(window->ibuf, nsize);
+
+	if (!nbuf) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	window->ibuf = nbuf;
+	window->ibuf_size = nsize;
+    }
+
+    if (window->ring)
+	got = ring_read(window->ring, window->ibuf + window->ibuf_end,
+		window->ibuf_size - window->ibuf_end, 1);
+    else
+	got = read(fileno(window->in), window->ibuf + window->ibuf_end,
+		window->ibuf_size - window->ibuf_end);
+    if (got > 0) {
+	window->ibuf_end += got;
+	return got;
+    }
+    if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	return -1;
+    window->ieof = 1;
+    return 0;
+}
+
+/* Copy the next complete line of buffered input into *line, which is grown as
+ * getline (3) would grow it, and return its length including the newline.
+ * Once the input has ended, a last line without a newline is returned as is.
+ * If the window echoes, the line is echoed to its output as it is handed out.
+ * Returns 0 if there is no complete line buffered and -1 if the input has
+ * ended and everything has been handed out. */
+ssize_t window_getline(window_t *window, char **line, size_t *cap) {
+    char *start = window->ibuf + window->ibuf_start;
+    size_t avail = window->ibuf_end - window->ibuf_start;
+    char *nl = avail ? (char *) memchr(start, '\n', avail) : NULL;
+    size_t len;
+
+    if (nl) len = nl - start + 1;
+    else if (window->ieof && avail) len = avail;
+    else return (window->ieof) ? -1 : 0;
+
+    if (!*line || *cap < len + 1) {
+	char *nline = (char *) realloc(*line, len + 1);
+
+	if (!nline) return -1;
+	*line = nline;
+	*cap = len + 1;
+    }
+    memcpy(*line, start, len);
+    (*line)[len] = '\0';
+    window->ibuf_start += len;
+    if (window->echo)
+	fprintf(window->out, ">> %s", *line);
+    return len;
+}
+
+/* Write response to the window the same way serve() does, but leave it
+ * buffered until window_flush(). */
+void window_reply(window_t *window, char *response) {
+    if (strlen(response) > 0)
+	fprintf(window->out, "%s\n", response);
+}
+
+/* Write one of the extra lines of an answer (see interpret_stream()) to the
+ * window passed as arg, ahead of the response proper.  It stays buffered
+ * along with the response. */
+void window_emit(char *line, void *arg) {
+    fprintf(((window_t *) arg)->out, "%s\n", line);
+}
+
+/* Push the replies written so far out to the window */
+void window_flush(window_t *window) {
     fflush(window->out);
-    return getline(query, qlen, window->in);
 }
 
 /* Cleanup the tmp dir.  Remove all the fifos in it and then remove tmpdir.
@@ -1,14 +1,33 @@
 typedef struct window {
-	FILE *in;
+	FILE *in;		/* NULL when input comes through ring */
 	FILE *out;
 	int pid;
 	char *ififo;
 	char *ofifo;
 	int echo;
+	/* Input read with window_fill() but not yet handed out by
+	 * window_getline().  Only used by callers that never call serve(). */
+	char *ibuf;
+	size_t ibuf_size;
+	size_t ibuf_start;	/* First byte not yet handed out */
+	size_t ibuf_end;	/* One past the last byte read */
+	int ieof;		/* The other side has closed its end */
+	/* With window_use_rings() on, an interactive window's commands and
+	 * responses go through shared memory instead of fifos, and out writes
+	 * to the ring.  Such a window has no window_fd(). */
+	struct RingPair *ring;
 } window_t;
 
+void window_use_rings(int);
+
 window_t *window_create(char *);
 window_t *nowindow_create(char *, char *);
 void window_destroy(window_t *);
 int serve(window_t *, char *, char **, size_t*);
+int window_fd(window_t *);
+int window_fill(window_t *);
+ssize_t window_getline(window_t *, char **, size_t *);
+void window_reply(window_t *, char *);
+void window_emit(char *, void *);
+void window_flush(window_t *);
 void window_cleanup();
@@ -1,5 +1,13 @@
 #ifndef WORDS_H
 #define WORDS_H
-char **split_words(char *);
-void free_words(char **);
+/* Longest word tokenize() hands out; longer ones are cut off */
+#define WORD_MAX 255
+
+/* A word found by tokenize(): where it starts in the line, and its length */
+typedef struct Word {
+    char *p;
+    int len;
+} word_t;
+
+int tokenize(char *, word_t *, int);
 #endif